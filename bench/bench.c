@@ -0,0 +1,126 @@
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The allocations are counted by wrapping the allocator at link time (-Wl,--wrap=malloc, see the Makefile), so the
+// allocations made inside the C library (fopen...) are not counted
+
+static uint64_t allocations_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    ++allocations_count;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    ++allocations_count;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    ++allocations_count;
+    return __real_realloc(pointer, size);
+}
+
+/*!
+ * @brief init_bench_config initializes the benchmark configuration with default values
+ * @param config is a pointer to the configuration
+ */
+void init_bench_config(bench_config_t *config) {
+    config->warmup_runs = BENCH_DEFAULT_WARMUP_RUNS;
+    config->runs = BENCH_DEFAULT_RUNS;
+    config->csv = false;
+}
+
+/*!
+ * @brief bench_allocations_count gives the number of allocations since the start of the program
+ * @return the allocations count
+ */
+uint64_t bench_allocations_count(void) {
+    return allocations_count;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compare_doubles(const void *lhd, const void *rhd) {
+    double difference = *(const double *) lhd - *(const double *) rhd;
+    return (difference > 0) - (difference < 0);
+}
+
+/*!
+ * @brief bench_print_header prints the columns of the results
+ * @param config is a pointer to the configuration
+ */
+void bench_print_header(bench_config_t *config) {
+    if (config->csv) {
+        printf("name,size,median_ns_per_op,p99_ns_per_op,allocs_per_op,mb_per_s\n");
+    } else {
+        printf("%-32s %10s %14s %14s %10s %10s\n", "name", "size", "median ns/op", "p99 ns/op", "allocs/op", "MB/s");
+    }
+}
+
+/*!
+ * @brief bench_run measures a case and prints its result
+ * Each run is measured as a whole and divided by its operations count. The median and the 99th percentile are
+ * computed on the runs (with few runs, the 99th percentile is the slowest run).
+ * @param bench_case is the case to measure
+ * @param context is given to the functions of the case
+ * @param size is the size of the case (entries count, bytes...), given to the functions of the case
+ * @param config is a pointer to the configuration
+ * @return the result of the case
+ */
+bench_result_t bench_run(bench_case_t *bench_case, void *context, size_t size, bench_config_t *config) {
+    bench_result_t result = {0, 0, 0};
+    double *samples = __real_malloc(config->runs * sizeof(double));
+    if (samples == NULL) {
+        return result;
+    }
+    uint64_t total_allocations = 0;
+    size_t total_ops = 0;
+    for (size_t run=0; run<config->warmup_runs + config->runs; ++run) {
+        if (bench_case->setup != NULL) {
+            bench_case->setup(context, size);
+        }
+        uint64_t allocations_before = allocations_count;
+        uint64_t start = now_ns();
+        size_t ops = bench_case->body(context, size);
+        uint64_t elapsed = now_ns() - start;
+        uint64_t allocations = allocations_count - allocations_before;
+        if (bench_case->teardown != NULL) {
+            bench_case->teardown(context, size);
+        }
+        if (run >= config->warmup_runs && ops > 0) {
+            samples[run - config->warmup_runs] = (double) elapsed / ops;
+            total_allocations += allocations;
+            total_ops += ops;
+        }
+    }
+
+    qsort(samples, config->runs, sizeof(double), compare_doubles);
+    result.median_ns = samples[config->runs / 2];
+    size_t p99_index = (config->runs * 99 + 99) / 100 - 1;
+    result.p99_ns = samples[p99_index < config->runs ? p99_index : config->runs - 1];
+    result.allocations = total_ops > 0 ? (double) total_allocations / total_ops : 0;
+    free(samples);
+
+    double throughput = bench_case->bytes_per_op > 0 ? bench_case->bytes_per_op * 1e3 / result.median_ns : 0;
+    if (config->csv) {
+        printf("%s,%zu,%.1f,%.1f,%.2f,%.1f\n", bench_case->name, size, result.median_ns, result.p99_ns, result.allocations, throughput);
+    } else if (bench_case->bytes_per_op > 0) {
+        printf("%-32s %10zu %14.1f %14.1f %10.2f %10.1f\n", bench_case->name, size, result.median_ns, result.p99_ns, result.allocations, throughput);
+    } else {
+        printf("%-32s %10zu %14.1f %14.1f %10.2f %10s\n", bench_case->name, size, result.median_ns, result.p99_ns, result.allocations, "-");
+    }
+    fflush(stdout);
+    return result;
+}
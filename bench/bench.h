@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_DEFAULT_WARMUP_RUNS 3
+#define BENCH_DEFAULT_RUNS 31
+
+typedef void (*bench_prepare_t)(void *context, size_t size);
+typedef size_t (*bench_body_t)(void *context, size_t size);
+
+typedef struct {
+    char *name;
+    bench_prepare_t setup; // Before each run, not measured (may be NULL)
+    bench_body_t body; // One measured run, returns the number of operations it made
+    bench_prepare_t teardown; // After each run, not measured (may be NULL)
+    size_t bytes_per_op; // When not 0, the throughput is displayed too
+} bench_case_t;
+
+typedef struct {
+    size_t warmup_runs;
+    size_t runs;
+    bool csv;
+} bench_config_t;
+
+typedef struct {
+    double median_ns; // Per operation
+    double p99_ns; // Per operation
+    double allocations; // Per operation
+} bench_result_t;
+
+void init_bench_config(bench_config_t *config);
+uint64_t bench_allocations_count(void);
+void bench_print_header(bench_config_t *config);
+bench_result_t bench_run(bench_case_t *bench_case, void *context, size_t size, bench_config_t *config);
@@ -0,0 +1,317 @@
+#include "bench.h"
+#include <files-list.h>
+#include <messages.h>
+#include <utility.h>
+#include <file-properties.h>
+#include <md5-multi.h>
+
+#include <openssl/evp.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/msg.h>
+#include <unistd.h>
+
+// Micro-benchmarks of the building blocks of the synchronization (make microbench)
+// Options: -r <runs> -w <warmup runs> -s <max size> -c (CSV output)
+
+#define PATH_STRIDE 32 // Generated paths are like /d0001/f00000001
+#define LOOKUPS_PER_RUN 1000
+#define MAX_MESSAGES_PER_RUN 100000
+#define MD5_FILE_SIZE (64 << 20)
+
+typedef struct {
+    char *paths; // Paths in lexical order, every PATH_STRIDE bytes
+    files_list_t list;
+    int msg_queue;
+    char file_path[PATH_SIZE];
+    size_t buffer_size; // Of md5_read_loop
+    uint8_t *small_files; // MD5_BATCH_FILES contents of small_file_size bytes, hashed by the md5 batch cases
+    size_t small_file_size;
+} microbench_context_t;
+
+static size_t sizes[] = {1000, 100000, 10000000};
+
+static char *path_at(microbench_context_t *context, size_t index) {
+    return context->paths + index * PATH_STRIDE;
+}
+
+static void generate_paths(microbench_context_t *context, size_t count) {
+    for (size_t i=0; i<count; ++i) {
+        snprintf(path_at(context, i), PATH_STRIDE, "/d%04u/f%08u", (unsigned) (i / 1000 % 10000), (unsigned) (i % 100000000));
+    }
+}
+
+/*!
+ * @brief fits_in_memory tells if a list of size entries can be built without swapping
+ */
+static bool fits_in_memory(size_t size) {
+    uint64_t physical = (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    return (uint64_t) size * (sizeof(files_list_entry_t) + 32) < physical / 2;
+}
+
+static void build_list(void *context, size_t size) {
+    microbench_context_t *bench_context = context;
+    for (size_t i=0; i<size; ++i) {
+        add_file_entry(&bench_context->list, path_at(bench_context, i));
+    }
+}
+
+static void clear_list(void *context, size_t size) {
+    (void) size;
+    clear_files_list(&((microbench_context_t *) context)->list);
+}
+
+static size_t add_file_entry_body(void *context, size_t size) {
+    build_list(context, size);
+    return size;
+}
+
+static size_t find_entry_by_name_body(void *context, size_t size) {
+    microbench_context_t *bench_context = context;
+    size_t lookups = size < LOOKUPS_PER_RUN ? size : LOOKUPS_PER_RUN;
+    size_t found = 0;
+    for (size_t i=0; i<lookups; ++i) {
+        found += find_entry_by_name(&bench_context->list, path_at(bench_context, i * (size / lookups)), 0, 0) != NULL;
+    }
+    return found;
+}
+
+static size_t find_next_entry_by_name_body(void *context, size_t size) {
+    microbench_context_t *bench_context = context;
+    files_list_entry_t *cursor = bench_context->list.head;
+    size_t found = 0;
+    for (size_t i=0; i<size; ++i) {
+        found += find_next_entry_by_name(&cursor, path_at(bench_context, i), 0, 0) != NULL;
+    }
+    return found;
+}
+
+static size_t clear_files_list_body(void *context, size_t size) {
+    clear_list(context, size);
+    return size;
+}
+
+static size_t concat_path_body(void *context, size_t size) {
+    microbench_context_t *bench_context = context;
+    char result[PATH_SIZE];
+    for (size_t i=0; i<size; ++i) {
+        concat_path(result, "/home/user/source", path_at(bench_context, i) + 1);
+    }
+    return size;
+}
+
+static size_t message_round_trip_body(void *context, size_t size) {
+    microbench_context_t *bench_context = context;
+    files_list_entry_t entry;
+    memset(&entry, 0, sizeof(files_list_entry_t));
+    files_list_entry_transmit_t message;
+    size_t count = size < MAX_MESSAGES_PER_RUN ? size : MAX_MESSAGES_PER_RUN;
+    for (size_t i=0; i<count; ++i) {
+        strcpy(entry.path_and_name, path_at(bench_context, i));
+        send_file_entry(bench_context->msg_queue, MSG_TYPE_TO_MAIN, &entry, COMMAND_CODE_FILE_ENTRY);
+        if (msgrcv(bench_context->msg_queue, &message, sizeof(message) - sizeof(long), MSG_TYPE_TO_MAIN, 0) == -1) {
+            return i;
+        }
+    }
+    return count;
+}
+
+static size_t compute_file_md5_body(void *context, size_t size) {
+    (void) size;
+    files_list_entry_t entry;
+    memset(&entry, 0, sizeof(files_list_entry_t));
+    strcpy(entry.path_and_name, ((microbench_context_t *) context)->file_path);
+    return compute_file_md5(&entry) == 0 ? 1 : 0;
+}
+
+/*!
+ * @brief md5_read_loop_body is the loop of compute_file_md5 with another buffer size, to choose it
+ */
+static size_t md5_read_loop_body(void *context, size_t size) {
+    (void) size;
+    microbench_context_t *bench_context = context;
+    FILE *file = fopen(bench_context->file_path, "rb");
+    unsigned char *buffer = malloc(bench_context->buffer_size);
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    size_t ops = 0;
+    if (file != NULL && buffer != NULL && mdctx != NULL && EVP_DigestInit_ex(mdctx, EVP_md5(), NULL) == 1) {
+        setvbuf(file, NULL, _IONBF, 0);
+        size_t bytes;
+        while ((bytes = fread(buffer, 1, bench_context->buffer_size, file)) != 0) {
+            EVP_DigestUpdate(mdctx, buffer, bytes);
+        }
+        unsigned char md5sum[16];
+        unsigned int md_len;
+        ops = EVP_DigestFinal_ex(mdctx, md5sum, &md_len) == 1 ? 1 : 0;
+    }
+    EVP_MD_CTX_free(mdctx);
+    free(buffer);
+    if (file != NULL) {
+        fclose(file);
+    }
+    return ops;
+}
+
+/*!
+ * @brief md5_evp_batch_body hashes a batch of small files one after the other with EVP, as compute_file_md5 does
+ */
+static size_t md5_evp_batch_body(void *context, size_t size) {
+    (void) size;
+    microbench_context_t *bench_context = context;
+    unsigned char md5sum[16];
+    for (size_t i=0; i<MD5_BATCH_FILES; ++i) {
+        EVP_Digest(bench_context->small_files + i * bench_context->small_file_size, bench_context->small_file_size,
+                   md5sum, NULL, EVP_md5(), NULL);
+    }
+    return 1;
+}
+
+/*!
+ * @brief md5_multi_batch_body hashes a batch of small files at once with the multi-buffer kernel in use
+ */
+static size_t md5_multi_batch_body(void *context, size_t size) {
+    (void) size;
+    microbench_context_t *bench_context = context;
+    uint8_t md5sums[MD5_BATCH_FILES][16];
+    md5_job_t jobs[MD5_BATCH_FILES];
+    for (size_t i=0; i<MD5_BATCH_FILES; ++i) {
+        jobs[i] = (md5_job_t) {bench_context->small_files + i * bench_context->small_file_size,
+                               bench_context->small_file_size, md5sums[i]};
+    }
+    md5_hash_jobs(jobs, MD5_BATCH_FILES);
+    return 1;
+}
+
+/*!
+ * @brief write_test_file creates a file of pseudo-random content (it stays in the page cache)
+ * @return 0 on success, -1 else
+ */
+static int write_test_file(char *path, size_t size) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    uint32_t state = 2463534242u;
+    for (size_t i=0; i<size; i+=sizeof(state)) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        fwrite(&state, sizeof(state), 1, file);
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    bench_config_t config;
+    init_bench_config(&config);
+    size_t max_size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:s:c")) != -1) {
+        switch (opt) {
+            case 'r':
+                config.runs = strtoul(optarg, NULL, 10) > 0 ? strtoul(optarg, NULL, 10) : 1;
+                break;
+            case 'w':
+                config.warmup_runs = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                max_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                config.csv = true;
+                break;
+            default:
+                fprintf(stderr, "%s [-r runs] [-w warmup runs] [-s max size] [-c]\n", argv[0]);
+                return -1;
+        }
+    }
+
+    microbench_context_t context = {.list = {NULL, NULL}};
+    context.paths = malloc(max_size * PATH_STRIDE);
+    context.msg_queue = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+    if (context.paths == NULL || context.msg_queue == -1) {
+        perror("Unable to prepare the benchmarks");
+        return -1;
+    }
+    generate_paths(&context, max_size);
+
+    bench_case_t list_cases[] = {
+        {"add_file_entry (in order)", NULL, add_file_entry_body, clear_list, 0},
+        {"clear_files_list", build_list, clear_files_list_body, NULL, 0},
+        {"find_next_entry_by_name (walk)", build_list, find_next_entry_by_name_body, clear_list, 0},
+        {"concat_path", NULL, concat_path_body, NULL, 0},
+    };
+    bench_case_t find_case = {"find_entry_by_name", NULL, find_entry_by_name_body, NULL, 0};
+    bench_case_t message_case = {"send_file_entry+msgrcv", NULL, message_round_trip_body, NULL, 0};
+
+    bench_print_header(&config);
+    for (size_t s=0; s<sizeof(sizes) / sizeof(sizes[0]) && sizes[s]<=max_size; ++s) {
+        for (size_t c=0; c<sizeof(list_cases) / sizeof(list_cases[0]); ++c) {
+            // concat_path does not build a list
+            if (list_cases[c].body == concat_path_body || fits_in_memory(sizes[s])) {
+                bench_run(&list_cases[c], &context, sizes[s], &config);
+            } else if (!config.csv) {
+                printf("%-32s %10zu skipped (not enough memory)\n", list_cases[c].name, sizes[s]);
+            }
+        }
+        // Each lookup scans the list, it would take hours on the largest one
+        if (sizes[s] <= 100000) {
+            build_list(&context, sizes[s]);
+            bench_run(&find_case, &context, sizes[s], &config);
+            clear_list(&context, sizes[s]);
+        }
+        if (sizes[s] <= MAX_MESSAGES_PER_RUN) {
+            bench_run(&message_case, &context, sizes[s], &config);
+        }
+    }
+    msgctl(context.msg_queue, IPC_RMID, NULL);
+
+    size_t file_sizes[] = {4096, 1 << 20, MD5_FILE_SIZE};
+    snprintf(context.file_path, PATH_SIZE, "/tmp/lp25-microbench.%d", getpid());
+    for (size_t s=0; s<sizeof(file_sizes) / sizeof(file_sizes[0]); ++s) {
+        if (write_test_file(context.file_path, file_sizes[s]) == -1) {
+            perror("Unable to write the MD5 test file");
+            break;
+        }
+        bench_case_t md5_case = {"compute_file_md5", NULL, compute_file_md5_body, NULL, file_sizes[s]};
+        bench_run(&md5_case, &context, file_sizes[s], &config);
+    }
+    size_t buffer_sizes[] = {4096, 65536, 1 << 20};
+    char names[sizeof(buffer_sizes) / sizeof(buffer_sizes[0])][48];
+    for (size_t b=0; b<sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); ++b) {
+        context.buffer_size = buffer_sizes[b];
+        snprintf(names[b], sizeof(names[b]), "md5 read loop (%zuK buffer)", buffer_sizes[b] >> 10);
+        bench_case_t loop_case = {names[b], NULL, md5_read_loop_body, NULL, MD5_FILE_SIZE};
+        bench_run(&loop_case, &context, MD5_FILE_SIZE, &config);
+    }
+    unlink(context.file_path);
+
+    // Lots de petits fichiers : EVP un par un, puis chaque noyau multi-buffer disponible
+    context.small_files = malloc((size_t) MD5_BATCH_FILES * MD5_BATCH_FILE_SIZE);
+    for (size_t i=0; context.small_files != NULL && i<(size_t) MD5_BATCH_FILES * MD5_BATCH_FILE_SIZE; ++i) {
+        context.small_files[i] = (uint8_t) (i * 2654435761u >> 13);
+    }
+    char *kernel_names[] = {"avx512", "avx2", "vector4"};
+    size_t small_sizes[] = {4096, 16384, MD5_BATCH_FILE_SIZE};
+    for (size_t s=0; context.small_files != NULL && s<sizeof(small_sizes) / sizeof(small_sizes[0]); ++s) {
+        context.small_file_size = small_sizes[s];
+        size_t batch_bytes = MD5_BATCH_FILES * small_sizes[s];
+        bench_case_t evp_case = {"md5 batch (EVP)", NULL, md5_evp_batch_body, NULL, batch_bytes};
+        bench_run(&evp_case, &context, small_sizes[s], &config);
+        for (size_t k=0; k<sizeof(kernel_names) / sizeof(kernel_names[0]); ++k) {
+            char name[48];
+            snprintf(name, sizeof(name), "md5 batch (%s)", kernel_names[k]);
+            if (use_md5_kernel(kernel_names[k])) {
+                bench_case_t multi_case = {name, NULL, md5_multi_batch_body, NULL, batch_bytes};
+                bench_run(&multi_case, &context, small_sizes[s], &config);
+            }
+        }
+    }
+    free(context.small_files);
+    free(context.paths);
+    return 0;
+}
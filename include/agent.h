@@ -0,0 +1,26 @@
+#pragma once
+
+#include <configuration.h>
+#include <files-list.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frames of the agent protocol: [uint32 payload length][uint8 op code][payload], integers in big endian
+#define AGENT_FRAME_HEADER_SIZE 5
+#define AGENT_CHUNK_SIZE 65536 // File bytes per COMMAND_CODE_FILE_DATA frame
+#define AGENT_FRAME_MAX (PATH_SIZE + AGENT_CHUNK_SIZE)
+
+typedef struct {
+    uint8_t op_code;
+    uint32_t length;
+    uint8_t payload[AGENT_FRAME_MAX];
+} agent_frame_t;
+
+bool is_remote_destination(configuration_t *the_config);
+int run_agent(configuration_t *the_config);
+int open_remote_destination(configuration_t *the_config);
+int request_remote_list(void);
+void receive_remote_list(files_list_t *list, char *destination);
+int send_remote_copy(files_list_entry_t *source_entry, size_t source_prefix);
+void close_remote_destination(void);
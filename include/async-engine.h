@@ -0,0 +1,54 @@
+#pragma once
+
+#include <configuration.h>
+#include <file-properties.h>
+#include <files-list.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define ENGINE_HELPERS 8 // Threads doing the blocking system calls
+#define ENGINE_DIRS_IN_FLIGHT 8 // Directories listed at once
+#define ENGINE_STATS_IN_FLIGHT 64 // Entries stat-ed at once
+#define ENGINE_FILES_IN_FLIGHT 16 // Files hashed at once, with one read in flight each
+#define ENGINE_READ_SIZE (1 << 18) // Bytes of a read, hashed as soon as it completes
+#define ENGINE_WAITING_MAX (4 * ENGINE_FILES_IN_FLIGHT) // Stat-ed files waiting to be hashed before stats pause
+
+typedef enum {ENGINE_LIST_DIR, ENGINE_STAT, ENGINE_READ} engine_operation_t;
+
+typedef struct _engine_request {
+    engine_operation_t operation;
+    files_list_entry_t *entry; // The entry analyzed (STAT, READ) or the directory listed (LIST_DIR)
+    int error; // errno of a failed operation, 0 on success
+    struct stat sb; // STAT result
+    int fd; // File read, opened by the first READ / Directory listed, kept open to filter its entries
+    uint8_t *buffer; // READ buffer, of ENGINE_READ_SIZE bytes
+    off_t offset; // Offset of the next READ
+    ssize_t result; // Bytes read by the last READ, 0 at the end of the file
+    md5_context_t *md5;
+    char *names; // LIST_DIR result: for each entry, its d_type then its name and a '\0'
+    size_t names_length;
+    size_t names_position; // Next name to stat
+    struct _engine_request *next;
+} engine_request_t;
+
+typedef struct {
+    engine_request_t *head;
+    engine_request_t *tail;
+} engine_queue_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t has_submissions;
+    engine_queue_t submitted; // Taken by the helpers
+    engine_queue_t completed; // Taken by the event loop, woken through event_fd
+    int event_fd;
+    bool is_stopping;
+    pthread_t helpers[ENGINE_HELPERS];
+    int helpers_count;
+} engine_t;
+
+typedef void (*engine_callback_t)(files_list_entry_t *entry, void *context);
+
+int analyze_tree_async(char *root, bool is_destination, configuration_t *the_config, engine_callback_t callback, void *context);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define AUTOSCALE_WINDOW_FILES 64
+#define AUTOSCALE_MIN_WINDOW 0.2 // Seconds
+#define AUTOSCALE_MAX_WINDOW 1.0 // Seconds
+#define AUTOSCALE_FILE_COST 16384 // Bytes worth of work for opening and stating one file
+
+typedef struct {
+    char *name; // Side displayed in verbose logs
+    bool verbose;
+    uint16_t min_count;
+    uint16_t max_count;
+    uint16_t current_count; // Analyze requests allowed in flight
+    int step; // Direction of the last change: 1 to grow, -1 to shrink, 0 to hold
+    double window_start;
+    uint64_t window_files;
+    uint64_t window_bytes;
+    uint64_t window_dispatches;
+    uint64_t window_waits; // Dispatches delayed because all allowed analyzers were busy
+    uint64_t window_in_flight; // Sum of the in flight requests sampled at each dispatch
+    double previous_throughput;
+    double best_latency;
+    int hold_windows;
+} autoscale_t;
+
+uint16_t available_cpus_count(void);
+bool is_rotational_storage(char *path);
+uint16_t initial_analyzers_count(char *path, uint16_t max_count);
+void init_autoscale(autoscale_t *autoscale, char *name, uint16_t initial_count, uint16_t max_count, bool verbose);
+void autoscale_record(autoscale_t *autoscale, uint64_t bytes);
+uint16_t autoscale_update(autoscale_t *autoscale, int in_flight, bool has_waited);
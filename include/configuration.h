@@ -2,16 +2,44 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <defines.h>
+
+typedef enum { IO_CLASS_DEFAULT, IO_CLASS_BEST_EFFORT, IO_CLASS_IDLE } io_class_t;
+typedef enum { LOCALITY_NONE, LOCALITY_INODE, LOCALITY_EXTENT } locality_mode_t;
 
 typedef struct {
     char source[1024];
     char destination[1024];
-    uint8_t processes_count;
+    char extra_destinations[DESTINATIONS_MAX - 1][1024]; // Further destinations, receiving the same copies
+    uint8_t destinations_count; // Including destination
+    char link_dest[1024]; // Previous snapshot to hard link unchanged files from, empty if none
+    uint16_t processes_count;
+    bool auto_processes; // -n auto: processes_count is the pool size, the analyzers in use are scaled at runtime
     bool is_parallel;
     bool uses_md5;
     bool verbose;
     bool dry_run;
+    bool detect_moves;
+    bool dedup;
+    bool dedup_verify; // Compare bytes before deduplicating, in addition to MD5 sums
+    uint64_t bwlimit; // Bytes per second read and written by all processes, 0 for unlimited
+    uint32_t iops_limit; // I/O operations per second of all processes, 0 for unlimited
+    io_class_t io_class;
+    locality_mode_t locality; // Order of the analyses and copies, lexical when LOCALITY_NONE
+    uint64_t memory_limit; // Max bytes of entries kept in memory per list, 0 for unlimited
+    bool journal; // Record analyses and copies in the destination to allow resuming
+    bool resume; // Reuse the journal of an interrupted run
+    bool atomic; // Copy through temporary files, published once durable
+    bool hash_copies; // Hash files while copying them, the sums are kept in the manifest of the destination
+    bool agent; // Serve a remote synchronization of destination (@see run_agent)
+    char agent_socket[108]; // Unix socket the agent listens on, stdin and stdout if empty
+    char remote_command[1024]; // Command starting the agent of the destination, empty if local
+    char remote_socket[108]; // Unix socket of the agent of the destination, empty if local
+    bool progress; // Display the progress on stderr
+    int progress_fd; // Descriptor receiving the progress as JSON lines, -1 if none
+    char progress_socket[108]; // Unix socket receiving the progress as JSON lines, empty if none
 } configuration_t;
 
 void init_configuration(configuration_t *the_config);
-int set_configuration(configuration_t *the_config, int argc, char *argv[]);
\ No newline at end of file
+int set_configuration(configuration_t *the_config, int argc, char *argv[]);
+char *get_destination(configuration_t *the_config, uint8_t index);
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <files-list.h>
+#include <configuration.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t size;
+    uint8_t md5sum[16];
+    char *path; // Destination file holding this content
+} dedup_slot_t;
+
+typedef struct {
+    dedup_slot_t *slots;
+    size_t capacity;
+    size_t count;
+    size_t reflinks_count;
+    size_t hardlinks_count;
+    uint64_t bytes_deduplicated;
+} dedup_index_t;
+
+int init_dedup_index(dedup_index_t *index);
+int register_dedup_entry(dedup_index_t *index, files_list_entry_t *entry, char *destination_path);
+bool dedup_entry(dedup_index_t *index, files_list_entry_t *source_entry, char *destination_path, configuration_t *the_config);
+void display_dedup_report(dedup_index_t *index);
+void clear_dedup_index(dedup_index_t *index);
@@ -1,3 +1,7 @@
 #pragma once
 
-#define PATH_SIZE 4096
\ No newline at end of file
+#define PATH_SIZE 4096
+#define STREAM_WINDOW_SIZE 16
+#define ANALYZERS_MAX 1024
+#define COPY_BUFFER_SIZE (1 << 20) // Read once, written to every destination
+#define DESTINATIONS_MAX 8 // Destinations of a single run, each one is a bit of files_list_entry_t.destinations
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <files-list.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define EXTERNAL_SORT_MIN_BUFFER 16
+#define EXTERNAL_SORT_FAN_IN 32
+
+typedef struct {
+    FILE *file;
+    files_list_entry_t head; // Smallest entry of the run not yet consumed
+    bool has_head;
+    uint8_t level; // Number of merges this run went through
+} sorted_run_t;
+
+typedef struct {
+    uint64_t memory_limit; // 0 for an unbounded (never spilled) buffer
+    files_list_entry_t *buffer;
+    size_t buffer_count;
+    size_t buffer_capacity;
+    size_t buffer_position;
+    sorted_run_t *runs;
+    size_t runs_count;
+    size_t runs_capacity;
+    size_t *heap; // Indices of runs, ordered by their head
+    size_t heap_size;
+    bool is_merging;
+} external_sorter_t;
+
+int init_external_sorter(external_sorter_t *sorter, uint64_t memory_limit);
+int external_sorter_add(external_sorter_t *sorter, files_list_entry_t *entry);
+int external_sorter_finish(external_sorter_t *sorter);
+bool external_sorter_next(external_sorter_t *sorter, files_list_entry_t *entry);
+void clear_external_sorter(external_sorter_t *sorter);
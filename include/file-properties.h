@@ -3,8 +3,29 @@
 #include <files-list.h>
 #include <stdbool.h>
 #include <configuration.h>
+#include <md5-multi.h>
+#include <sys/stat.h>
 
+#define MD5_BATCH_FILES MD5_LANES_MAX
+#define MD5_BATCH_FILE_SIZE (1 << 16) // Files up to 64 KiB are read whole and hashed together
+
+typedef struct {
+    files_list_entry_t *entries[MD5_BATCH_FILES]; // Entries whose MD5 sum is pending
+    md5_job_t jobs[MD5_BATCH_FILES];
+    uint8_t *buffers; // MD5_BATCH_FILES buffers of MD5_BATCH_FILE_SIZE bytes
+    size_t count;
+} md5_batch_t;
+
+int set_file_stats(files_list_entry_t *entry, struct stat *sb);
 int get_file_stats(files_list_entry_t *entry);
+int init_md5_batch(md5_batch_t *batch);
+int get_file_stats_batched(files_list_entry_t *entry, md5_batch_t *batch);
+void flush_md5_batch(md5_batch_t *batch);
+void clear_md5_batch(md5_batch_t *batch);
 int compute_file_md5(files_list_entry_t *entry);
+typedef struct evp_md_ctx_st md5_context_t;
+md5_context_t *start_md5(void);
+int update_md5(md5_context_t *context, const void *buffer, size_t size);
+int finish_md5(md5_context_t *context, uint8_t *md5sum);
 bool directory_exists(char *path_to_dir);
 bool is_directory_writable(char *path_to_dir);
\ No newline at end of file
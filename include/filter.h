@@ -0,0 +1,59 @@
+#pragma once
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum { GLOB_LITERAL, GLOB_ANY, GLOB_CLASS, GLOB_STAR, GLOB_GLOBSTAR, GLOB_OPTIONAL } glob_token_kind_t;
+
+typedef struct {
+    glob_token_kind_t kind;
+    unsigned char literal;
+    uint8_t skip; // GLOB_OPTIONAL: the tokens of the optional group, "**/" matching no directory
+    uint8_t class_bits[32]; // GLOB_CLASS: bit c is set if character c is accepted
+} glob_token_t;
+
+typedef struct {
+    int rule; // Order of the rule: the last matching rule decides
+    bool is_anchored; // Matched against the path relative to the root, else against the name
+    bool is_dir_only;
+    glob_token_t *tokens;
+    size_t tokens_count;
+} glob_rule_t;
+
+typedef struct {
+    char *key;
+    int any_rule; // Last rule for any entry type, -1 if none
+    int dir_rule; // Last rule for directories only, -1 if none
+} filter_slot_t;
+
+typedef struct {
+    filter_slot_t *slots;
+    size_t capacity;
+    size_t count;
+} filter_table_t;
+
+typedef struct {
+    bool *is_include; // Per rule
+    int rules_count;
+    filter_table_t names; // Rules matching a whole name, like node_modules
+    filter_table_t suffixes; // Rules matching the end of a name, like *.tmp
+    size_t suffix_lengths[64]; // Distinct lengths of the suffixes, to look each of them up
+    size_t suffix_lengths_count;
+    glob_rule_t *globs; // Other rules, in their order
+    size_t globs_count;
+    bool *states; // Scratch of the glob automaton
+    bool *next_states;
+    size_t states_capacity;
+    bool reports; // Count the pruned bytes (verbose)
+    uint64_t pruned_entries;
+    uint64_t pruned_bytes;
+} filter_t;
+
+int add_filter_rule(char *pattern, bool is_include);
+int add_filter_rules_from(char *file_path);
+void set_filter_report(bool reports);
+bool filter_excludes(char *relative_path, bool is_dir);
+bool filter_prunes(char *relative_path, int dir_fd, struct dirent *dir_entry);
+void display_filter_report(char *root);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <files-list.h>
+#include <configuration.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_FILE_NAME ".lp25-journal"
+#define MANIFEST_FILE_NAME ".lp25-manifest"
+#define JOURNAL_SYNC_INTERVAL 1.0 // Seconds between two fdatasync of the journal
+#define JOURNAL_RECORD_ANALYSIS 'A'
+#define JOURNAL_RECORD_COPY_START 'B'
+#define JOURNAL_RECORD_COPY_DONE 'C'
+#define ANALYSIS_FIELDS_SIZE (sizeof(struct timespec) + sizeof(uint64_t) + 16 + sizeof(ino_t)) // After the path
+
+typedef struct {
+    char *path;
+    struct timespec mtime;
+    uint64_t size;
+    uint8_t md5sum[16];
+    ino_t inode;
+    bool has_analysis;
+    bool is_copying; // A copy started and never completed: the file was in flight during the crash
+    bool is_manifest; // The analysis comes from the manifest, it is kept by compact_manifest
+} journal_slot_t;
+
+typedef struct {
+    int fd;
+    int manifest_fd;
+    size_t manifest_records; // Records in the manifest file, outdated ones included
+    double last_sync;
+    journal_slot_t *slots; // Records of the interrupted run, loaded by --resume
+    size_t capacity;
+    size_t count;
+} journal_t;
+
+int init_journal(configuration_t *the_config);
+bool journal_reuse_analysis(files_list_entry_t *entry);
+bool journal_was_in_flight(char *path);
+void journal_record_analysis(files_list_entry_t *entry);
+void journal_record_sum(char *dest_path, uint8_t *md5sum);
+void journal_record_copy(char *destination_path, bool is_done, uint8_t *md5sum);
+void manifest_record_copy(char *dest_path, uint8_t *md5sum);
+void finish_journal(configuration_t *the_config);
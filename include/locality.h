@@ -0,0 +1,28 @@
+#pragma once
+
+#include <files-list.h>
+#include <configuration.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOCALITY_BATCH_SIZE 1024
+
+typedef struct {
+    uint64_t key; // Inode number or first physical extent
+    size_t index;
+} locality_order_t;
+
+typedef void (*locality_apply_t)(files_list_entry_t *entry, void *context);
+
+typedef struct {
+    locality_mode_t mode;
+    files_list_entry_t *entries; // Copies of the batched entries
+    locality_order_t *order;
+    size_t count;
+} locality_batch_t;
+
+uint64_t physical_key(files_list_entry_t *entry, locality_mode_t mode);
+int init_locality_batch(locality_batch_t *batch, locality_mode_t mode);
+bool locality_batch_add(locality_batch_t *batch, files_list_entry_t *entry);
+void locality_batch_flush(locality_batch_t *batch, locality_apply_t apply, void *context);
+void clear_locality_batch(locality_batch_t *batch);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MD5_LANES_MAX 16 // Lanes of the widest kernel (AVX-512)
+
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    uint8_t *digest; // 16 bytes, written once the job is hashed
+} md5_job_t;
+
+void md5_hash_jobs(md5_job_t *jobs, size_t count);
+const char *md5_kernel_name(void);
+bool use_md5_kernel(const char *name);
@@ -8,6 +8,10 @@
 #define COMMAND_CODE_ANALYZE_FILE 0x01
 #define COMMAND_CODE_FILE_ANALYZED 0x11
 #define COMMAND_CODE_ANALYZE_DIR 0x02
+#define COMMAND_CODE_REQUEST_ENTRIES 0x03
+#define COMMAND_CODE_WRITE_ENTRY 0x04 // Agent protocol only (@see agent.h)
+#define COMMAND_CODE_FILE_DATA 0x05 // Agent protocol only, an empty one ends the file
+#define COMMAND_CODE_ANALYZE_FILES 0x06 // Several entries, answered one by one with COMMAND_CODE_FILE_ANALYZED
 #define COMMAND_CODE_FILE_ENTRY 0x12
 #define COMMAND_CODE_LIST_COMPLETE 0x22
 
@@ -16,6 +20,8 @@
 #define MSG_TYPE_TO_DESTINATION_LISTER 3
 #define MSG_TYPE_TO_SOURCE_ANALYZERS 4
 #define MSG_TYPE_TO_DESTINATION_ANALYZERS 5
+#define MSG_TYPE_SOURCE_LIST_TO_MAIN 6
+#define MSG_TYPE_DESTINATION_LIST_TO_MAIN 7
 
 typedef struct {
     long mtype;
@@ -41,18 +47,27 @@ typedef struct {
     char target[PATH_SIZE];
 } analyze_dir_command_t;
 
+typedef struct {
+    long mtype;
+    char op_code; // Contains the analyze files opcode
+    char paths[PATH_SIZE]; // Paths of the entries, each followed by a '\0', then an empty path
+} analyze_files_command_t;
+
 typedef union {
     simple_command_t simple_command;
     analyze_file_command_t analyze_file_command;
     analyze_dir_command_t analyze_dir_command;
+    analyze_files_command_t analyze_files_command;
     files_list_entry_transmit_t list_entry;
 } any_message_t;
 
 int send_analyze_dir_command(int msg_queue, int recipient, char *target_dir);
 int send_file_entry(int msg_queue, int recipient, files_list_entry_t *file_entry, int cmd_code);
 int send_analyze_file_command(int msg_queue, int recipient, files_list_entry_t *file_entry);
+int send_analyze_files_command(int msg_queue, int recipient, char *paths, size_t length, int msg_flags);
 int send_analyze_file_response(int msg_queue, int recipient, files_list_entry_t *file_entry);
 int send_files_list_element(int msg_queue, int recipient, files_list_entry_t *file_entry);
 int send_list_end(int msg_queue, int recipient);
+int send_entries_request(int msg_queue, int recipient);
 int send_terminate_command(int msg_queue, int recipient);
 int send_terminate_confirm(int msg_queue, int recipient);
\ No newline at end of file
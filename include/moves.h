@@ -0,0 +1,21 @@
+#pragma once
+
+#include <files-list.h>
+#include <configuration.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    files_list_entry_t **slots; // Extra destination files, hashed by size and MD5 sum
+    bool *is_moved; // Set when the matching slot entry was renamed (its path is then the new one)
+    size_t capacity;
+    size_t moves_count;
+    size_t links_count;
+    uint64_t bytes_saved;
+} moves_index_t;
+
+int init_moves_index(moves_index_t *index, files_list_t *destination_list, files_list_t *source_list, configuration_t *the_config);
+bool try_move_entry(moves_index_t *index, files_list_entry_t *source_entry, configuration_t *the_config);
+void display_moves_report(moves_index_t *index);
+void clear_moves_index(moves_index_t *index);
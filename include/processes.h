@@ -7,7 +7,7 @@
 #include <stdbool.h>
 
 typedef struct {
-    uint8_t processes_count;
+    uint16_t processes_count;
     pid_t main_process_pid;
     pid_t source_lister_pid;
     pid_t destination_lister_pid;
@@ -15,12 +15,19 @@ typedef struct {
     pid_t *destination_analyzers_pids;
     key_t shared_key;
     int message_queue_id;
+    io_class_t io_class; // Applied to every process made by make_process
+    pid_t progress_pid; // Reporter of the progress, -1 if none
 } process_context_t;
 
 typedef struct {
     int my_recipient_id; // Id of analyzers' MQ topic
     int my_receiver_id; // Id of MQ topic to listen to
     int analyzers_count; // Number of analyzers available
+    bool auto_scale; // Scale the analyzers in use at runtime, up to analyzers_count
+    bool verbose;
+    int my_main_recipient_id; // Id of MQ topic on which my list is streamed to main
+    uint64_t memory_limit; // Bytes of entries kept in memory before spilling sorted runs, 0 for unlimited
+    locality_mode_t locality; // Order in which entries are dispatched to the analyzers
     key_t mq_key;
 } lister_configuration_t;
 
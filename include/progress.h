@@ -0,0 +1,44 @@
+#pragma once
+
+#include <configuration.h>
+#include <defines.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PROGRESS_INTERVAL 0.5 // Seconds between two renderings of the progress
+#define PROGRESS_POLL_NS 50000000L // The reporter checks the end of the synchronization every 50ms
+#define PROGRESS_RATE_SMOOTHING 0.3 // Weight of the last interval in the displayed throughputs
+#define PROGRESS_SLOTS (2 * ANALYZERS_MAX + 1) // Every analyzer, and main
+#define PROGRESS_NAME_SIZE 128 // End of the path of the current file of a slot
+
+typedef enum {
+    PROGRESS_LISTED, // Entries found by the listers
+    PROGRESS_ANALYZED, // Entries whose properties are known
+    PROGRESS_BYTES_HASHED,
+    PROGRESS_FILES_TO_COPY, // Differences found so far
+    PROGRESS_BYTES_TO_COPY,
+    PROGRESS_FILES_COPIED, // Differences applied (copied, moved or deduplicated)
+    PROGRESS_BYTES_COPIED,
+    PROGRESS_COUNTERS
+} progress_counter_t;
+
+typedef struct {
+    pid_t pid; // 0 while the slot is free
+    char role; // 'm' for main, 'a' for an analyzer
+    char current[PROGRESS_NAME_SIZE]; // Last file handled, it can be torn while it is rewritten
+} progress_slot_t;
+
+typedef struct {
+    uint64_t counters[PROGRESS_COUNTERS];
+    uint32_t slots_count; // Slots claimed, the free ones are never given back
+    uint32_t is_done;
+    progress_slot_t slots[PROGRESS_SLOTS];
+} progress_t;
+
+int init_progress(configuration_t *the_config);
+void reset_progress_slot(void);
+void count_progress(progress_counter_t counter, uint64_t value);
+void set_progress_file(char *path);
+void progress_process_loop(void *parameters);
+void finish_progress(pid_t reporter_pid);
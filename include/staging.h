@@ -0,0 +1,35 @@
+#pragma once
+
+#include <defines.h>
+#include <files-list.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define STAGING_BATCH_SIZE 256 // Staged files published together, each one keeps its descriptor open until then
+#define STAGING_PREFIX ".lp25-tmp." // Prefix of the named temporary files, when O_TMPFILE is not supported
+
+typedef struct {
+    int fd;
+    char temp_path[PATH_SIZE]; // Empty for an anonymous (O_TMPFILE) file
+    char final_path[PATH_SIZE];
+    files_list_entry_t entry; // Source entry, given back when the file is published
+} staged_file_t;
+
+typedef void (*staging_published_t)(files_list_entry_t *entry, char *final_path, void *context);
+
+typedef struct {
+    int sync_fd; // The destination directory, to sync its whole filesystem
+    staged_file_t *files;
+    size_t count;
+    staging_published_t published;
+    void *context;
+} staging_batch_t;
+
+int open_named_temp(char *temp_path, char *final_path, mode_t mode);
+int init_staging_batch(staging_batch_t *batch, char *destination, staging_published_t published, void *context);
+int stage_file(staging_batch_t *batch, char *final_path, mode_t mode);
+void commit_staged_file(staging_batch_t *batch, files_list_entry_t *entry);
+void discard_staged_file(staging_batch_t *batch);
+void flush_staging_batch(staging_batch_t *batch);
+void clear_staging_batch(staging_batch_t *batch);
@@ -4,13 +4,39 @@
 #include <files-list.h>
 #include <configuration.h>
 #include <processes.h>
+#include <messages.h>
 #include <dirent.h>
 
+typedef void (*walk_callback_t)(char *path, struct dirent *dir_entry, void *context);
+
+// Differences between an entry and its counterpart (@see mismatch), combined as bits
+typedef enum {
+    MISMATCH_NONE = 0,
+    MISMATCH_CONTENT = 1 << 0, // Type, size or MD5 sum differ: the entry must be copied
+    MISMATCH_MODE = 1 << 1, // Permission bits differ
+    MISMATCH_MTIME = 1 << 2, // Modification times differ
+    MISMATCH_DIRECTORY = 1 << 3, // Both entries are directories, only their mode can differ
+} mismatch_t;
+
+typedef struct {
+    int msg_queue;
+    int lister_id; // Topic of the lister to pull the entries from
+    int topic_id; // Topic on which the lister streams its entries
+    files_list_entry_t window[STREAM_WINDOW_SIZE];
+    size_t window_count;
+    size_t window_position;
+    bool is_complete;
+} lister_stream_t;
+
 void synchronize(configuration_t *the_config, process_context_t *p_context);
 void make_files_list(files_list_t *list, char *target_path);
-bool mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5);
+mismatch_t mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5);
 void make_files_lists_parallel(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config, int msg_queue);
 void copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config);
 void make_list(files_list_t *list, char *target);
 DIR *open_dir(char *path);
-struct dirent *get_next_entry(DIR *dir);
\ No newline at end of file
+struct dirent *get_next_entry(DIR *dir);
+bool is_internal_entry(char *relative_path, bool is_destination);
+void walk_tree(char *target, bool is_destination, walk_callback_t callback, void *context);
+void init_lister_stream(lister_stream_t *stream, int msg_queue, int lister_id, int topic_id);
+bool lister_stream_next(lister_stream_t *stream, files_list_entry_t *entry);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <configuration.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define THROTTLE_BURST_NS 100000000ULL // Up to 100ms of I/O can be done ahead of the rate
+#define THROTTLE_CHECK_NS 250000000ULL // Device latency is checked every 250ms
+#define THROTTLE_OP_SIZE 131072 // Bytes of a sendfile counted as one operation
+#define THROTTLE_MIN_FACTOR 62 // Backoff never goes below 1/16 of the limits (permille)
+#define THROTTLE_BASELINE_WEIGHT 0.05 // Weight of a new latency sample in the baseline when above it (EWMA)
+#define THROTTLE_MIN_BUSY_MS 10 // Busy time of a device over a check below which its latency is not trusted
+#define THROTTLE_DEVICES 2
+
+typedef struct {
+    uint64_t ios;
+    uint64_t ticks_ms; // Time spent doing I/Os, summed over requests
+} device_counters_t;
+
+typedef struct {
+    uint64_t bytes_per_second; // 0 when not limited
+    uint64_t ops_per_second; // 0 when not limited
+    uint64_t bytes_tat_ns; // Theoretical arrival time of the bytes bucket (GCRA)
+    uint64_t ops_tat_ns; // Theoretical arrival time of the operations bucket (GCRA)
+    uint32_t factor_permille; // Adaptive backoff applied to both limits
+    uint64_t last_check_ns;
+    dev_t devices[THROTTLE_DEVICES];
+    device_counters_t counters[THROTTLE_DEVICES];
+    double baseline_latency_ms[THROTTLE_DEVICES];
+} io_throttle_t;
+
+int init_io_throttle(configuration_t *the_config);
+int apply_io_class(io_class_t io_class);
+void throttle_io(uint64_t bytes, uint32_t ops);
+bool is_io_throttled(void);
@@ -1,8 +1,9 @@
 #pragma once
 
 #include <defines.h>
+#include <stddef.h>
+#include <stdint.h>
 
-char *concat_path(char *result, char *prefix, char *suffix){
-    result = strcat(prefix,suffix);
-    return result;
-}
\ No newline at end of file
+char *concat_path(char *result, char *prefix, char *suffix);
+size_t path_prefix_length(char *root);
+int parse_size(char *text, uint64_t *size);
@@ -2,6 +2,7 @@
 #include <../include/configuration.h>
 #include <../include/file-properties.h>
 #include <../include/processes.h>
+#include <../include/agent.h>
 
 #include <stdio.h>
 #include <assert.h>
@@ -26,13 +27,22 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    // Check directories
-    if (!directory_exists(my_config.source) || !directory_exists(my_config.destination)) {
+    // Agent mode: serve the destination to a remote lp25-backup
+    if (my_config.agent) {
+        if (!directory_exists(my_config.destination) || !is_directory_writable(my_config.destination)) {
+            printf("Destination directory %s does not exist or is not writable\nAborting\n", my_config.destination);
+            return -1;
+        }
+        return run_agent(&my_config);
+    }
+
+    // Check directories (a remote destination is checked by its agent)
+    if (!directory_exists(my_config.source) || (!is_remote_destination(&my_config) && !directory_exists(my_config.destination))) {
         printf("Either source or destination directory do not exist\nAborting\n");
         return -1;
     }
     // Is destination writable?
-    if (!is_directory_writable(my_config.destination)) {
+    if (!is_remote_destination(&my_config) && !is_directory_writable(my_config.destination)) {
         printf("Destination directory %s is not writable\n", my_config.destination);
         return -1;
     }
@@ -0,0 +1,563 @@
+#define _DEFAULT_SOURCE // htobe64 and be64toh
+
+#include "agent.h"
+#include "external-sort.h"
+#include "messages.h"
+#include "file-properties.h"
+#include "staging.h"
+#include "sync.h"
+#include "throttle.h"
+#include "utility.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// With --remote or --remote-socket, the destination is handled by an agent (lp25-backup --agent) running next to
+// it: the agent lists and hashes the destination locally and writes the copies, so that only the destination
+// list and the changed file bytes cross the link. Both sides speak the op codes of the message queue protocol,
+// framed over a byte stream:
+//   main  -> agent: COMMAND_CODE_ANALYZE_DIR
+//   agent -> main:  COMMAND_CODE_FILE_ENTRY (one per entry), then COMMAND_CODE_LIST_COMPLETE
+//   main  -> agent: COMMAND_CODE_WRITE_ENTRY, then for files COMMAND_CODE_FILE_DATA frames and an empty one
+//   main  -> agent: COMMAND_CODE_TERMINATE
+//   agent -> main:  COMMAND_CODE_TERMINATE_OK with the number of failed writes
+// Paths are relative to the root of each side. Entries are encoded as (@see encode_entry)
+//   [uint16 path length][path][int64 mtime s][int64 mtime ns][uint64 size][md5 16 bytes][uint8 type][uint32 mode]
+
+static int remote_fd = -1;
+static pid_t remote_pid = -1;
+
+/*!
+ * @brief read_exactly reads a whole buffer from a stream
+ * @return 0 on success, -1 on error or end of stream
+ */
+static int read_exactly(int fd, void *buffer, size_t size) {
+    uint8_t *cursor = buffer;
+    while (size > 0) {
+        ssize_t bytes = read(fd, cursor, size);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+        cursor += bytes;
+        size -= bytes;
+    }
+    return 0;
+}
+
+/*!
+ * @brief write_exactly writes a whole buffer to a stream
+ * @return 0 on success, -1 else
+ */
+static int write_exactly(int fd, const void *buffer, size_t size) {
+    const uint8_t *cursor = buffer;
+    while (size > 0) {
+        ssize_t bytes = write(fd, cursor, size);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+        cursor += bytes;
+        size -= bytes;
+    }
+    return 0;
+}
+
+/*!
+ * @brief send_frame sends a frame
+ * @param fd is the stream
+ * @param op_code is the op code (COMMAND_CODE_*)
+ * @param payload is the payload, may be NULL if length is 0
+ * @param length is the payload length
+ * @return 0 on success, -1 else
+ */
+static int send_frame(int fd, uint8_t op_code, const void *payload, uint32_t length) {
+    uint8_t header[AGENT_FRAME_HEADER_SIZE];
+    uint32_t big_endian_length = htobe32(length);
+    memcpy(header, &big_endian_length, sizeof(big_endian_length));
+    header[4] = op_code;
+    if (write_exactly(fd, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    return length == 0 ? 0 : write_exactly(fd, payload, length);
+}
+
+/*!
+ * @brief receive_frame receives a frame
+ * @param fd is the stream
+ * @param frame is a pointer to the frame to fill
+ * @return 0 on success, -1 on error, end of stream or oversized frame
+ */
+static int receive_frame(int fd, agent_frame_t *frame) {
+    uint8_t header[AGENT_FRAME_HEADER_SIZE];
+    if (read_exactly(fd, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    uint32_t big_endian_length;
+    memcpy(&big_endian_length, header, sizeof(big_endian_length));
+    frame->length = be32toh(big_endian_length);
+    frame->op_code = header[4];
+    if (frame->length > AGENT_FRAME_MAX) {
+        return -1;
+    }
+    return read_exactly(fd, frame->payload, frame->length);
+}
+
+/*!
+ * @brief encode_entry encodes an entry, with its path relative to its root
+ * @param entry is the entry
+ * @param prefix is the length of the root in the entry path (@see path_prefix_length)
+ * @param buffer receives the encoded entry, it must hold PATH_SIZE + 64 bytes
+ * @return the length of the encoded entry
+ */
+static uint32_t encode_entry(files_list_entry_t *entry, size_t prefix, uint8_t *buffer) {
+    char *relative_path = entry->path_and_name + prefix;
+    uint16_t path_length = (uint16_t) strnlen(relative_path, PATH_SIZE - 1);
+    uint16_t big_endian_length = htobe16(path_length);
+    uint64_t fields[3] = {htobe64(entry->mtime.tv_sec), htobe64(entry->mtime.tv_nsec), htobe64(entry->size)};
+    uint32_t mode = htobe32(entry->mode);
+    uint8_t *cursor = buffer;
+    memcpy(cursor, &big_endian_length, sizeof(big_endian_length));
+    cursor += sizeof(big_endian_length);
+    memcpy(cursor, relative_path, path_length);
+    cursor += path_length;
+    memcpy(cursor, fields, sizeof(fields));
+    cursor += sizeof(fields);
+    memcpy(cursor, entry->md5sum, sizeof(entry->md5sum));
+    cursor += sizeof(entry->md5sum);
+    *cursor++ = entry->entry_type == DOSSIER;
+    memcpy(cursor, &mode, sizeof(mode));
+    cursor += sizeof(mode);
+    return (uint32_t) (cursor - buffer);
+}
+
+/*!
+ * @brief is_safe_relative_path tells if a received path stays under the root
+ * @param relative_path is the path
+ * @return false for an empty or absolute path, or a path with a ".." component
+ */
+static bool is_safe_relative_path(char *relative_path) {
+    if (relative_path[0] == '\0' || relative_path[0] == '/') {
+        return false;
+    }
+    for (char *component=relative_path; component!=NULL; component=strchr(component, '/')) {
+        if (*component == '/') {
+            ++component;
+        }
+        if (strncmp(component, "..", 2) == 0 && (component[2] == '/' || component[2] == '\0')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+ * @brief decode_entry decodes an entry, putting its relative path under a root
+ * @param buffer is the encoded entry
+ * @param length is the length of the encoded entry
+ * @param root is the directory the relative path is appended to
+ * @param entry is a pointer to the entry to fill
+ * @return 0 on success, -1 on a malformed entry or a too long path
+ */
+static int decode_entry(uint8_t *buffer, uint32_t length, char *root, files_list_entry_t *entry) {
+    uint16_t path_length;
+    uint64_t fields[3];
+    uint32_t mode;
+    if (length < sizeof(path_length)) {
+        return -1;
+    }
+    memcpy(&path_length, buffer, sizeof(path_length));
+    path_length = be16toh(path_length);
+    if (length != sizeof(path_length) + path_length + sizeof(fields) + sizeof(entry->md5sum) + 1 + sizeof(mode) || path_length >= PATH_SIZE) {
+        return -1;
+    }
+    memset(entry, 0, sizeof(files_list_entry_t));
+    uint8_t *cursor = buffer + sizeof(path_length) + path_length;
+    memcpy(fields, cursor, sizeof(fields));
+    cursor += sizeof(fields);
+    entry->mtime.tv_sec = (time_t) be64toh(fields[0]);
+    entry->mtime.tv_nsec = (long) be64toh(fields[1]);
+    entry->size = be64toh(fields[2]);
+    memcpy(entry->md5sum, cursor, sizeof(entry->md5sum));
+    cursor += sizeof(entry->md5sum);
+    entry->entry_type = *cursor++ ? DOSSIER : FICHIER;
+    memcpy(&mode, cursor, sizeof(mode));
+    entry->mode = be32toh(mode);
+
+    // The properties are decoded even for an invalid path, the agent needs the type to skip the content
+    char relative_path[PATH_SIZE];
+    memcpy(relative_path, buffer + sizeof(path_length), path_length);
+    relative_path[path_length] = '\0';
+    if (!is_safe_relative_path(relative_path) || concat_path(entry->path_and_name, root, relative_path) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief is_remote_destination tells if the destination is handled by an agent
+ * @param the_config is a pointer to the configuration
+ * @return true with --remote or --remote-socket
+ */
+bool is_remote_destination(configuration_t *the_config) {
+    return the_config->remote_command[0] != '\0' || the_config->remote_socket[0] != '\0';
+}
+
+typedef struct {
+    int fd;
+    size_t prefix;
+} agent_list_context_t;
+
+/*!
+ * @brief send_listed_entry is the walk_tree callback of the agent: it analyzes an entry and sends it to main
+ */
+static void send_listed_entry(char *path, struct dirent *dir_entry, void *context) {
+    (void) dir_entry;
+    agent_list_context_t *list_context = (agent_list_context_t *) context;
+    files_list_entry_t entry;
+    memset(&entry, 0, sizeof(files_list_entry_t));
+    strncpy(entry.path_and_name, path, sizeof(entry.path_and_name) - 1);
+    if (get_file_stats(&entry) == 0) {
+        uint8_t buffer[PATH_SIZE + 64];
+        send_frame(list_context->fd, COMMAND_CODE_FILE_ENTRY, buffer, encode_entry(&entry, list_context->prefix, buffer));
+    }
+}
+
+/*!
+ * @brief receive_written_entry writes an entry sent by main (COMMAND_CODE_WRITE_ENTRY and its data frames)
+ * The file is written to a temporary file renamed over the destination once complete, so that a previous version
+ * (possibly hard linked to other files) is never rewritten in place.
+ * @param fd is the stream
+ * @param frame is the COMMAND_CODE_WRITE_ENTRY frame, reused for the data frames
+ * @param root is the destination directory
+ * @return 0 on success, 1 if the entry could not be written, -1 on a stream error
+ */
+static int receive_written_entry(int fd, agent_frame_t *frame, char *root) {
+    files_list_entry_t entry;
+    bool is_valid = decode_entry(frame->payload, frame->length, root, &entry) == 0;
+    int dest_fd = -1;
+    char temp_path[PATH_SIZE];
+    // An existing directory is sent again when its mode changed
+    if (entry.entry_type == DOSSIER) {
+        if (is_valid && mkdir(entry.path_and_name, entry.mode & 07777) == -1
+            && (errno != EEXIST || chmod(entry.path_and_name, entry.mode & 07777) == -1)) {
+            is_valid = false;
+        }
+        return is_valid ? 0 : 1;
+    }
+    if (is_valid) {
+        dest_fd = open_named_temp(temp_path, entry.path_and_name, entry.mode & 07777);
+        if (dest_fd == -1) {
+            perror("Error opening destination file");
+        }
+    }
+    // The data frames are read even when the file cannot be written, to stay in sync with main
+    bool is_written = dest_fd != -1;
+    while (true) {
+        if (receive_frame(fd, frame) == -1 || frame->op_code != COMMAND_CODE_FILE_DATA) {
+            if (dest_fd != -1) {
+                close(dest_fd);
+                unlink(temp_path);
+            }
+            return -1;
+        }
+        if (frame->length == 0) {
+            break;
+        }
+        if (is_written && write_exactly(dest_fd, frame->payload, frame->length) == -1) {
+            perror("Error writing destination file");
+            is_written = false;
+        }
+    }
+    if (dest_fd == -1) {
+        return 1;
+    }
+    struct timespec times[2] = {{0, UTIME_OMIT}, entry.mtime};
+    fchmod(dest_fd, entry.mode & 07777);
+    futimens(dest_fd, times);
+    close(dest_fd);
+    if (is_written && rename(temp_path, entry.path_and_name) == -1) {
+        perror("Error renaming destination file");
+        is_written = false;
+    }
+    if (!is_written) {
+        unlink(temp_path);
+    }
+    return is_written ? 0 : 1;
+}
+
+/*!
+ * @brief init_socket_address fills the address of a Unix socket
+ * @param address is a pointer to the address to fill
+ * @param socket_path is the path of the socket
+ * @return 0 on success, -1 if the path does not fit in the address
+ */
+static int init_socket_address(struct sockaddr_un *address, char *socket_path) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(address->sun_path, sizeof(address->sun_path), "%s", socket_path);
+    return 0;
+}
+
+/*!
+ * @brief accept_agent_connection listens on a Unix socket and accepts one connection (--listen)
+ * @param socket_path is the path of the socket
+ * @return the connected socket, -1 on failure
+ */
+static int accept_agent_connection(char *socket_path) {
+    struct sockaddr_un address;
+    if (init_socket_address(&address, socket_path) == -1) {
+        return -1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(listen_fd, 1) == -1) {
+        close(listen_fd);
+        return -1;
+    }
+    int fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    unlink(socket_path);
+    return fd;
+}
+
+/*!
+ * @brief run_agent serves one synchronization of the destination (--agent)
+ * The protocol goes through stdin and stdout, or through a Unix socket with --listen. The standard output is then
+ * redirected to the standard error, so that messages do not corrupt the stream.
+ * @param the_config is a pointer to the configuration, its destination being the directory served
+ * @return 0 on success, -1 else
+ */
+int run_agent(configuration_t *the_config) {
+    int in_fd = STDIN_FILENO;
+    int out_fd;
+    if (the_config->agent_socket[0] != '\0') {
+        in_fd = accept_agent_connection(the_config->agent_socket);
+        out_fd = in_fd;
+        if (in_fd == -1) {
+            perror("Unable to accept the connection");
+            return -1;
+        }
+    } else {
+        out_fd = dup(STDOUT_FILENO);
+        if (out_fd == -1) {
+            return -1;
+        }
+        // Messages still buffered by stdio are flushed later, to the standard error
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    agent_frame_t *frame = malloc(sizeof(agent_frame_t));
+    if (frame == NULL) {
+        return -1;
+    }
+    uint32_t failures = 0;
+    int result = -1;
+    while (receive_frame(in_fd, frame) == 0) {
+        if (frame->op_code == COMMAND_CODE_ANALYZE_DIR) {
+            agent_list_context_t list_context = {out_fd, path_prefix_length(the_config->destination)};
+            walk_tree(the_config->destination, true, send_listed_entry, &list_context);
+            send_frame(out_fd, COMMAND_CODE_LIST_COMPLETE, NULL, 0);
+        } else if (frame->op_code == COMMAND_CODE_WRITE_ENTRY) {
+            int written = receive_written_entry(in_fd, frame, the_config->destination);
+            if (written == -1) {
+                break;
+            }
+            failures += written;
+        } else if (frame->op_code == COMMAND_CODE_TERMINATE) {
+            uint32_t big_endian_failures = htobe32(failures);
+            send_frame(out_fd, COMMAND_CODE_TERMINATE_OK, &big_endian_failures, sizeof(big_endian_failures));
+            result = failures == 0 ? 0 : -1;
+            break;
+        }
+    }
+    free(frame);
+    close(in_fd);
+    if (out_fd != in_fd) {
+        close(out_fd);
+    }
+    return result;
+}
+
+/*!
+ * @brief spawn_agent runs the --remote command with its stdin and stdout on one end of a socket pair
+ * The command is run by sh, for instance "ssh host lp25-backup --agent /backup".
+ * @param command is the command starting the agent
+ * @return the other end of the socket pair, -1 on failure
+ */
+static int spawn_agent(char *command) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        return -1;
+    }
+    remote_pid = fork();
+    if (remote_pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (remote_pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+/*!
+ * @brief open_remote_destination connects to the agent of the destination
+ * @param the_config is a pointer to the configuration
+ * @return 0 on success, -1 else
+ */
+int open_remote_destination(configuration_t *the_config) {
+    // A dead agent must make writes fail, not kill main
+    signal(SIGPIPE, SIG_IGN);
+    if (the_config->remote_command[0] != '\0') {
+        remote_fd = spawn_agent(the_config->remote_command);
+    } else {
+        struct sockaddr_un address;
+        remote_fd = init_socket_address(&address, the_config->remote_socket) == -1 ? -1 : socket(AF_UNIX, SOCK_STREAM, 0);
+        if (remote_fd != -1 && connect(remote_fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+            close(remote_fd);
+            remote_fd = -1;
+        }
+    }
+    if (remote_fd == -1) {
+        perror("Unable to reach the agent");
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief request_remote_list asks the agent to list and analyze its destination
+ * The list is received later (@see receive_remote_list), so that the source is listed meanwhile.
+ * @return 0 on success, -1 else
+ */
+int request_remote_list(void) {
+    return send_frame(remote_fd, COMMAND_CODE_ANALYZE_DIR, NULL, 0);
+}
+
+/*!
+ * @brief receive_remote_list receives the list of the destination from the agent
+ * The agent sends the entries in the order of its walk, they are sorted by path like the other lists.
+ * @param list is a pointer to the list to build
+ * @param destination is the destination as named on the command line, prefixed to the received paths
+ */
+void receive_remote_list(files_list_t *list, char *destination) {
+    agent_frame_t *frame = malloc(sizeof(agent_frame_t));
+    external_sorter_t sorter;
+    if (frame == NULL || init_external_sorter(&sorter, 0) == -1) {
+        free(frame);
+        return;
+    }
+    files_list_entry_t entry;
+    while (receive_frame(remote_fd, frame) == 0 && frame->op_code == COMMAND_CODE_FILE_ENTRY) {
+        if (decode_entry(frame->payload, frame->length, destination, &entry) == 0) {
+            external_sorter_add(&sorter, &entry);
+        }
+    }
+    free(frame);
+    if (external_sorter_finish(&sorter) == 0) {
+        while (external_sorter_next(&sorter, &entry)) {
+            files_list_entry_t *new_entry = malloc(sizeof(files_list_entry_t));
+            if (new_entry != NULL) {
+                memcpy(new_entry, &entry, sizeof(files_list_entry_t));
+                add_entry_to_tail(list, new_entry);
+            }
+        }
+    }
+    clear_external_sorter(&sorter);
+}
+
+/*!
+ * @brief send_remote_copy sends an entry, and the content of a file, to the agent
+ * @param source_entry is the source entry
+ * @param source_prefix is the length of the source in the entry path (@see path_prefix_length)
+ * @return 0 on success, -1 else
+ */
+int send_remote_copy(files_list_entry_t *source_entry, size_t source_prefix) {
+    static uint8_t buffer[PATH_SIZE + AGENT_CHUNK_SIZE];
+    if (send_frame(remote_fd, COMMAND_CODE_WRITE_ENTRY, buffer, encode_entry(source_entry, source_prefix, buffer)) == -1) {
+        return -1;
+    }
+    if (source_entry->entry_type == DOSSIER) {
+        return 0;
+    }
+    int source_fd = open(source_entry->path_and_name, O_RDONLY);
+    if (source_fd == -1) {
+        perror("Error opening source file");
+    }
+    ssize_t bytes = 0;
+    while (source_fd != -1 && (bytes = read(source_fd, buffer, AGENT_CHUNK_SIZE)) != 0) {
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error reading source file");
+            break;
+        }
+        throttle_io(bytes, 1);
+        if (send_frame(remote_fd, COMMAND_CODE_FILE_DATA, buffer, (uint32_t) bytes) == -1) {
+            close(source_fd);
+            return -1;
+        }
+    }
+    if (source_fd != -1) {
+        close(source_fd);
+    }
+    // Ends the file, even a partial one: the agent keeps the mtime of the source, a later run copies it again
+    return send_frame(remote_fd, COMMAND_CODE_FILE_DATA, NULL, 0);
+}
+
+/*!
+ * @brief close_remote_destination ends the synchronization with the agent and reports its failed writes
+ */
+void close_remote_destination(void) {
+    if (remote_fd == -1) {
+        return;
+    }
+    agent_frame_t *frame = malloc(sizeof(agent_frame_t));
+    if (send_frame(remote_fd, COMMAND_CODE_TERMINATE, NULL, 0) == 0 && frame != NULL && receive_frame(remote_fd, frame) == 0
+        && frame->op_code == COMMAND_CODE_TERMINATE_OK && frame->length == sizeof(uint32_t)) {
+        uint32_t failures;
+        memcpy(&failures, frame->payload, sizeof(failures));
+        failures = be32toh(failures);
+        if (failures > 0) {
+            printf("The agent could not write %u entries\n", failures);
+        }
+    } else {
+        printf("The agent did not confirm the end of the synchronization\n");
+    }
+    free(frame);
+    close(remote_fd);
+    remote_fd = -1;
+    if (remote_pid != -1) {
+        waitpid(remote_pid, NULL, 0);
+        remote_pid = -1;
+    }
+}
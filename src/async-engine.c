@@ -0,0 +1,531 @@
+#include "async-engine.h"
+#include "sync.h"
+#include "utility.h"
+#include "filter.h"
+#include "journal.h"
+#include "progress.h"
+#include "throttle.h"
+#include "md5-multi.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Single process analysis of a tree, used without --parallel. An event loop keeps many directory listings, stats
+// and reads in flight at once: a pool of helper threads does the blocking system calls, and wakes the loop through
+// an eventfd when they complete. Everything else (filters, MD5 sums, journal, callback) runs in the loop, so the
+// rest of the program never sees a thread. Each file being hashed has a single read in flight, so its chunks are
+// hashed in order, while the next chunks of the other files are read. Files read in one chunk are hashed together
+// once the completions of a wakeup are handled (@see md5_hash_jobs).
+
+typedef struct {
+    engine_t *engine;
+    configuration_t *the_config;
+    size_t root_length;
+    bool is_destination; // The files of lp25-backup in a destination are not analyzed (@see is_internal_entry)
+    engine_callback_t callback;
+    void *context;
+    engine_queue_t pending_dirs; // Directories to list
+    engine_queue_t listings; // Listed directories whose entries are not all stat-ed yet
+    engine_queue_t waiting_files; // Stat-ed files to hash
+    uint8_t *free_buffers[ENGINE_FILES_IN_FLIGHT];
+    int free_buffers_count;
+    engine_request_t *small_files[ENGINE_FILES_IN_FLIGHT]; // Files read in one chunk, hashed together
+    int small_files_count;
+    int dirs_in_flight;
+    int stats_in_flight;
+    int files_in_flight;
+    int waiting_count;
+} engine_loop_t;
+
+/*!
+ * @brief push_request appends a request to a queue
+ */
+static void push_request(engine_queue_t *queue, engine_request_t *request) {
+    request->next = NULL;
+    if (queue->tail == NULL) {
+        queue->head = request;
+    } else {
+        queue->tail->next = request;
+    }
+    queue->tail = request;
+}
+
+/*!
+ * @brief pop_request removes the first request of a queue
+ * @return the request, NULL if the queue is empty
+ */
+static engine_request_t *pop_request(engine_queue_t *queue) {
+    engine_request_t *request = queue->head;
+    if (request != NULL) {
+        queue->head = request->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+    }
+    return request;
+}
+
+/*!
+ * @brief list_directory reads the relevant entries of a directory, keeping it open for the filters
+ * @param request is the LIST_DIR request
+ */
+static void list_directory(engine_request_t *request) {
+    request->fd = open(request->entry->path_and_name, O_RDONLY | O_DIRECTORY);
+    int dir_fd = request->fd == -1 ? -1 : dup(request->fd);
+    DIR *dir = dir_fd == -1 ? NULL : fdopendir(dir_fd);
+    if (dir == NULL) {
+        request->error = errno;
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        return;
+    }
+    size_t capacity = 4096;
+    request->names = malloc(capacity);
+    request->names_length = 0;
+    struct dirent *dir_entry;
+    while (request->names != NULL && (dir_entry = get_next_entry(dir)) != NULL) {
+        size_t record_length = 1 + strlen(dir_entry->d_name) + 1;
+        if (request->names_length + record_length > capacity) {
+            capacity *= 2;
+            char *names = realloc(request->names, capacity);
+            if (names == NULL) {
+                free(request->names);
+                request->names = NULL;
+                break;
+            }
+            request->names = names;
+        }
+        request->names[request->names_length] = (char) dir_entry->d_type;
+        memcpy(request->names + request->names_length + 1, dir_entry->d_name, record_length - 1);
+        request->names_length += record_length;
+    }
+    closedir(dir);
+    if (request->names == NULL) {
+        request->error = ENOMEM;
+    }
+}
+
+/*!
+ * @brief read_chunk reads the next chunk of a file, opening it on its first read
+ * @param request is the READ request
+ */
+static void read_chunk(engine_request_t *request) {
+    if (request->fd == -1) {
+        request->fd = open(request->entry->path_and_name, O_RDONLY);
+        if (request->fd == -1) {
+            request->error = errno;
+            return;
+        }
+    }
+    request->result = pread(request->fd, request->buffer, ENGINE_READ_SIZE, request->offset);
+    if (request->result == -1) {
+        request->error = errno;
+        return;
+    }
+    throttle_io(request->result, 1);
+}
+
+/*!
+ * @brief helper_loop is the function of the helper threads: they do the blocking calls of the submitted requests
+ * @param parameters is a pointer to the engine
+ */
+static void *helper_loop(void *parameters) {
+    engine_t *engine = (engine_t *) parameters;
+    while (true) {
+        pthread_mutex_lock(&engine->lock);
+        while (engine->submitted.head == NULL && !engine->is_stopping) {
+            pthread_cond_wait(&engine->has_submissions, &engine->lock);
+        }
+        engine_request_t *request = pop_request(&engine->submitted);
+        pthread_mutex_unlock(&engine->lock);
+        if (request == NULL) {
+            return NULL;
+        }
+
+        request->error = 0;
+        switch (request->operation) {
+            case ENGINE_LIST_DIR:
+                list_directory(request);
+                break;
+            case ENGINE_STAT:
+                if (lstat(request->entry->path_and_name, &request->sb) == -1) {
+                    request->error = errno;
+                }
+                break;
+            case ENGINE_READ:
+                read_chunk(request);
+                break;
+        }
+
+        pthread_mutex_lock(&engine->lock);
+        push_request(&engine->completed, request);
+        pthread_mutex_unlock(&engine->lock);
+        uint64_t one = 1;
+        if (write(engine->event_fd, &one, sizeof(one)) == -1) {
+            perror("Unable to wake the event loop");
+        }
+    }
+}
+
+/*!
+ * @brief init_engine starts the helper threads
+ * @param engine is a pointer to the engine to initialize
+ * @return 0 on success (with at least one helper), -1 else
+ */
+static int init_engine(engine_t *engine) {
+    engine->submitted = (engine_queue_t) {NULL, NULL};
+    engine->completed = (engine_queue_t) {NULL, NULL};
+    engine->is_stopping = false;
+    engine->helpers_count = 0;
+    engine->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (engine->event_fd == -1) {
+        return -1;
+    }
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->has_submissions, NULL);
+    for (int i=0; i<ENGINE_HELPERS; ++i) {
+        if (pthread_create(&engine->helpers[i], NULL, helper_loop, engine) != 0) {
+            break;
+        }
+        ++engine->helpers_count;
+    }
+    if (engine->helpers_count == 0) {
+        pthread_mutex_destroy(&engine->lock);
+        pthread_cond_destroy(&engine->has_submissions);
+        close(engine->event_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief clear_engine stops the helper threads once they are idle
+ * @param engine is a pointer to the engine
+ */
+static void clear_engine(engine_t *engine) {
+    pthread_mutex_lock(&engine->lock);
+    engine->is_stopping = true;
+    pthread_cond_broadcast(&engine->has_submissions);
+    pthread_mutex_unlock(&engine->lock);
+    for (int i=0; i<engine->helpers_count; ++i) {
+        pthread_join(engine->helpers[i], NULL);
+    }
+    pthread_mutex_destroy(&engine->lock);
+    pthread_cond_destroy(&engine->has_submissions);
+    close(engine->event_fd);
+}
+
+/*!
+ * @brief submit_request gives a request to the helpers
+ */
+static void submit_request(engine_t *engine, engine_request_t *request, engine_operation_t operation) {
+    request->operation = operation;
+    pthread_mutex_lock(&engine->lock);
+    push_request(&engine->submitted, request);
+    pthread_cond_signal(&engine->has_submissions);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/*!
+ * @brief new_request allocates a request about an entry
+ * @param path is the path of the entry
+ * @return the request, NULL on failure
+ */
+static engine_request_t *new_request(char *path) {
+    engine_request_t *request = calloc(1, sizeof(engine_request_t));
+    if (request == NULL) {
+        return NULL;
+    }
+    request->entry = calloc(1, sizeof(files_list_entry_t));
+    if (request->entry == NULL) {
+        free(request);
+        return NULL;
+    }
+    strncpy(request->entry->path_and_name, path, PATH_SIZE - 1);
+    request->fd = -1;
+    return request;
+}
+
+/*!
+ * @brief free_request frees a request and its entry
+ */
+static void free_request(engine_request_t *request) {
+    free(request->names);
+    free(request->entry);
+    free(request);
+}
+
+/*!
+ * @brief emit_entry gives an analyzed entry to the callback
+ */
+static void emit_entry(engine_loop_t *loop, files_list_entry_t *entry) {
+    set_progress_file(entry->path_and_name);
+    count_progress(PROGRESS_ANALYZED, 1);
+    loop->callback(entry, loop->context);
+}
+
+/*!
+ * @brief report_error displays the error of a failed request
+ */
+static void report_error(engine_request_t *request, char *message) {
+    errno = request->error;
+    fprintf(stderr, "%s %s: %s\n", message, request->entry->path_and_name, strerror(errno));
+}
+
+/*!
+ * @brief stat_next_name submits the stat of the next entry of a listed directory, skipping the excluded ones
+ * @param loop is a pointer to the event loop
+ * @param listing is the LIST_DIR request of the directory
+ * @return true if a stat was submitted, false if the directory has no more entries
+ */
+static bool stat_next_name(engine_loop_t *loop, engine_request_t *listing) {
+    while (listing->names_position < listing->names_length) {
+        struct dirent dir_entry;
+        dir_entry.d_type = (unsigned char) listing->names[listing->names_position];
+        char *name = listing->names + listing->names_position + 1;
+        listing->names_position += 1 + strlen(name) + 1;
+        strncpy(dir_entry.d_name, name, sizeof(dir_entry.d_name) - 1);
+        dir_entry.d_name[sizeof(dir_entry.d_name) - 1] = '\0';
+
+        char path[PATH_SIZE];
+        if (concat_path(path, listing->entry->path_and_name, name) == NULL) {
+            continue;
+        }
+        // Les entrées exclues ne sont ni analysées, ni parcourues (--exclude, --include)
+        if (is_internal_entry(path + loop->root_length, loop->is_destination)
+            || filter_prunes(path + loop->root_length, listing->fd, &dir_entry)) {
+            continue;
+        }
+        count_progress(PROGRESS_LISTED, 1);
+        engine_request_t *request = new_request(path);
+        if (request == NULL) {
+            continue;
+        }
+        submit_request(loop->engine, request, ENGINE_STAT);
+        ++loop->stats_in_flight;
+        return true;
+    }
+    return false;
+}
+
+/*!
+ * @brief schedule submits as many requests as the limits allow
+ * @param loop is a pointer to the event loop
+ */
+static void schedule(engine_loop_t *loop) {
+    while (loop->dirs_in_flight < ENGINE_DIRS_IN_FLIGHT && loop->pending_dirs.head != NULL) {
+        submit_request(loop->engine, pop_request(&loop->pending_dirs), ENGINE_LIST_DIR);
+        ++loop->dirs_in_flight;
+    }
+    // Stats pause while too many files wait to be hashed, to bound the memory
+    while (loop->stats_in_flight < ENGINE_STATS_IN_FLIGHT && loop->waiting_count < ENGINE_WAITING_MAX
+           && loop->listings.head != NULL) {
+        engine_request_t *listing = loop->listings.head;
+        if (!stat_next_name(loop, listing)) {
+            close(pop_request(&loop->listings)->fd);
+            free_request(listing);
+        }
+    }
+    while (loop->free_buffers_count > 0 && loop->waiting_files.head != NULL) {
+        engine_request_t *request = pop_request(&loop->waiting_files);
+        --loop->waiting_count;
+        request->buffer = loop->free_buffers[--loop->free_buffers_count];
+        request->offset = 0;
+        submit_request(loop->engine, request, ENGINE_READ);
+        ++loop->files_in_flight;
+    }
+}
+
+/*!
+ * @brief finish_read ends the hashing of a file, giving its buffer back
+ */
+static void finish_read(engine_loop_t *loop, engine_request_t *request) {
+    if (request->fd != -1) {
+        close(request->fd);
+    }
+    loop->free_buffers[loop->free_buffers_count++] = request->buffer;
+    --loop->files_in_flight;
+    free_request(request);
+}
+
+/*!
+ * @brief handle_stat handles a completed stat: directories are emitted then listed, files are hashed if needed
+ */
+static void handle_stat(engine_loop_t *loop, engine_request_t *request) {
+    --loop->stats_in_flight;
+    if (request->error != 0 || set_file_stats(request->entry, &request->sb) == -1) {
+        free_request(request);
+        return;
+    }
+    if (request->entry->entry_type == DOSSIER) {
+        emit_entry(loop, request->entry);
+        push_request(&loop->pending_dirs, request);
+        return;
+    }
+    // Le journal d'une synchronisation interrompue évite de recalculer les sommes des fichiers inchangés
+    if (!loop->the_config->uses_md5 || journal_reuse_analysis(request->entry)) {
+        emit_entry(loop, request->entry);
+        free_request(request);
+        return;
+    }
+    push_request(&loop->waiting_files, request);
+    ++loop->waiting_count;
+}
+
+/*!
+ * @brief handle_read hashes a completed read, then reads the next chunk or ends the file
+ */
+static void handle_read(engine_loop_t *loop, engine_request_t *request) {
+    if (request->error != 0) {
+        report_error(request, "Unable to read");
+        if (request->md5 != NULL) {
+            finish_md5(request->md5, request->entry->md5sum);
+        }
+        finish_read(loop, request);
+        return;
+    }
+    // Un fichier lu en une seule fois attend les autres petits fichiers (@see hash_small_files)
+    if (request->offset == 0 && request->result < ENGINE_READ_SIZE) {
+        count_progress(PROGRESS_BYTES_HASHED, request->result);
+        loop->small_files[loop->small_files_count++] = request;
+        return;
+    }
+    if (request->md5 == NULL && (request->md5 = start_md5()) == NULL) {
+        fprintf(stderr, "Unable to hash %s\n", request->entry->path_and_name);
+        finish_read(loop, request);
+        return;
+    }
+    if (request->result > 0) {
+        update_md5(request->md5, request->buffer, request->result);
+        count_progress(PROGRESS_BYTES_HASHED, request->result);
+        request->offset += request->result;
+        submit_request(loop->engine, request, ENGINE_READ);
+        return;
+    }
+    if (finish_md5(request->md5, request->entry->md5sum) == 0) {
+        journal_record_analysis(request->entry);
+        emit_entry(loop, request->entry);
+    }
+    finish_read(loop, request);
+}
+
+/*!
+ * @brief hash_small_files hashes the files read in one chunk together, then ends them
+ * @param loop is a pointer to the event loop
+ */
+static void hash_small_files(engine_loop_t *loop) {
+    md5_job_t jobs[ENGINE_FILES_IN_FLIGHT];
+    for (int i=0; i<loop->small_files_count; ++i) {
+        engine_request_t *request = loop->small_files[i];
+        jobs[i] = (md5_job_t) {request->buffer, (size_t) request->result, request->entry->md5sum};
+    }
+    md5_hash_jobs(jobs, loop->small_files_count);
+    for (int i=0; i<loop->small_files_count; ++i) {
+        journal_record_analysis(loop->small_files[i]->entry);
+        emit_entry(loop, loop->small_files[i]->entry);
+        finish_read(loop, loop->small_files[i]);
+    }
+    loop->small_files_count = 0;
+}
+
+/*!
+ * @brief handle_completion handles a request completed by a helper
+ */
+static void handle_completion(engine_loop_t *loop, engine_request_t *request) {
+    switch (request->operation) {
+        case ENGINE_LIST_DIR:
+            --loop->dirs_in_flight;
+            if (request->error != 0) {
+                report_error(request, "Unable to open directory");
+                if (request->fd != -1) {
+                    close(request->fd);
+                }
+                free_request(request);
+            } else {
+                request->names_position = 0;
+                push_request(&loop->listings, request);
+            }
+            break;
+        case ENGINE_STAT:
+            handle_stat(loop, request);
+            break;
+        case ENGINE_READ:
+            handle_read(loop, request);
+            break;
+    }
+}
+
+/*!
+ * @brief analyze_tree_async lists and analyzes a tree (its root excluded) in the calling process
+ * Entries are given to the callback as they are analyzed, in no particular order. MD5 sums are only computed when
+ * uses_md5 is set.
+ * @param root is the directory to analyze
+ * @param is_destination tells if root is a destination, whose internal files are skipped
+ * @param the_config is a pointer to the configuration
+ * @param callback is called on every analyzed entry, the entry is freed when it returns
+ * @param context is passed as is to callback
+ * @return 0 on success, -1 if the engine could not be started (nothing was analyzed)
+ */
+int analyze_tree_async(char *root, bool is_destination, configuration_t *the_config, engine_callback_t callback, void *context) {
+    engine_t engine;
+    engine_loop_t loop = {
+        .engine = &engine,
+        .the_config = the_config,
+        .root_length = path_prefix_length(root),
+        .is_destination = is_destination,
+        .callback = callback,
+        .context = context,
+    };
+    engine_request_t *root_request = new_request(root);
+    uint8_t *buffers = malloc((size_t) ENGINE_FILES_IN_FLIGHT * ENGINE_READ_SIZE);
+    if (root_request == NULL || buffers == NULL) {
+        if (root_request != NULL) {
+            free_request(root_request);
+        }
+        free(buffers);
+        return -1;
+    }
+    if (init_engine(&engine) == -1) {
+        perror("Unable to start the analysis engine");
+        free_request(root_request);
+        free(buffers);
+        return -1;
+    }
+    for (int i=0; i<ENGINE_FILES_IN_FLIGHT; ++i) {
+        loop.free_buffers[i] = buffers + (size_t) i * ENGINE_READ_SIZE;
+    }
+    loop.free_buffers_count = ENGINE_FILES_IN_FLIGHT;
+    push_request(&loop.pending_dirs, root_request);
+
+    while (true) {
+        schedule(&loop);
+        if (loop.dirs_in_flight + loop.stats_in_flight + loop.files_in_flight == 0) {
+            break;
+        }
+        uint64_t completions;
+        if (read(engine.event_fd, &completions, sizeof(completions)) == -1 && errno != EINTR) {
+            perror("Unable to wait for the analysis engine");
+            break;
+        }
+        pthread_mutex_lock(&engine.lock);
+        engine_request_t *completed = engine.completed.head;
+        engine.completed = (engine_queue_t) {NULL, NULL};
+        pthread_mutex_unlock(&engine.lock);
+        while (completed != NULL) {
+            engine_request_t *next = completed->next;
+            handle_completion(&loop, completed);
+            completed = next;
+        }
+        // Les tampons des petits fichiers sont rendus avant d'attendre d'autres complétions
+        hash_small_files(&loop);
+    }
+
+    clear_engine(&engine);
+    free(buffers);
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "autoscale.h"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+// The number of analyze requests a lister keeps in flight is tuned by hill climbing on the analysis throughput:
+// a change that improved it is repeated, a change that degraded it is reverted. When the lister never waits for
+// an analyzer, the analyzers are not the bottleneck and their count shrinks.
+
+/*!
+ * @brief now_seconds gives a monotonic time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*!
+ * @brief available_cpus_count gives the number of online CPUs
+ * @return the number of CPUs, at least 1
+ */
+uint16_t available_cpus_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > UINT16_MAX ? UINT16_MAX : (uint16_t) cpus;
+}
+
+/*!
+ * @brief is_rotational_storage tells if a path is stored on a rotational disk, according to sysfs
+ * Partitions do not have a queue directory, the one of their parent disk is used then.
+ * @param path is a path on the device to test
+ * @return true for a rotational disk, false else (including when it cannot be known)
+ */
+bool is_rotational_storage(char *path) {
+    struct stat sb;
+    if (stat(path, &sb) == -1) {
+        return false;
+    }
+    char sysfs_path[128];
+    FILE *flag = NULL;
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u/queue/rotational", major(sb.st_dev), minor(sb.st_dev));
+    flag = fopen(sysfs_path, "r");
+    if (flag == NULL) {
+        snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u/../queue/rotational", major(sb.st_dev), minor(sb.st_dev));
+        flag = fopen(sysfs_path, "r");
+    }
+    if (flag == NULL) {
+        return false;
+    }
+    int rotational = fgetc(flag);
+    fclose(flag);
+    return rotational == '1';
+}
+
+/*!
+ * @brief initial_analyzers_count gives the starting number of analyzers for a tree
+ * Random reads thrash rotational disks, so they start with 2 analyzers, others start with one per CPU.
+ * @param path is the root of the tree to analyze
+ * @param max_count is the size of the analyzers pool
+ * @return the initial count, between 1 and max_count
+ */
+uint16_t initial_analyzers_count(char *path, uint16_t max_count) {
+    uint16_t count = is_rotational_storage(path) ? 2 : available_cpus_count();
+    if (count > max_count) {
+        count = max_count;
+    }
+    return count < 1 ? 1 : count;
+}
+
+/*!
+ * @brief init_autoscale initializes the controller of a lister
+ * @param autoscale is a pointer to the controller
+ * @param name is the side of the lister, for the logs
+ * @param initial_count is the starting number of analyze requests in flight
+ * @param max_count is the size of the analyzers pool
+ * @param verbose enables logging the scaling decisions
+ */
+void init_autoscale(autoscale_t *autoscale, char *name, uint16_t initial_count, uint16_t max_count, bool verbose) {
+    autoscale->name = name;
+    autoscale->verbose = verbose;
+    autoscale->min_count = 1;
+    autoscale->max_count = max_count < 1 ? 1 : max_count;
+    autoscale->current_count = initial_count < 1 ? 1 : initial_count;
+    autoscale->step = 1;
+    autoscale->window_start = now_seconds();
+    autoscale->window_files = 0;
+    autoscale->window_bytes = 0;
+    autoscale->window_dispatches = 0;
+    autoscale->window_waits = 0;
+    autoscale->window_in_flight = 0;
+    autoscale->previous_throughput = 0.0;
+    autoscale->best_latency = 0.0;
+    autoscale->hold_windows = 0;
+}
+
+/*!
+ * @brief autoscale_record accounts one analyzed entry
+ * @param autoscale is a pointer to the controller
+ * @param bytes is the number of bytes read to analyze the entry (0 for directories)
+ */
+void autoscale_record(autoscale_t *autoscale, uint64_t bytes) {
+    ++autoscale->window_files;
+    autoscale->window_bytes += bytes;
+}
+
+/*!
+ * @brief autoscale_update samples the lister state before a dispatch, and rescales at the end of each window
+ * @param autoscale is a pointer to the controller
+ * @param in_flight is the number of analyze requests in flight
+ * @param has_waited is true when the dispatch waits because all allowed analyzers are busy
+ * @return the number of analyze requests allowed in flight
+ */
+uint16_t autoscale_update(autoscale_t *autoscale, int in_flight, bool has_waited) {
+    ++autoscale->window_dispatches;
+    autoscale->window_in_flight += in_flight;
+    if (has_waited) {
+        ++autoscale->window_waits;
+    }
+
+    double now = now_seconds();
+    double elapsed = now - autoscale->window_start;
+    if (elapsed < AUTOSCALE_MIN_WINDOW || (autoscale->window_files < AUTOSCALE_WINDOW_FILES && elapsed < AUTOSCALE_MAX_WINDOW)) {
+        return autoscale->current_count;
+    }
+
+    double throughput = (autoscale->window_bytes + (double) autoscale->window_files * AUTOSCALE_FILE_COST) / elapsed;
+    double average_in_flight = (double) autoscale->window_in_flight / autoscale->window_dispatches;
+    // Little's law: latency = requests in flight / completion rate
+    double latency = autoscale->window_files > 0 ? average_in_flight * elapsed / autoscale->window_files : 0.0;
+    bool is_backlogged = 2 * autoscale->window_waits > autoscale->window_dispatches;
+
+    int step = autoscale->step;
+    if (!is_backlogged) {
+        step = -1;
+    } else if (throughput > autoscale->previous_throughput * 1.05) {
+        step = step == 0 ? 1 : step;
+        autoscale->hold_windows = 0;
+    } else if (throughput < autoscale->previous_throughput * 0.95) {
+        step = -step;
+        autoscale->hold_windows = 0;
+    } else if (autoscale->best_latency > 0.0 && latency > 1.5 * autoscale->best_latency) {
+        // Same throughput at a higher latency: the device is saturated
+        step = -1;
+    } else {
+        // Flat throughput: hold, but probe a bigger pool from time to time
+        step = ++autoscale->hold_windows % 8 == 0 ? 1 : 0;
+    }
+
+    uint16_t previous_count = autoscale->current_count;
+    int delta = autoscale->current_count / 4 > 1 ? autoscale->current_count / 4 : 1;
+    int next_count = autoscale->current_count + step * delta;
+    if (next_count < autoscale->min_count) {
+        next_count = autoscale->min_count;
+    }
+    if (next_count > autoscale->max_count) {
+        next_count = autoscale->max_count;
+    }
+    autoscale->current_count = (uint16_t) next_count;
+    autoscale->step = step;
+    if (autoscale->verbose && autoscale->current_count != previous_count) {
+        printf("[%s] analyzers %u -> %u (%.1f MB/s, %.2f ms/file, %.1f in flight, %s)\n", autoscale->name,
+               previous_count, autoscale->current_count, autoscale->window_bytes / elapsed / 1e6, latency * 1e3,
+               average_in_flight, is_backlogged ? "backlogged" : "idle analyzers");
+    }
+
+    if (latency > 0.0 && (autoscale->best_latency == 0.0 || latency < autoscale->best_latency)) {
+        autoscale->best_latency = latency;
+    }
+    autoscale->previous_throughput = throughput;
+    autoscale->window_start = now;
+    autoscale->window_files = 0;
+    autoscale->window_bytes = 0;
+    autoscale->window_dispatches = 0;
+    autoscale->window_waits = 0;
+    autoscale->window_in_flight = 0;
+    return autoscale->current_count;
+}
@@ -4,8 +4,14 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include "utility.h"
+#include "file-properties.h"
+#include "autoscale.h"
+#include "filter.h"
+#include "agent.h"
 
-typedef enum {DATE_SIZE_ONLY, NO_PARALLEL} long_opt_values;
+typedef enum {DATE_SIZE_ONLY, NO_PARALLEL, MEMORY_LIMIT = 0x100, DETECT_MOVES, DEDUP, DEDUP_VERIFY, LINK_DEST, BWLIMIT, IOPS_LIMIT, IO_CLASS, LOCALITY, JOURNAL, RESUME, ATOMIC, HASH_COPIES, EXCLUDE, INCLUDE, EXCLUDE_FROM, AGENT, LISTEN, REMOTE, REMOTE_SOCKET, PROGRESS, PROGRESS_FD, PROGRESS_SOCKET} long_opt_values;
 
 /*!
  * @brief function display_help displays a brief manual for the program usage
@@ -13,11 +19,36 @@ typedef enum {DATE_SIZE_ONLY, NO_PARALLEL} long_opt_values;
  * This function is provided with its code, you don't have to implement nor modify it.
  */
 void display_help(char *my_name) {
-    printf("%s [options] source_dir destination_dir\n", my_name);
+    printf("%s [options] source_dir destination_dir [destination_dir...]\n", my_name);
+    printf("%s --agent [--listen <socket>] destination_dir\n", my_name);
     printf("Options: \t-n <processes count>\tnumber of processes for file calculations\n");
+    printf("         \t-n auto scales the processes for file calculations at runtime\n");
     printf("         \t-h display help (this text)\n");
     printf("         \t--date_size_only disables MD5 calculation for files\n");
     printf("         \t--no-parallel disables parallel computing (cancels values of option -n)\n");
+    printf("         \t--memory-limit <size> bounds the memory used by files lists (K, M, G suffixes), spilling to temporary files\n");
+    printf("         \t--detect-moves renames moved files in the destination instead of copying them again\n");
+    printf("         \t--dedup reflinks or hard links files whose content is already in the destination\n");
+    printf("         \t--dedup-verify compares bytes before deduplicating (implies --dedup)\n");
+    printf("         \t--link-dest=<previous> makes a snapshot, hard linking files unchanged since the previous one\n");
+    printf("         \t--bwlimit <size> limits the bytes read and written per second (K, M, G suffixes)\n");
+    printf("         \t--iops-limit <count> limits the I/O operations per second\n");
+    printf("         \t--io-class=idle|best-effort sets the I/O scheduling class of all processes\n");
+    printf("         \t--locality=inode|extent analyzes and copies files in physical order (rotational or network storage)\n");
+    printf("         \t--journal keeps a journal in the destination to resume an interrupted synchronization\n");
+    printf("         \t--resume resumes an interrupted synchronization from its journal (implies --journal)\n");
+    printf("         \t--atomic writes copies to temporary files, made durable and renamed by batches\n");
+    printf("         \t--hash-copies hashes files while copying them, verifies them and keeps their sums in the destination\n");
+    printf("         \t--exclude <pattern> skips the matching files and directories (gitignore syntax, repeatable)\n");
+    printf("         \t--include <pattern> keeps the matching entries excluded by a previous pattern\n");
+    printf("         \t--exclude-from <file> reads exclude patterns from a file, '!' for include patterns\n");
+    printf("         \t--agent serves the destination to a remote lp25-backup through stdin and stdout\n");
+    printf("         \t--listen <socket> makes the agent serve through a Unix socket instead\n");
+    printf("         \t--remote <command> lets an agent started by command handle the destination, e.g. \"ssh host lp25-backup --agent /backup\"\n");
+    printf("         \t--remote-socket <socket> lets the agent listening on socket handle the destination\n");
+    printf("         \t--progress displays the progress, the throughput and an ETA on a single line of stderr\n");
+    printf("         \t--progress-fd <fd> writes the progress to a file descriptor, one JSON object per line\n");
+    printf("         \t--progress-socket <socket> writes the JSON progress to a Unix socket instead\n");
 }
 
 /*!
@@ -30,11 +61,33 @@ void init_configuration(configuration_t *the_config) {
     }
     the_config->source[0] = '\0';
     the_config->destination[0] = '\0'; 
+    the_config->destinations_count = 0;
+    the_config->link_dest[0] = '\0';
     the_config->processes_count = 1;
+    the_config->auto_processes = false;
     the_config->is_parallel = true;
     the_config->uses_md5 = true;
     the_config->verbose = false;
     the_config->dry_run = false;
+    the_config->detect_moves = false;
+    the_config->dedup = false;
+    the_config->dedup_verify = false;
+    the_config->bwlimit = 0;
+    the_config->iops_limit = 0;
+    the_config->io_class = IO_CLASS_DEFAULT;
+    the_config->locality = LOCALITY_NONE;
+    the_config->memory_limit = 0;
+    the_config->journal = false;
+    the_config->resume = false;
+    the_config->atomic = false;
+    the_config->hash_copies = false;
+    the_config->agent = false;
+    the_config->agent_socket[0] = '\0';
+    the_config->remote_command[0] = '\0';
+    the_config->remote_socket[0] = '\0';
+    the_config->progress = false;
+    the_config->progress_fd = -1;
+    the_config->progress_socket[0] = '\0';
 }
 
 /*!
@@ -52,6 +105,29 @@ int set_configuration(configuration_t *the_config, int argc, char *argv[]) {
         {"no-parallel",    no_argument,       0, 'p'},
         {"dry-run",        no_argument,       0, 'r'},
         {"verbose",        no_argument,       0, 'v'},
+        {"memory-limit",   required_argument, 0, MEMORY_LIMIT},
+        {"detect-moves",   no_argument,       0, DETECT_MOVES},
+        {"dedup",          no_argument,       0, DEDUP},
+        {"dedup-verify",   no_argument,       0, DEDUP_VERIFY},
+        {"link-dest",      required_argument, 0, LINK_DEST},
+        {"bwlimit",        required_argument, 0, BWLIMIT},
+        {"iops-limit",     required_argument, 0, IOPS_LIMIT},
+        {"io-class",       required_argument, 0, IO_CLASS},
+        {"locality",       required_argument, 0, LOCALITY},
+        {"journal",        no_argument,       0, JOURNAL},
+        {"resume",         no_argument,       0, RESUME},
+        {"atomic",         no_argument,       0, ATOMIC},
+        {"hash-copies",    no_argument,       0, HASH_COPIES},
+        {"exclude",        required_argument, 0, EXCLUDE},
+        {"include",        required_argument, 0, INCLUDE},
+        {"exclude-from",   required_argument, 0, EXCLUDE_FROM},
+        {"agent",          no_argument,       0, AGENT},
+        {"listen",         required_argument, 0, LISTEN},
+        {"remote",         required_argument, 0, REMOTE},
+        {"remote-socket",  required_argument, 0, REMOTE_SOCKET},
+        {"progress",       no_argument,       0, PROGRESS},
+        {"progress-fd",    required_argument, 0, PROGRESS_FD},
+        {"progress-socket", required_argument, 0, PROGRESS_SOCKET},
         {0, 0, 0, 0}
     };
 
@@ -64,26 +140,250 @@ int set_configuration(configuration_t *the_config, int argc, char *argv[]) {
                 the_config->is_parallel = false;
                 break;
             case 'r':
-                // handle dry-run option
+                the_config->dry_run = true;
                 break;
             case 'v':
-                // handle verbose option
+                the_config->verbose = true;
                 break;
             case 'n':
-                the_config->processes_count = atoi(optarg);
+                if (strcmp(optarg, "auto") == 0) {
+                    // The pool allows twice the CPUs, the listers start with less (@see initial_analyzers_count)
+                    uint32_t pool_size = 2 * (uint32_t) available_cpus_count();
+                    the_config->auto_processes = true;
+                    the_config->processes_count = pool_size > ANALYZERS_MAX ? ANALYZERS_MAX : pool_size;
+                } else {
+                    char *end;
+                    long count = strtol(optarg, &end, 10);
+                    if (*end != '\0' || count < 1 || count > ANALYZERS_MAX) {
+                        printf("Invalid processes count: %s (1 to %d, or auto)\n", optarg, ANALYZERS_MAX);
+                        return -1;
+                    }
+                    the_config->auto_processes = false;
+                    the_config->processes_count = (uint16_t) count;
+                }
+                break;
+            case DETECT_MOVES:
+                the_config->detect_moves = true;
+                break;
+            case DEDUP_VERIFY:
+                the_config->dedup_verify = true;
+                // fall through
+            case DEDUP:
+                the_config->dedup = true;
+                break;
+            case LINK_DEST:
+                if (!directory_exists(optarg)) {
+                    printf("Previous snapshot %s does not exist\n", optarg);
+                    return -1;
+                }
+                strncpy(the_config->link_dest, optarg, sizeof(the_config->link_dest) - 1);
+                break;
+            case BWLIMIT:
+                if (parse_size(optarg, &the_config->bwlimit) == -1) {
+                    printf("Invalid bandwidth limit: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case IOPS_LIMIT: {
+                char *end;
+                unsigned long iops = strtoul(optarg, &end, 10);
+                if (*end != '\0' || iops > UINT32_MAX) {
+                    printf("Invalid IOPS limit: %s\n", optarg);
+                    return -1;
+                }
+                the_config->iops_limit = (uint32_t) iops;
+                break;
+            }
+            case IO_CLASS:
+                if (strcmp(optarg, "idle") == 0) {
+                    the_config->io_class = IO_CLASS_IDLE;
+                } else if (strcmp(optarg, "best-effort") == 0) {
+                    the_config->io_class = IO_CLASS_BEST_EFFORT;
+                } else {
+                    printf("Invalid I/O class: %s (idle or best-effort)\n", optarg);
+                    return -1;
+                }
+                break;
+            case LOCALITY:
+                if (strcmp(optarg, "inode") == 0) {
+                    the_config->locality = LOCALITY_INODE;
+                } else if (strcmp(optarg, "extent") == 0) {
+                    the_config->locality = LOCALITY_EXTENT;
+                } else {
+                    printf("Invalid locality: %s (inode or extent)\n", optarg);
+                    return -1;
+                }
+                break;
+            case RESUME:
+                the_config->resume = true;
+                // fall through
+            case JOURNAL:
+                the_config->journal = true;
+                break;
+            case ATOMIC:
+                the_config->atomic = true;
+                break;
+            case HASH_COPIES:
+                the_config->hash_copies = true;
+                break;
+            case EXCLUDE:
+            case INCLUDE:
+                if (add_filter_rule(optarg, opt == INCLUDE) == -1) {
+                    printf("Invalid pattern: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case EXCLUDE_FROM:
+                if (add_filter_rules_from(optarg) == -1) {
+                    printf("Unable to read the patterns of %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case AGENT:
+                the_config->agent = true;
+                break;
+            case LISTEN:
+            case REMOTE_SOCKET:
+            case PROGRESS_SOCKET: {
+                char *socket_path = opt == LISTEN ? the_config->agent_socket
+                                    : opt == REMOTE_SOCKET ? the_config->remote_socket : the_config->progress_socket;
+                if (strlen(optarg) >= sizeof(the_config->agent_socket)) {
+                    printf("Socket path too long: %s\n", optarg);
+                    return -1;
+                }
+                strcpy(socket_path, optarg);
+                break;
+            }
+            case REMOTE:
+                strncpy(the_config->remote_command, optarg, sizeof(the_config->remote_command) - 1);
+                break;
+            case PROGRESS:
+                the_config->progress = true;
+                break;
+            case PROGRESS_FD: {
+                char *end;
+                long fd = strtol(optarg, &end, 10);
+                if (*end != '\0' || fd < 0 || fcntl((int) fd, F_GETFD) == -1) {
+                    printf("Invalid progress file descriptor: %s\n", optarg);
+                    return -1;
+                }
+                the_config->progress_fd = (int) fd;
+                break;
+            }
+            case MEMORY_LIMIT:
+                if (parse_size(optarg, &the_config->memory_limit) == -1) {
+                    printf("Invalid memory limit: %s\n", optarg);
+                    return -1;
+                }
                 break;
             default:
                 return -1;
         }
     }
 
-    // Copy remaining arguments to source and destination
+    // Moves are matched on MD5 sums, and need both lists in memory. With --link-dest, they would move files of
+    // the previous snapshot
+    if (the_config->detect_moves && (!the_config->uses_md5 || the_config->memory_limit > 0 || the_config->link_dest[0] != '\0')) {
+        printf("--detect-moves requires MD5 sums and is not available with --memory-limit nor --link-dest, disabling it\n");
+        the_config->detect_moves = false;
+    }
+
+    // The dedup index grows with the number of distinct files, it would defeat the memory limit
+    if (the_config->dedup && (!the_config->uses_md5 || the_config->memory_limit > 0)) {
+        printf("--dedup requires MD5 sums and is not available with --memory-limit, disabling it\n");
+        the_config->dedup = false;
+        the_config->dedup_verify = false;
+    }
+
+    // Copy remaining arguments to source and destinations
     if (optind < argc) {
         strncpy(the_config->source, argv[optind++], sizeof(the_config->source));
         if (optind < argc) {
             strncpy(the_config->destination, argv[optind++], sizeof(the_config->destination));
+            the_config->destinations_count = 1;
+        }
+    }
+    // The agent only gets the directory it serves
+    if (the_config->agent) {
+        strcpy(the_config->destination, the_config->source);
+        the_config->source[0] = '\0';
+        the_config->destinations_count = 1;
+        return 0;
+    }
+    for (; optind < argc; ++optind) {
+        if (the_config->destinations_count == DESTINATIONS_MAX) {
+            printf("Too many destinations (at most %d)\n", DESTINATIONS_MAX);
+            return -1;
+        }
+        // The first destination is checked by main
+        if (!directory_exists(argv[optind]) || !is_directory_writable(argv[optind])) {
+            printf("Destination directory %s does not exist or is not writable\n", argv[optind]);
+            return -1;
         }
+        char *extra_destination = the_config->extra_destinations[the_config->destinations_count - 1];
+        strncpy(extra_destination, argv[optind], sizeof(the_config->extra_destinations[0]) - 1);
+        extra_destination[sizeof(the_config->extra_destinations[0]) - 1] = '\0';
+        ++the_config->destinations_count;
+    }
+
+    // The agent serves a single destination, the others would silently be left out
+    if (is_remote_destination(the_config) && the_config->destinations_count > 1) {
+        printf("--remote and --remote-socket support a single destination\n");
+        return -1;
+    }
+
+    // Those features keep an index of a single destination, or change how it is written
+    if (the_config->destinations_count > 1 && (the_config->memory_limit > 0 || the_config->detect_moves
+        || the_config->dedup || the_config->link_dest[0] != '\0' || the_config->atomic)) {
+        printf("--memory-limit, --detect-moves, --dedup, --link-dest and --atomic need a single destination, disabling them\n");
+        the_config->memory_limit = 0;
+        the_config->detect_moves = false;
+        the_config->dedup = false;
+        the_config->dedup_verify = false;
+        the_config->link_dest[0] = '\0';
+        the_config->atomic = false;
+    }
+
+    // The agent lists and writes the destination on its side, with the default options
+    if (is_remote_destination(the_config) && (the_config->memory_limit > 0
+        || the_config->detect_moves || the_config->dedup || the_config->link_dest[0] != '\0' || the_config->atomic || the_config->journal
+        || the_config->hash_copies)) {
+        printf("--remote does not support --memory-limit, --detect-moves, --dedup, --link-dest, --atomic, --journal nor --hash-copies, disabling them\n");
+        the_config->memory_limit = 0;
+        the_config->detect_moves = false;
+        the_config->dedup = false;
+        the_config->dedup_verify = false;
+        the_config->link_dest[0] = '\0';
+        the_config->atomic = false;
+        the_config->journal = false;
+        the_config->resume = false;
+        the_config->hash_copies = false;
+    }
+
+    if (the_config->progress_fd != -1 && the_config->progress_socket[0] != '\0') {
+        printf("--progress-fd and --progress-socket cannot be used together\n");
+        return -1;
+    }
+
+    // Pruned bytes are only counted to be reported
+    set_filter_report(the_config->verbose);
+
+    // The journal and the manifest live in the destination, which is never written by a dry run
+    if (the_config->dry_run) {
+        the_config->journal = false;
+        the_config->resume = false;
+        the_config->hash_copies = false;
     }
 
     return 0;
 }
+
+/*!
+ * @brief get_destination gives a destination directory
+ * @param the_config is a pointer to the configuration
+ * @param index is the index of the destination, 0 being the destination parameter
+ * @return the path of the destination
+ */
+char *get_destination(configuration_t *the_config, uint8_t index) {
+    return index == 0 ? the_config->destination : the_config->extra_destinations[index - 1];
+}
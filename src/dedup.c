@@ -0,0 +1,250 @@
+#include "dedup.h"
+#include "staging.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEDUP_INITIAL_CAPACITY 1024
+#define DEDUP_COMPARE_BUFFER 65536
+
+// The dedup index maps contents (size and MD5 sum) to a destination file already holding them. Files with a
+// known content are cloned (FICLONE) from it when the filesystem supports reflinks, or hard linked to it when
+// their mode and mtime are the same (a hard link shares them).
+
+/*!
+ * @brief hash_content computes the first slot for a content
+ */
+static size_t hash_content(uint64_t size, uint8_t *md5sum, size_t capacity) {
+    uint64_t hash;
+    memcpy(&hash, md5sum, sizeof(hash));
+    hash ^= size * 0x9E3779B97F4A7C15ULL;
+    return hash % capacity;
+}
+
+/*!
+ * @brief find_slot finds the slot of a content, or the empty slot where it would be inserted
+ */
+static dedup_slot_t *find_slot(dedup_index_t *index, uint64_t size, uint8_t *md5sum) {
+    size_t slot = hash_content(size, md5sum, index->capacity);
+    while (index->slots[slot].path != NULL) {
+        if (index->slots[slot].size == size && memcmp(index->slots[slot].md5sum, md5sum, 16) == 0) {
+            break;
+        }
+        slot = (slot + 1) % index->capacity;
+    }
+    return &index->slots[slot];
+}
+
+/*!
+ * @brief grow_index doubles the capacity of the index, rehashing its slots
+ * @return 0 on success, -1 else
+ */
+static int grow_index(dedup_index_t *index) {
+    dedup_index_t grown = *index;
+    grown.capacity = 2 * index->capacity;
+    grown.slots = calloc(grown.capacity, sizeof(dedup_slot_t));
+    if (grown.slots == NULL) {
+        return -1;
+    }
+    for (size_t i=0; i<index->capacity; ++i) {
+        if (index->slots[i].path != NULL) {
+            *find_slot(&grown, index->slots[i].size, index->slots[i].md5sum) = index->slots[i];
+        }
+    }
+    free(index->slots);
+    *index = grown;
+    return 0;
+}
+
+/*!
+ * @brief files_are_identical compares two files byte per byte
+ * @return true if both files could be read and have the same content, false else
+ */
+static bool files_are_identical(char *lhs_path, char *rhs_path) {
+    FILE *lhs = fopen(lhs_path, "rb");
+    FILE *rhs = fopen(rhs_path, "rb");
+    bool identical = lhs != NULL && rhs != NULL;
+    static unsigned char lhs_buffer[DEDUP_COMPARE_BUFFER];
+    static unsigned char rhs_buffer[DEDUP_COMPARE_BUFFER];
+    while (identical) {
+        size_t lhs_bytes = fread(lhs_buffer, 1, sizeof(lhs_buffer), lhs);
+        size_t rhs_bytes = fread(rhs_buffer, 1, sizeof(rhs_buffer), rhs);
+        if (lhs_bytes != rhs_bytes || memcmp(lhs_buffer, rhs_buffer, lhs_bytes) != 0) {
+            identical = false;
+        } else if (lhs_bytes == 0) {
+            break;
+        }
+    }
+    if (lhs != NULL) {
+        fclose(lhs);
+    }
+    if (rhs != NULL) {
+        fclose(rhs);
+    }
+    return identical;
+}
+
+/*!
+ * @brief reflink_file clones the content of an existing destination file into a new one
+ * The clone is made in a temporary file renamed over the destination once complete, so that a previous version of
+ * the destination (possibly hard linked to other files) is never truncated.
+ * @param existing_path is the destination file holding the content
+ * @param destination_path is the file to create
+ * @param source_entry gives the mode and mtime of the new file
+ * @return 0 on success, -1 if the filesystem cannot clone (nothing is left behind then)
+ */
+static int reflink_file(char *existing_path, char *destination_path, files_list_entry_t *source_entry) {
+    int existing_fd = open(existing_path, O_RDONLY);
+    if (existing_fd == -1) {
+        return -1;
+    }
+    char temp_path[PATH_SIZE];
+    int destination_fd = open_named_temp(temp_path, destination_path, source_entry->mode & 07777);
+    if (destination_fd == -1) {
+        close(existing_fd);
+        return -1;
+    }
+    if (ioctl(destination_fd, FICLONE, existing_fd) == -1) {
+        close(existing_fd);
+        close(destination_fd);
+        unlink(temp_path);
+        return -1;
+    }
+    struct timespec times[2] = {{0, UTIME_OMIT}, source_entry->mtime};
+    fchmod(destination_fd, source_entry->mode & 07777);
+    futimens(destination_fd, times);
+    close(existing_fd);
+    close(destination_fd);
+    if (rename(temp_path, destination_path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief hardlink_file links a new destination file to an existing one with the same content and metadata
+ * @param existing_path is the destination file holding the content
+ * @param destination_path is the file to create (replaced if it exists)
+ * @param source_entry gives the expected mode and mtime
+ * @return 0 on success, -1 else
+ */
+static int hardlink_file(char *existing_path, char *destination_path, files_list_entry_t *source_entry) {
+    struct stat sb;
+    if (stat(existing_path, &sb) == -1
+        || (sb.st_mode & 07777) != (source_entry->mode & 07777)
+        || sb.st_mtim.tv_sec != source_entry->mtime.tv_sec
+        || sb.st_mtim.tv_nsec != source_entry->mtime.tv_nsec) {
+        return -1;
+    }
+    if (unlink(destination_path) == -1 && errno != ENOENT) {
+        return -1;
+    }
+    return link(existing_path, destination_path);
+}
+
+/*!
+ * @brief init_dedup_index initializes an empty dedup index
+ * @param index is a pointer to the index to initialize
+ * @return 0 on success, -1 else
+ */
+int init_dedup_index(dedup_index_t *index) {
+    memset(index, 0, sizeof(dedup_index_t));
+    index->capacity = DEDUP_INITIAL_CAPACITY;
+    index->slots = calloc(index->capacity, sizeof(dedup_slot_t));
+    return index->slots == NULL ? -1 : 0;
+}
+
+/*!
+ * @brief register_dedup_entry records that a destination file holds the content of an entry
+ * Only the first destination file of a given content is kept.
+ * @param index is a pointer to the dedup index
+ * @param entry is the entry (from the source or the destination) with its size and MD5 sum
+ * @param destination_path is the path of the destination file holding this content
+ * @return 0 on success, -1 else
+ */
+int register_dedup_entry(dedup_index_t *index, files_list_entry_t *entry, char *destination_path) {
+    if (index == NULL || index->slots == NULL || entry->entry_type != FICHIER || entry->size == 0) {
+        return -1;
+    }
+    if (2 * (index->count + 1) > index->capacity && grow_index(index) == -1) {
+        return -1;
+    }
+    dedup_slot_t *slot = find_slot(index, entry->size, entry->md5sum);
+    if (slot->path != NULL) {
+        return 0;
+    }
+    slot->path = strdup(destination_path);
+    if (slot->path == NULL) {
+        return -1;
+    }
+    slot->size = entry->size;
+    memcpy(slot->md5sum, entry->md5sum, sizeof(slot->md5sum));
+    ++index->count;
+    return 0;
+}
+
+/*!
+ * @brief dedup_entry materializes a source file from a destination file with the same content, if any
+ * @param index is a pointer to the dedup index
+ * @param source_entry is the source file to materialize
+ * @param destination_path is the path of the file in the destination
+ * @param the_config is a pointer to the configuration (for dedup_verify)
+ * @return true if the file was reflinked or hard linked, false if it must be copied
+ */
+bool dedup_entry(dedup_index_t *index, files_list_entry_t *source_entry, char *destination_path, configuration_t *the_config) {
+    if (index == NULL || index->slots == NULL || source_entry->entry_type != FICHIER || source_entry->size == 0) {
+        return false;
+    }
+    dedup_slot_t *slot = find_slot(index, source_entry->size, source_entry->md5sum);
+    if (slot->path == NULL || strcmp(slot->path, destination_path) == 0) {
+        return false;
+    }
+    if (the_config->dedup_verify && !files_are_identical(source_entry->path_and_name, slot->path)) {
+        return false;
+    }
+
+    if (reflink_file(slot->path, destination_path, source_entry) == 0) {
+        ++index->reflinks_count;
+    } else if (hardlink_file(slot->path, destination_path, source_entry) == 0) {
+        ++index->hardlinks_count;
+    } else {
+        return false;
+    }
+    index->bytes_deduplicated += source_entry->size;
+    if (the_config->verbose) {
+        printf("Deduplicated %s from %s\n", destination_path, slot->path);
+    }
+    return true;
+}
+
+/*!
+ * @brief display_dedup_report displays the number of deduplicated files and bytes
+ * @param index is a pointer to the dedup index
+ */
+void display_dedup_report(dedup_index_t *index) {
+    printf("Deduplicated files: %zu reflinks, %zu hard links, %llu bytes deduplicated\n",
+           index->reflinks_count, index->hardlinks_count, (unsigned long long) index->bytes_deduplicated);
+}
+
+/*!
+ * @brief clear_dedup_index frees the memory used by the index
+ * @param index is a pointer to the dedup index
+ */
+void clear_dedup_index(dedup_index_t *index) {
+    if (index->slots != NULL) {
+        for (size_t i=0; i<index->capacity; ++i) {
+            free(index->slots[i].path);
+        }
+    }
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
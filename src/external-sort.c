@@ -0,0 +1,344 @@
+#include "external-sort.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Entries are spilled to unlinked temporary files (tmpfile) as sorted runs, then merged back as a single sorted
+// stream. Runs are merged by groups of EXTERNAL_SORT_FAN_IN as soon as enough of them share the same level, so
+// that the number of open runs (and the memory used by their heads) grows only logarithmically with the tree size.
+
+/*!
+ * @brief compare_entries orders two entries by path, as the lists built by the program
+ */
+static int compare_entries(const void *lhs, const void *rhs) {
+    return strcmp(((files_list_entry_t *) lhs)->path_and_name, ((files_list_entry_t *) rhs)->path_and_name);
+}
+
+/*!
+ * @brief write_record writes an entry to a run in a compact form (the path is not padded to PATH_SIZE)
+ * @param file the run to write to
+ * @param entry the entry to write
+ * @return 0 on success, -1 else
+ */
+static int write_record(FILE *file, files_list_entry_t *entry) {
+    uint16_t path_len = (uint16_t) strnlen(entry->path_and_name, sizeof(entry->path_and_name) - 1);
+    if (fwrite(&path_len, sizeof(path_len), 1, file) != 1
+        || fwrite(entry->path_and_name, 1, path_len, file) != path_len
+        || fwrite(&entry->mtime, sizeof(entry->mtime), 1, file) != 1
+        || fwrite(&entry->size, sizeof(entry->size), 1, file) != 1
+        || fwrite(entry->md5sum, sizeof(entry->md5sum), 1, file) != 1
+        || fwrite(&entry->entry_type, sizeof(entry->entry_type), 1, file) != 1
+        || fwrite(&entry->mode, sizeof(entry->mode), 1, file) != 1
+        || fwrite(&entry->inode, sizeof(entry->inode), 1, file) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief read_record reads back an entry written by write_record
+ * @param file the run to read from
+ * @param entry the entry to fill
+ * @return 0 on success, -1 at the end of the run or on error
+ */
+static int read_record(FILE *file, files_list_entry_t *entry) {
+    uint16_t path_len;
+    if (fread(&path_len, sizeof(path_len), 1, file) != 1 || path_len >= sizeof(entry->path_and_name)) {
+        return -1;
+    }
+    if (fread(entry->path_and_name, 1, path_len, file) != path_len
+        || fread(&entry->mtime, sizeof(entry->mtime), 1, file) != 1
+        || fread(&entry->size, sizeof(entry->size), 1, file) != 1
+        || fread(entry->md5sum, sizeof(entry->md5sum), 1, file) != 1
+        || fread(&entry->entry_type, sizeof(entry->entry_type), 1, file) != 1
+        || fread(&entry->mode, sizeof(entry->mode), 1, file) != 1
+        || fread(&entry->inode, sizeof(entry->inode), 1, file) != 1) {
+        return -1;
+    }
+    entry->path_and_name[path_len] = '\0';
+    entry->next = NULL;
+    entry->prev = NULL;
+    return 0;
+}
+
+/*!
+ * @brief sift_down restores the min-heap property of heap from position index
+ * @param runs the runs whose heads are compared
+ * @param heap the heap of run indices
+ * @param heap_size the number of elements in heap
+ * @param index the position to sift down
+ */
+static void sift_down(sorted_run_t *runs, size_t *heap, size_t heap_size, size_t index) {
+    while (true) {
+        size_t smallest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if (left < heap_size && compare_entries(&runs[heap[left]].head, &runs[heap[smallest]].head) < 0) {
+            smallest = left;
+        }
+        if (right < heap_size && compare_entries(&runs[heap[right]].head, &runs[heap[smallest]].head) < 0) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        size_t tmp = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = tmp;
+        index = smallest;
+    }
+}
+
+/*!
+ * @brief build_heap rewinds runs, loads their heads and orders them in heap
+ * @param runs the runs to merge
+ * @param count the number of runs
+ * @param heap an array of at least count elements
+ * @return the number of non empty runs in the heap
+ */
+static size_t build_heap(sorted_run_t *runs, size_t count, size_t *heap) {
+    size_t heap_size = 0;
+    for (size_t i=0; i<count; ++i) {
+        rewind(runs[i].file);
+        runs[i].has_head = read_record(runs[i].file, &runs[i].head) == 0;
+        if (runs[i].has_head) {
+            heap[heap_size++] = i;
+        }
+    }
+    for (size_t i=heap_size/2; i>0; --i) {
+        sift_down(runs, heap, heap_size, i - 1);
+    }
+    return heap_size;
+}
+
+/*!
+ * @brief pop_heap moves the smallest head to entry and loads the next element of its run
+ * @return the new heap size
+ */
+static size_t pop_heap(sorted_run_t *runs, size_t *heap, size_t heap_size, files_list_entry_t *entry) {
+    sorted_run_t *run = &runs[heap[0]];
+    memcpy(entry, &run->head, sizeof(files_list_entry_t));
+    run->has_head = read_record(run->file, &run->head) == 0;
+    if (!run->has_head) {
+        heap[0] = heap[--heap_size];
+    }
+    sift_down(runs, heap, heap_size, 0);
+    return heap_size;
+}
+
+/*!
+ * @brief merge_tail_runs merges the count last runs of the sorter into a single run of the next level
+ * @param sorter the sorter whose runs are merged
+ * @param count the number of runs to merge
+ * @return 0 on success, -1 else
+ */
+static int merge_tail_runs(external_sorter_t *sorter, size_t count) {
+    sorted_run_t *runs = &sorter->runs[sorter->runs_count - count];
+    size_t heap[EXTERNAL_SORT_FAN_IN];
+    FILE *output = tmpfile();
+    if (output == NULL) {
+        return -1;
+    }
+
+    files_list_entry_t entry;
+    size_t heap_size = build_heap(runs, count, heap);
+    while (heap_size > 0) {
+        heap_size = pop_heap(runs, heap, heap_size, &entry);
+        if (write_record(output, &entry) == -1) {
+            fclose(output);
+            return -1;
+        }
+    }
+
+    uint8_t level = runs[0].level + 1;
+    for (size_t i=0; i<count; ++i) {
+        fclose(runs[i].file);
+    }
+    sorter->runs_count -= count - 1;
+    runs[0].file = output;
+    runs[0].has_head = false;
+    runs[0].level = level;
+    return 0;
+}
+
+/*!
+ * @brief spill_buffer sorts the buffered entries and writes them to a new run
+ * @param sorter the sorter to spill
+ * @return 0 on success, -1 else
+ */
+static int spill_buffer(external_sorter_t *sorter) {
+    if (sorter->runs_count == sorter->runs_capacity) {
+        size_t new_capacity = sorter->runs_capacity == 0 ? EXTERNAL_SORT_FAN_IN : 2 * sorter->runs_capacity;
+        sorted_run_t *new_runs = realloc(sorter->runs, new_capacity * sizeof(sorted_run_t));
+        if (new_runs == NULL) {
+            return -1;
+        }
+        sorter->runs = new_runs;
+        sorter->runs_capacity = new_capacity;
+    }
+
+    FILE *run_file = tmpfile();
+    if (run_file == NULL) {
+        perror("Unable to create a temporary run");
+        return -1;
+    }
+    qsort(sorter->buffer, sorter->buffer_count, sizeof(files_list_entry_t), compare_entries);
+    for (size_t i=0; i<sorter->buffer_count; ++i) {
+        if (write_record(run_file, &sorter->buffer[i]) == -1) {
+            perror("Unable to write a temporary run");
+            fclose(run_file);
+            return -1;
+        }
+    }
+    sorter->buffer_count = 0;
+
+    sorted_run_t *run = &sorter->runs[sorter->runs_count++];
+    run->file = run_file;
+    run->has_head = false;
+    run->level = 0;
+
+    // Merge the tail runs while EXTERNAL_SORT_FAN_IN of them share the same level
+    while (sorter->runs_count >= EXTERNAL_SORT_FAN_IN) {
+        uint8_t level = sorter->runs[sorter->runs_count - 1].level;
+        size_t same_level = 0;
+        while (same_level < sorter->runs_count && sorter->runs[sorter->runs_count - 1 - same_level].level == level) {
+            ++same_level;
+        }
+        if (same_level < EXTERNAL_SORT_FAN_IN) {
+            break;
+        }
+        if (merge_tail_runs(sorter, EXTERNAL_SORT_FAN_IN) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief init_external_sorter initializes an empty sorter
+ * @param sorter a pointer to the sorter to initialize
+ * @param memory_limit the number of bytes of entries that may be kept in memory, 0 to never spill
+ * @return 0 on success, -1 else
+ */
+int init_external_sorter(external_sorter_t *sorter, uint64_t memory_limit) {
+    if (sorter == NULL) {
+        return -1;
+    }
+    memset(sorter, 0, sizeof(external_sorter_t));
+    sorter->memory_limit = memory_limit;
+    if (memory_limit > 0) {
+        sorter->buffer_capacity = memory_limit / sizeof(files_list_entry_t);
+        if (sorter->buffer_capacity < EXTERNAL_SORT_MIN_BUFFER) {
+            sorter->buffer_capacity = EXTERNAL_SORT_MIN_BUFFER;
+        }
+        sorter->buffer = malloc(sorter->buffer_capacity * sizeof(files_list_entry_t));
+        if (sorter->buffer == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief external_sorter_add adds a copy of an entry to the sorter, spilling a run when the memory limit is reached
+ * @param sorter the sorter to add the entry to
+ * @param entry the entry to add (must be copied)
+ * @return 0 on success, -1 else
+ */
+int external_sorter_add(external_sorter_t *sorter, files_list_entry_t *entry) {
+    if (sorter == NULL || entry == NULL || sorter->is_merging) {
+        return -1;
+    }
+    if (sorter->buffer_count == sorter->buffer_capacity) {
+        if (sorter->memory_limit > 0) {
+            if (spill_buffer(sorter) == -1) {
+                return -1;
+            }
+        } else {
+            size_t new_capacity = sorter->buffer_capacity == 0 ? EXTERNAL_SORT_MIN_BUFFER : 2 * sorter->buffer_capacity;
+            files_list_entry_t *new_buffer = realloc(sorter->buffer, new_capacity * sizeof(files_list_entry_t));
+            if (new_buffer == NULL) {
+                return -1;
+            }
+            sorter->buffer = new_buffer;
+            sorter->buffer_capacity = new_capacity;
+        }
+    }
+    memcpy(&sorter->buffer[sorter->buffer_count++], entry, sizeof(files_list_entry_t));
+    return 0;
+}
+
+/*!
+ * @brief external_sorter_finish ends the additions and prepares the sorted stream
+ * When nothing was spilled, the buffer is sorted in place, otherwise the remaining entries are spilled and all
+ * the runs are merged on the fly by external_sorter_next
+ * @param sorter the sorter to finish
+ * @return 0 on success, -1 else
+ */
+int external_sorter_finish(external_sorter_t *sorter) {
+    if (sorter == NULL || sorter->is_merging) {
+        return -1;
+    }
+    if (sorter->runs_count == 0) {
+        qsort(sorter->buffer, sorter->buffer_count, sizeof(files_list_entry_t), compare_entries);
+        sorter->buffer_position = 0;
+        return 0;
+    }
+
+    if (sorter->buffer_count > 0 && spill_buffer(sorter) == -1) {
+        return -1;
+    }
+    free(sorter->buffer);
+    sorter->buffer = NULL;
+    sorter->buffer_capacity = 0;
+
+    sorter->heap = malloc(sorter->runs_count * sizeof(size_t));
+    if (sorter->heap == NULL) {
+        return -1;
+    }
+    sorter->heap_size = build_heap(sorter->runs, sorter->runs_count, sorter->heap);
+    sorter->is_merging = true;
+    return 0;
+}
+
+/*!
+ * @brief external_sorter_next gets the next entry of the sorted stream
+ * @param sorter the finished sorter
+ * @param entry a pointer to the entry to fill
+ * @return true if an entry was produced, false at the end of the stream
+ */
+bool external_sorter_next(external_sorter_t *sorter, files_list_entry_t *entry) {
+    if (sorter == NULL || entry == NULL) {
+        return false;
+    }
+    if (!sorter->is_merging) {
+        if (sorter->buffer_position >= sorter->buffer_count) {
+            return false;
+        }
+        memcpy(entry, &sorter->buffer[sorter->buffer_position++], sizeof(files_list_entry_t));
+        entry->next = NULL;
+        entry->prev = NULL;
+        return true;
+    }
+    if (sorter->heap_size == 0) {
+        return false;
+    }
+    sorter->heap_size = pop_heap(sorter->runs, sorter->heap, sorter->heap_size, entry);
+    return true;
+}
+
+/*!
+ * @brief clear_external_sorter frees the memory and temporary files used by a sorter
+ * @param sorter the sorter to clear
+ */
+void clear_external_sorter(external_sorter_t *sorter) {
+    if (sorter == NULL) {
+        return;
+    }
+    for (size_t i=0; i<sorter->runs_count; ++i) {
+        fclose(sorter->runs[i].file);
+    }
+    free(sorter->runs);
+    free(sorter->heap);
+    free(sorter->buffer);
+    memset(sorter, 0, sizeof(external_sorter_t));
+}
@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE // st_mtim and lstat are not part of strict C11 (see Makefile)
+
 #include "file-properties.h"
 
 #include <sys/stat.h>
@@ -9,34 +11,136 @@
 #include "defines.h"
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "utility.h"
+#include "throttle.h"
+#include "journal.h"
+#include "progress.h"
 #include <stdbool.h>
 
-int get_file_stats(files_list_entry_t *entry) {
-    struct stat sb;
-    char path = entry->path_and_name;
-    if (lstat(path, &sb) == -1) {
+/*!
+ * @brief set_file_stats fills the properties of an entry from its lstat, except its MD5 sum
+ * @param entry is the entry to fill
+ * @param sb is the result of lstat on the entry
+ * @return 0 for a file or a directory, -1 for other entries (they are not synchronized)
+ */
+int set_file_stats(files_list_entry_t *entry, struct stat *sb) {
+    entry->mtime = sb->st_mtim;
+    entry->size = sb->st_size;
+    entry->mode = sb->st_mode;
+    entry->inode = sb->st_ino;
+
+    if (S_ISDIR(sb->st_mode)) {
+        entry->entry_type = DOSSIER;
+    } else if (S_ISREG(sb->st_mode)) {
+        entry->entry_type = FICHIER;
+    } else {
         return -1;
     }
+    return 0;
+}
+
+int get_file_stats(files_list_entry_t *entry) {
+    return get_file_stats_batched(entry, NULL);
+}
 
-    entry->mtime.tv_nsec = sb.st_mtime;
-    entry->size = sb.st_size;
-    entry->mode = sb.st_mode;
+/*!
+ * @brief init_md5_batch allocates the buffers of a batch of small files
+ * @param batch is the batch to initialize
+ * @return 0 on success, -1 else
+ */
+int init_md5_batch(md5_batch_t *batch) {
+    batch->count = 0;
+    batch->buffers = malloc((size_t) MD5_BATCH_FILES * MD5_BATCH_FILE_SIZE);
+    return batch->buffers == NULL ? -1 : 0;
+}
 
-    if (S_ISDIR(sb.st_mode)) {
-        entry->entry_type = DOSSIER;
-    } else if (S_ISREG(sb.st_mode)) {
-        entry->entry_type = FICHIER;
+/*!
+ * @brief read_small_file reads a whole file of at most MD5_BATCH_FILE_SIZE bytes
+ * @param path is the path of the file
+ * @param buffer is where the file is read, of MD5_BATCH_FILE_SIZE bytes
+ * @return the length of the file, -1 if it could not be read or has grown beyond the buffer
+ */
+static ssize_t read_small_file(char *path, uint8_t *buffer) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t length = 0;
+    ssize_t bytes = 0;
+    while (length < MD5_BATCH_FILE_SIZE && (bytes = read(fd, buffer + length, MD5_BATCH_FILE_SIZE - length)) > 0) {
+        length += bytes;
+    }
+    // Un fichier qui a grandi depuis son lstat est haché normalement
+    uint8_t extra;
+    if (bytes == -1 || (length == MD5_BATCH_FILE_SIZE && read(fd, &extra, 1) != 0)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    throttle_io(length, 1);
+    count_progress(PROGRESS_BYTES_HASHED, length);
+    return length;
+}
+
+/*!
+ * @brief get_file_stats_batched gets the properties of an entry, the MD5 sum of a small file may be left to the batch
+ * @param entry is the entry, it must not move until the batch is flushed
+ * @param batch is the batch of small files, NULL to hash every file now
+ * @return 1 if the MD5 sum is pending in the batch (@see flush_md5_batch), 0 when the entry is complete, -1 on error
+ */
+int get_file_stats_batched(files_list_entry_t *entry, md5_batch_t *batch) {
+    struct stat sb;
+    char *path = entry->path_and_name;
+    set_progress_file(path);
+    if (lstat(path, &sb) == -1 || set_file_stats(entry, &sb) == -1) {
+        return -1;
+    }
 
+    // Le journal d'une synchronisation interrompue évite de recalculer les sommes des fichiers inchangés
+    if (entry->entry_type == FICHIER && !journal_reuse_analysis(entry)) {
+        if (batch != NULL && batch->count < MD5_BATCH_FILES && entry->size <= MD5_BATCH_FILE_SIZE) {
+            uint8_t *buffer = batch->buffers + batch->count * MD5_BATCH_FILE_SIZE;
+            ssize_t length = read_small_file(path, buffer);
+            if (length != -1) {
+                batch->entries[batch->count] = entry;
+                batch->jobs[batch->count] = (md5_job_t) {buffer, length, entry->md5sum};
+                ++batch->count;
+                return 1;
+            }
+        }
         if (compute_file_md5(entry) == -1) {
             return -1;
         }
-    } else {
-        return -1;
+        journal_record_analysis(entry);
     }
 
+    count_progress(PROGRESS_ANALYZED, 1);
     return 0;
 }
+
+/*!
+ * @brief flush_md5_batch computes the MD5 sums of the batched files at once (@see md5_hash_jobs) and empties the batch
+ * @param batch is the batch
+ */
+void flush_md5_batch(md5_batch_t *batch) {
+    md5_hash_jobs(batch->jobs, batch->count);
+    for (size_t i=0; i<batch->count; ++i) {
+        journal_record_analysis(batch->entries[i]);
+        count_progress(PROGRESS_ANALYZED, 1);
+    }
+    batch->count = 0;
+}
+
+/*!
+ * @brief clear_md5_batch frees the buffers of a batch
+ */
+void clear_md5_batch(md5_batch_t *batch) {
+    free(batch->buffers);
+    batch->buffers = NULL;
+    batch->count = 0;
+}
+
 int compute_file_md5(files_list_entry_t *entry) {
 
     //Ouvre et vérifie si le fichier à été correctement ouvert.
@@ -57,9 +161,12 @@ int compute_file_md5(files_list_entry_t *entry) {
         return -1;
     }
 
-    unsigned char buffer[1024];
+    // Un tampon de 64 Ko fait une lecture par appel à fread, comptée comme une opération par throttle_io
+    static unsigned char buffer[65536];
     size_t bytes;
     while ((bytes = fread(buffer, 1, sizeof(buffer), file)) != 0) {
+        throttle_io(bytes, 1);
+        count_progress(PROGRESS_BYTES_HASHED, bytes);
         if (1 != EVP_DigestUpdate(mdctx, buffer, bytes)) {
             printf("%s\n", mdctx);
             fclose(file);
@@ -82,6 +189,40 @@ int compute_file_md5(files_list_entry_t *entry) {
     return 0;
 }
 
+/*!
+ * @brief start_md5 starts an MD5 sum computed on the fly (by copies, @see copy_entry_to_destination)
+ * @return the context of the sum, NULL on failure
+ */
+md5_context_t *start_md5(void) {
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    if (mdctx != NULL && EVP_DigestInit_ex(mdctx, EVP_md5(), NULL) != 1) {
+        EVP_MD_CTX_free(mdctx);
+        return NULL;
+    }
+    return mdctx;
+}
+
+/*!
+ * @brief update_md5 adds bytes to an MD5 sum
+ * @return 0 on success, -1 else
+ */
+int update_md5(md5_context_t *context, const void *buffer, size_t size) {
+    return EVP_DigestUpdate(context, buffer, size) == 1 ? 0 : -1;
+}
+
+/*!
+ * @brief finish_md5 gives an MD5 sum and frees its context
+ * @param context is the context of the sum
+ * @param md5sum receives the 16 bytes of the sum
+ * @return 0 on success, -1 else
+ */
+int finish_md5(md5_context_t *context, uint8_t *md5sum) {
+    unsigned int md_len;
+    int result = EVP_DigestFinal_ex(context, md5sum, &md_len) == 1 ? 0 : -1;
+    EVP_MD_CTX_free(context);
+    return result;
+}
+
 bool directory_exists(char *path_to_dir) {
     struct stat sb;
     if (stat(path_to_dir, &sb) == 0 && S_ISDIR(sb.st_mode)) {
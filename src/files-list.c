@@ -9,36 +9,45 @@ void clear_files_list(files_list_t *list) {
         list->head = tmp->next;
         free(tmp);
     }
+    list->tail = NULL;
 }
+/*!
+ * @brief add_file_entry adds a new file to the files list, keeping it in lexical order
+ * The insertion point is searched from the tail, so that adding paths in order costs a single comparison.
+ * @param list is a pointer to the list
+ * @param file_path is the path of the file
+ * @return a pointer to the entry of file_path (the existing one if it was already listed), NULL if out of memory
+ */
 files_list_entry_t *add_file_entry(files_list_t *list, char *file_path) {
+    files_list_entry_t *cursor = list->tail;
+    int order = 1;
+    while (cursor != NULL && (order = strcmp(cursor->path_and_name, file_path)) > 0) {
+        cursor = cursor->prev;
+    }
+    if (cursor != NULL && order == 0) {
+        return cursor;
+    }
 
-    files_list_entry_t *new_entry = malloc(sizeof(files_list_entry_t));
+    files_list_entry_t *new_entry = calloc(1, sizeof(files_list_entry_t));
     if (new_entry == NULL) {
-        return -1;
+        return NULL;
     }
-    files_list_entry_t *temp = list->head;
-    strncpy(new_entry->path_and_name, file_path, sizeof(new_entry->path_and_name));
+    strncpy(new_entry->path_and_name, file_path, sizeof(new_entry->path_and_name) - 1);
 
-    while (temp->next != NULL) {
-        if (strcmp(temp->path_and_name, file_path) == 0) {
-            return 0;
-        }else {
-            if (strcmp(temp->path_and_name, file_path) < 0 ) {
-                new_entry->prev = temp;
-                new_entry->next = temp->next;
-                temp->next = new_entry;
-                return 0;
-            }else {
-                temp = temp->next;
-            }
-        }
+    // Insère après cursor (en tête si tous les chemins de la liste sont après file_path)
+    new_entry->prev = cursor;
+    new_entry->next = cursor == NULL ? list->head : cursor->next;
+    if (new_entry->next == NULL) {
+        list->tail = new_entry;
+    } else {
+        new_entry->next->prev = new_entry;
     }
-    if (temp->next == NULL) {
-        temp->next = new_entry;
-        new_entry->prev = temp;
-        new_entry->next = NULL;
-        return 0;
+    if (cursor == NULL) {
+        list->head = new_entry;
+    } else {
+        cursor->next = new_entry;
     }
+    return new_entry;
 }
 int add_entry_to_tail(files_list_t *list, files_list_entry_t *entry) {
     if (entry == NULL) {
@@ -65,6 +74,28 @@ files_list_entry_t *find_entry_by_name(files_list_t *list, char *file_path, size
     }
     return NULL;
 }
+/*!
+ * @brief find_next_entry_by_name finds an entry in a sorted list, searching from a cursor that only moves forward
+ * The paths searched must come in the order of the list (i.e. while walking another sorted list), each search then
+ * starting where the previous one stopped: matching two lists costs a single pass over each (a merge walk).
+ * @param cursor is a pointer to the first entry not passed yet, it is moved past the entries before file_path
+ * @param file_path is the path searched
+ * @param start_of_src is the length of the prefix of the list entries, not compared
+ * @param start_of_dest is the length of the prefix of file_path, not compared
+ * @return the entry with the same relative path, NULL if the list has none
+ */
+files_list_entry_t *find_next_entry_by_name(files_list_entry_t **cursor, char *file_path, size_t start_of_src, size_t start_of_dest) {
+    int order = 1;
+    while (*cursor != NULL && (order = strcmp((*cursor)->path_and_name + start_of_src, file_path + start_of_dest)) < 0) {
+        *cursor = (*cursor)->next;
+    }
+    if (*cursor == NULL || order != 0) {
+        return NULL;
+    }
+    files_list_entry_t *match = *cursor;
+    *cursor = match->next;
+    return match;
+}
 void display_files_list(files_list_t *list) {
     if (!list)
         return;
@@ -0,0 +1,426 @@
+#include "filter.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Include and exclude rules with gitignore semantics: a pattern without a slash matches names at any depth, a
+// pattern with a slash matches paths relative to the root, a trailing slash matches directories only, and the
+// last matching rule decides. An excluded directory is pruned, so its content cannot be included again.
+// Rules are compiled when they are added: whole names and *suffix patterns go to hash tables, the other patterns
+// are compiled to a glob automaton (one state per token, simulated on all its states at once).
+
+#define GLOB_SPECIAL_CHARS "*?[\\"
+
+static filter_t filter = {.rules_count = 0};
+
+/*!
+ * @brief hash_key computes the FNV-1a hash of a string
+ */
+static size_t hash_key(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c=(const unsigned char *) key; *c!='\0'; ++c) {
+        hash = (hash ^ *c) * 0x100000001b3ULL;
+    }
+    return (size_t) hash;
+}
+
+static filter_slot_t *find_slot(filter_table_t *table, const char *key) {
+    size_t slot = hash_key(key) & (table->capacity - 1);
+    while (table->slots[slot].key != NULL && strcmp(table->slots[slot].key, key) != 0) {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return &table->slots[slot];
+}
+
+/*!
+ * @brief lookup_rule gets the last rule of a key in a table
+ * @param table is the table
+ * @param key is the name or the suffix
+ * @param is_dir tells if the entry is a directory
+ * @return the rule, -1 if none
+ */
+static int lookup_rule(filter_table_t *table, const char *key, bool is_dir) {
+    if (table->count == 0) {
+        return -1;
+    }
+    filter_slot_t *slot = find_slot(table, key);
+    if (slot->key == NULL) {
+        return -1;
+    }
+    return is_dir && slot->dir_rule > slot->any_rule ? slot->dir_rule : slot->any_rule;
+}
+
+/*!
+ * @brief set_table_rule records a rule in a table, doubling it when half full
+ * @return 0 on success, -1 if out of memory
+ */
+static int set_table_rule(filter_table_t *table, const char *key, int rule, bool is_dir_only) {
+    if (2 * (table->count + 1) > table->capacity) {
+        filter_table_t grown = {NULL, table->capacity == 0 ? 64 : 2 * table->capacity, table->count};
+        grown.slots = calloc(grown.capacity, sizeof(filter_slot_t));
+        if (grown.slots == NULL) {
+            return -1;
+        }
+        for (size_t i=0; i<table->capacity; ++i) {
+            if (table->slots[i].key != NULL) {
+                *find_slot(&grown, table->slots[i].key) = table->slots[i];
+            }
+        }
+        free(table->slots);
+        *table = grown;
+    }
+    filter_slot_t *slot = find_slot(table, key);
+    if (slot->key == NULL) {
+        slot->key = strdup(key);
+        if (slot->key == NULL) {
+            return -1;
+        }
+        slot->any_rule = -1;
+        slot->dir_rule = -1;
+        ++table->count;
+    }
+    if (is_dir_only) {
+        slot->dir_rule = rule;
+    } else {
+        slot->any_rule = rule;
+    }
+    return 0;
+}
+
+/*!
+ * @brief reserve_suffix_length records a suffix length to look up
+ * @param length is the length of the suffix
+ * @return false if there are already too many distinct lengths (the rule is then matched as a glob)
+ */
+static bool reserve_suffix_length(size_t length) {
+    for (size_t i=0; i<filter.suffix_lengths_count; ++i) {
+        if (filter.suffix_lengths[i] == length) {
+            return true;
+        }
+    }
+    if (filter.suffix_lengths_count == sizeof(filter.suffix_lengths) / sizeof(filter.suffix_lengths[0])) {
+        return false;
+    }
+    filter.suffix_lengths[filter.suffix_lengths_count++] = length;
+    return true;
+}
+
+/*!
+ * @brief compile_glob compiles a pattern to the tokens of the glob automaton
+ * @param pattern is the pattern, without its leading and trailing slashes
+ * @param tokens receives the tokens, at most one per character of the pattern
+ * @return the number of tokens
+ */
+static size_t compile_glob(char *pattern, glob_token_t *tokens) {
+    size_t count = 0;
+    for (char *c=pattern; *c!='\0'; ++c) {
+        glob_token_t *token = &tokens[count++];
+        memset(token, 0, sizeof(glob_token_t));
+        if (c[0] == '*' && c[1] == '*' && (c == pattern || c[-1] == '/')) {
+            if (c[2] == '/') {
+                // "**/" matches any number of directories, including none
+                token->kind = GLOB_OPTIONAL;
+                token->skip = 2;
+                tokens[count].kind = GLOB_GLOBSTAR;
+                tokens[count + 1].kind = GLOB_LITERAL;
+                tokens[count + 1].literal = '/';
+                count += 2;
+                c += 2;
+            } else {
+                token->kind = GLOB_GLOBSTAR;
+                c += 1;
+            }
+        } else if (*c == '*') {
+            token->kind = GLOB_STAR;
+            while (c[1] == '*') {
+                ++c;
+            }
+        } else if (*c == '?') {
+            token->kind = GLOB_ANY;
+        } else if (*c == '[' && strchr(c + 2, ']') != NULL) {
+            token->kind = GLOB_CLASS;
+            bool is_negated = c[1] == '!' || c[1] == '^';
+            char *member = c + (is_negated ? 2 : 1);
+            // A ']' right after the opening bracket is a member
+            do {
+                unsigned char first = (unsigned char) *member;
+                unsigned char last = first;
+                if (member[1] == '-' && member[2] != ']' && member[2] != '\0') {
+                    last = (unsigned char) member[2];
+                    member += 2;
+                }
+                for (unsigned int member_char=first; member_char<=last; ++member_char) {
+                    token->class_bits[member_char / 8] |= 1 << (member_char % 8);
+                }
+                ++member;
+            } while (*member != ']' && *member != '\0');
+            if (is_negated) {
+                for (size_t i=0; i<sizeof(token->class_bits); ++i) {
+                    token->class_bits[i] = ~token->class_bits[i];
+                }
+            }
+            c = member;
+        } else {
+            if (*c == '\\' && c[1] != '\0') {
+                ++c;
+            }
+            token->kind = GLOB_LITERAL;
+            token->literal = (unsigned char) *c;
+        }
+    }
+    return count;
+}
+
+/*!
+ * @brief close_states adds the states reachable without consuming a character (they are all further)
+ */
+static void close_states(glob_token_t *tokens, size_t count, bool *states) {
+    for (size_t i=0; i<count; ++i) {
+        if (!states[i]) {
+            continue;
+        }
+        if (tokens[i].kind == GLOB_STAR || tokens[i].kind == GLOB_GLOBSTAR) {
+            states[i + 1] = true;
+        } else if (tokens[i].kind == GLOB_OPTIONAL) {
+            states[i + 1] = true;
+            states[i + 1 + tokens[i].skip] = true;
+        }
+    }
+}
+
+/*!
+ * @brief glob_matches runs the glob automaton of a rule on a text
+ * @return true if the whole text matches
+ */
+static bool glob_matches(glob_rule_t *rule, const char *text) {
+    size_t count = rule->tokens_count;
+    bool *states = filter.states;
+    bool *next_states = filter.next_states;
+    memset(states, 0, count + 1);
+    states[0] = true;
+    close_states(rule->tokens, count, states);
+    for (const unsigned char *c=(const unsigned char *) text; *c!='\0'; ++c) {
+        memset(next_states, 0, count + 1);
+        bool is_alive = false;
+        for (size_t i=0; i<count; ++i) {
+            if (!states[i]) {
+                continue;
+            }
+            glob_token_t *token = &rule->tokens[i];
+            switch (token->kind) {
+                case GLOB_LITERAL:
+                    next_states[i + 1] |= token->literal == *c;
+                    break;
+                case GLOB_ANY:
+                    next_states[i + 1] |= *c != '/';
+                    break;
+                case GLOB_CLASS:
+                    next_states[i + 1] |= *c != '/' && (token->class_bits[*c / 8] & (1 << (*c % 8)));
+                    break;
+                case GLOB_STAR:
+                    next_states[i] |= *c != '/';
+                    break;
+                case GLOB_GLOBSTAR:
+                    next_states[i] = true;
+                    break;
+                case GLOB_OPTIONAL:
+                    break;
+            }
+        }
+        close_states(rule->tokens, count, next_states);
+        for (size_t i=0; i<=count && !is_alive; ++i) {
+            is_alive = next_states[i];
+        }
+        if (!is_alive) {
+            return false;
+        }
+        bool *swap = states;
+        states = next_states;
+        next_states = swap;
+    }
+    return states[count];
+}
+
+/*!
+ * @brief add_filter_rule compiles and adds a rule after the previous ones
+ * @param pattern is the gitignore-style pattern
+ * @param is_include is true for --include, false for --exclude
+ * @return 0 on success, -1 on an invalid pattern or out of memory
+ */
+int add_filter_rule(char *pattern, bool is_include) {
+    char compiled[4096];
+    size_t length = strlen(pattern);
+    if (length == 0 || length >= sizeof(compiled)) {
+        return -1;
+    }
+    strcpy(compiled, pattern);
+    bool is_dir_only = false;
+    while (length > 1 && compiled[length - 1] == '/') {
+        compiled[--length] = '\0';
+        is_dir_only = true;
+    }
+    char *start = compiled;
+    bool is_anchored = strchr(compiled, '/') != NULL;
+    while (*start == '/') {
+        ++start;
+    }
+    if (*start == '\0') {
+        return -1;
+    }
+
+    bool *is_include_grown = realloc(filter.is_include, (filter.rules_count + 1) * sizeof(bool));
+    if (is_include_grown == NULL) {
+        return -1;
+    }
+    filter.is_include = is_include_grown;
+    int rule = filter.rules_count;
+
+    if (!is_anchored && strpbrk(start, GLOB_SPECIAL_CHARS) == NULL) {
+        if (set_table_rule(&filter.names, start, rule, is_dir_only) == -1) {
+            return -1;
+        }
+    } else if (!is_anchored && start[0] == '*' && start[1] != '\0' && strpbrk(start + 1, GLOB_SPECIAL_CHARS) == NULL
+               && reserve_suffix_length(strlen(start + 1))) {
+        if (set_table_rule(&filter.suffixes, start + 1, rule, is_dir_only) == -1) {
+            return -1;
+        }
+    } else {
+        glob_rule_t *globs_grown = realloc(filter.globs, (filter.globs_count + 1) * sizeof(glob_rule_t));
+        if (globs_grown == NULL) {
+            return -1;
+        }
+        filter.globs = globs_grown;
+        glob_rule_t *glob_rule = &filter.globs[filter.globs_count];
+        // "**/" becomes three tokens
+        glob_rule->tokens = calloc(strlen(start) + 2, sizeof(glob_token_t));
+        if (glob_rule->tokens == NULL) {
+            return -1;
+        }
+        glob_rule->tokens_count = compile_glob(start, glob_rule->tokens);
+        glob_rule->rule = rule;
+        glob_rule->is_anchored = is_anchored;
+        glob_rule->is_dir_only = is_dir_only;
+        if (glob_rule->tokens_count + 1 > filter.states_capacity) {
+            bool *states = realloc(filter.states, glob_rule->tokens_count + 1);
+            bool *next_states = states == NULL ? NULL : realloc(filter.next_states, glob_rule->tokens_count + 1);
+            if (next_states == NULL) {
+                filter.states = states;
+                free(glob_rule->tokens);
+                return -1;
+            }
+            filter.states = states;
+            filter.next_states = next_states;
+            filter.states_capacity = glob_rule->tokens_count + 1;
+        }
+        ++filter.globs_count;
+    }
+    filter.is_include[rule] = is_include;
+    ++filter.rules_count;
+    return 0;
+}
+
+/*!
+ * @brief add_filter_rules_from adds the rules of a file (--exclude-from)
+ * Each line is an exclude pattern, or an include pattern when it starts with '!'. Empty lines and lines starting
+ * with '#' are ignored.
+ * @param file_path is the path of the file
+ * @return 0 on success, -1 else
+ */
+int add_filter_rules_from(char *file_path) {
+    FILE *file = fopen(file_path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[4096];
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        size_t length = strcspn(line, "\r\n");
+        while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t')) {
+            --length;
+        }
+        line[length] = '\0';
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        result = line[0] == '!' ? add_filter_rule(line + 1, true) : add_filter_rule(line, false);
+    }
+    fclose(file);
+    return result;
+}
+
+/*!
+ * @brief set_filter_report enables the count of the pruned bytes, which costs a stat per pruned file
+ * @param reports is true to count them
+ */
+void set_filter_report(bool reports) {
+    filter.reports = reports;
+}
+
+/*!
+ * @brief filter_excludes tells if an entry is excluded
+ * @param relative_path is the path of the entry relative to the root of the synchronization
+ * @param is_dir tells if the entry is a directory
+ * @return true if the last rule matching the entry is an exclude rule
+ */
+bool filter_excludes(char *relative_path, bool is_dir) {
+    if (filter.rules_count == 0) {
+        return false;
+    }
+    char *name = strrchr(relative_path, '/');
+    name = name == NULL ? relative_path : name + 1;
+    size_t name_length = strlen(name);
+
+    int last_rule = lookup_rule(&filter.names, name, is_dir);
+    for (size_t i=0; i<filter.suffix_lengths_count; ++i) {
+        if (filter.suffix_lengths[i] <= name_length) {
+            int rule = lookup_rule(&filter.suffixes, name + name_length - filter.suffix_lengths[i], is_dir);
+            last_rule = rule > last_rule ? rule : last_rule;
+        }
+    }
+    // Only the rules after the last one found can change the decision
+    for (size_t i=filter.globs_count; i>0 && filter.globs[i - 1].rule>last_rule; --i) {
+        glob_rule_t *glob_rule = &filter.globs[i - 1];
+        if ((!glob_rule->is_dir_only || is_dir) && glob_matches(glob_rule, glob_rule->is_anchored ? relative_path : name)) {
+            last_rule = glob_rule->rule;
+            break;
+        }
+    }
+    return last_rule >= 0 && !filter.is_include[last_rule];
+}
+
+/*!
+ * @brief filter_prunes tells if a directory entry is excluded, and counts it if so
+ * It is called before the entry is stat-ed or opened, so an excluded directory is never walked.
+ * @param relative_path is the path of the entry relative to the root of the synchronization
+ * @param dir_fd is the descriptor of the directory of the entry (to stat the pruned files when reporting)
+ * @param dir_entry is the directory entry
+ * @return true if the entry must be skipped
+ */
+bool filter_prunes(char *relative_path, int dir_fd, struct dirent *dir_entry) {
+    if (!filter_excludes(relative_path, dir_entry->d_type == DT_DIR)) {
+        return false;
+    }
+    ++filter.pruned_entries;
+    struct stat sb;
+    if (filter.reports && dir_entry->d_type == DT_REG && fstatat(dir_fd, dir_entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+        filter.pruned_bytes += sb.st_size;
+    }
+    return true;
+}
+
+/*!
+ * @brief display_filter_report displays the entries pruned since the previous report
+ * Pruned directories count as one entry, their content is not walked.
+ * @param root is the walked directory
+ */
+void display_filter_report(char *root) {
+    if (filter.rules_count == 0) {
+        return;
+    }
+    printf("Filters pruned %llu entries (%llu bytes of files) in %s\n", (unsigned long long) filter.pruned_entries,
+           (unsigned long long) filter.pruned_bytes, root);
+    filter.pruned_entries = 0;
+    filter.pruned_bytes = 0;
+}
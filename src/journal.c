@@ -0,0 +1,423 @@
+#include "journal.h"
+#include "utility.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The journal is an append-only file in the destination. Each record is written with a single write() on an
+// O_APPEND descriptor, so records of the analyzers and of main never interleave. It is synced at most every
+// JOURNAL_SYNC_INTERVAL, and a record torn by a crash ends the loading. The journal is opened before forking, so
+// that the analyzers inherit the loaded records. It is removed when the synchronization completes.
+// The manifest (--hash-copies) uses the same analysis records to keep the MD5 sums of the files written in the
+// destination from one run to the next.
+
+static journal_t journal = {.fd = -1, .manifest_fd = -1};
+
+/*!
+ * @brief now_seconds gives a monotonic time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*!
+ * @brief hash_path computes the FNV-1a hash of a path
+ */
+static size_t hash_path(char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char *c=(unsigned char *) path; *c!='\0'; ++c) {
+        hash = (hash ^ *c) * 0x100000001b3ULL;
+    }
+    return (size_t) hash;
+}
+
+/*!
+ * @brief find_slot finds the slot of a path, or the empty slot where it would be inserted
+ */
+static journal_slot_t *find_slot(char *path) {
+    size_t slot = hash_path(path) % journal.capacity;
+    while (journal.slots[slot].path != NULL && strcmp(journal.slots[slot].path, path) != 0) {
+        slot = (slot + 1) % journal.capacity;
+    }
+    return &journal.slots[slot];
+}
+
+/*!
+ * @brief get_slot gets the slot of a path, creating it if needed
+ * @return a pointer to the slot, NULL on allocation failure
+ */
+static journal_slot_t *get_slot(char *path) {
+    if (2 * (journal.count + 1) > journal.capacity) {
+        journal_slot_t *old_slots = journal.slots;
+        size_t old_capacity = journal.capacity;
+        journal.capacity = old_capacity == 0 ? 1024 : 2 * old_capacity;
+        journal.slots = calloc(journal.capacity, sizeof(journal_slot_t));
+        if (journal.slots == NULL) {
+            journal.slots = old_slots;
+            journal.capacity = old_capacity;
+            return NULL;
+        }
+        for (size_t i=0; i<old_capacity; ++i) {
+            if (old_slots[i].path != NULL) {
+                *find_slot(old_slots[i].path) = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+    journal_slot_t *slot = find_slot(path);
+    if (slot->path == NULL) {
+        slot->path = strdup(path);
+        if (slot->path == NULL) {
+            return NULL;
+        }
+        ++journal.count;
+    }
+    return slot;
+}
+
+/*!
+ * @brief append_record writes one record to the journal or the manifest
+ * The journal is synced when the interval elapsed, the manifest is a cache which is only synced at the end.
+ * @param fd is the journal or the manifest
+ * @param kind is the kind of the record
+ * @param payload is the content of the record
+ * @param length is the length of the payload
+ */
+static void append_record(int fd, char kind, void *payload, uint16_t length) {
+    if (fd == -1) {
+        return;
+    }
+    uint8_t record[1 + sizeof(uint16_t) + UINT16_MAX];
+    record[0] = (uint8_t) kind;
+    memcpy(record + 1, &length, sizeof(length));
+    memcpy(record + 1 + sizeof(length), payload, length);
+    if (write(fd, record, 1 + sizeof(length) + length) == -1 || fd != journal.fd) {
+        return;
+    }
+    double now = now_seconds();
+    if (now - journal.last_sync >= JOURNAL_SYNC_INTERVAL) {
+        fdatasync(fd);
+        journal.last_sync = now;
+    }
+}
+
+/*!
+ * @brief encode_analysis encodes the properties of an analyzed file as the payload of a record
+ * @param entry is the analyzed entry
+ * @param payload receives the payload, of at most PATH_SIZE + ANALYSIS_FIELDS_SIZE bytes
+ * @return the length of the payload
+ */
+static uint16_t encode_analysis(files_list_entry_t *entry, uint8_t *payload) {
+    size_t path_length = strnlen(entry->path_and_name, PATH_SIZE - 1);
+    uint8_t *cursor = payload;
+    memcpy(cursor, entry->path_and_name, path_length);
+    cursor += path_length;
+    memcpy(cursor, &entry->mtime, sizeof(entry->mtime));
+    cursor += sizeof(entry->mtime);
+    memcpy(cursor, &entry->size, sizeof(entry->size));
+    cursor += sizeof(entry->size);
+    memcpy(cursor, entry->md5sum, sizeof(entry->md5sum));
+    cursor += sizeof(entry->md5sum);
+    memcpy(cursor, &entry->inode, sizeof(entry->inode));
+    cursor += sizeof(entry->inode);
+    return (uint16_t) (cursor - payload);
+}
+
+/*!
+ * @brief load_journal reads the records of an interrupted run, or of the manifest
+ * @param fd is the journal or the manifest, opened for reading
+ * @param is_manifest tells if the records come from the manifest
+ * @return the number of records read
+ */
+static size_t load_journal(int fd, bool is_manifest) {
+    size_t records = 0;
+    FILE *file = fdopen(fd, "rb");
+    if (file == NULL) {
+        close(fd);
+        return 0;
+    }
+    uint8_t kind;
+    uint16_t length;
+    char payload[UINT16_MAX + 1];
+    while (fread(&kind, 1, 1, file) == 1 && fread(&length, sizeof(length), 1, file) == 1
+           && fread(payload, 1, length, file) == length) {
+        ++records;
+        if (kind == JOURNAL_RECORD_ANALYSIS) {
+            if (length <= ANALYSIS_FIELDS_SIZE) {
+                break;
+            }
+            // The fields are copied before the path is terminated in place, over their first byte
+            uint8_t fields[ANALYSIS_FIELDS_SIZE];
+            memcpy(fields, payload + length - ANALYSIS_FIELDS_SIZE, ANALYSIS_FIELDS_SIZE);
+            payload[length - ANALYSIS_FIELDS_SIZE] = '\0';
+            journal_slot_t *slot = get_slot(payload);
+            if (slot == NULL) {
+                break;
+            }
+            memcpy(&slot->mtime, fields, sizeof(slot->mtime));
+            memcpy(&slot->size, fields + sizeof(slot->mtime), sizeof(slot->size));
+            memcpy(slot->md5sum, fields + sizeof(slot->mtime) + sizeof(slot->size), sizeof(slot->md5sum));
+            memcpy(&slot->inode, fields + sizeof(slot->mtime) + sizeof(slot->size) + sizeof(slot->md5sum), sizeof(slot->inode));
+            slot->has_analysis = true;
+            slot->is_manifest = slot->is_manifest || is_manifest;
+        } else if (kind == JOURNAL_RECORD_COPY_START || kind == JOURNAL_RECORD_COPY_DONE) {
+            payload[length] = '\0';
+            journal_slot_t *slot = get_slot(payload);
+            if (slot == NULL) {
+                break;
+            }
+            slot->is_copying = kind == JOURNAL_RECORD_COPY_START;
+            // Whatever was analyzed before, the file was rewritten since
+            slot->has_analysis = false;
+        } else {
+            break;
+        }
+    }
+    fclose(file);
+    return records;
+}
+
+/*!
+ * @brief init_journal opens the journal (with --journal or --resume) and the manifest (with --hash-copies)
+ * With --resume, the records of the interrupted run are loaded first and the journal is continued. Else, it is
+ * truncated. The manifest is always loaded and continued.
+ * @param the_config is a pointer to the configuration
+ * @return 0 on success (or when there is no journal nor manifest), -1 else
+ */
+int init_journal(configuration_t *the_config) {
+    char path[PATH_SIZE];
+    if (the_config->hash_copies) {
+        if (concat_path(path, the_config->destination, MANIFEST_FILE_NAME) == NULL) {
+            return -1;
+        }
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            journal.manifest_records = load_journal(fd, true);
+        }
+        journal.manifest_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (journal.manifest_fd == -1) {
+            perror("Unable to open the manifest");
+            return -1;
+        }
+    }
+    if (!the_config->journal) {
+        return 0;
+    }
+    if (concat_path(path, the_config->destination, JOURNAL_FILE_NAME) == NULL) {
+        return -1;
+    }
+    if (the_config->resume) {
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            load_journal(fd, false);
+        }
+        if (the_config->verbose) {
+            printf("Resuming with %zu journaled entries\n", journal.count);
+        }
+    }
+    int flags = O_WRONLY | O_CREAT | O_APPEND | (the_config->resume ? 0 : O_TRUNC);
+    journal.fd = open(path, flags, 0600);
+    if (journal.fd == -1) {
+        perror("Unable to open the journal");
+        return -1;
+    }
+    journal.last_sync = now_seconds();
+    return 0;
+}
+
+/*!
+ * @brief journal_reuse_analysis gets the MD5 sum of a file from the interrupted run, if it did not change since
+ * @param entry is the entry being analyzed, with its properties already set from lstat
+ * @return true if the MD5 sum was reused, false if it must be computed
+ */
+bool journal_reuse_analysis(files_list_entry_t *entry) {
+    if (journal.count == 0) {
+        return false;
+    }
+    journal_slot_t *slot = find_slot(entry->path_and_name);
+    if (slot->path == NULL || !slot->has_analysis || slot->size != entry->size || slot->inode != entry->inode
+        || slot->mtime.tv_sec != entry->mtime.tv_sec || slot->mtime.tv_nsec != entry->mtime.tv_nsec) {
+        return false;
+    }
+    memcpy(entry->md5sum, slot->md5sum, sizeof(entry->md5sum));
+    return true;
+}
+
+/*!
+ * @brief journal_was_in_flight tells if a destination file was being copied when the interrupted run stopped
+ * @param path is the path of the destination file
+ * @return true if the copy started but never completed
+ */
+bool journal_was_in_flight(char *path) {
+    if (journal.count == 0) {
+        return false;
+    }
+    journal_slot_t *slot = find_slot(path);
+    return slot->path != NULL && slot->is_copying;
+}
+
+/*!
+ * @brief journal_record_analysis records the properties of an analyzed file
+ * @param entry is the analyzed entry
+ */
+void journal_record_analysis(files_list_entry_t *entry) {
+    if (journal.fd == -1 || entry->entry_type != FICHIER) {
+        return;
+    }
+    uint8_t payload[PATH_SIZE + ANALYSIS_FIELDS_SIZE];
+    append_record(journal.fd, JOURNAL_RECORD_ANALYSIS, payload, encode_analysis(entry, payload));
+}
+
+/*!
+ * @brief describe_written_file gets the properties of a file written in the destination, whose MD5 sum is known
+ * @param dest_path is the path of the written file, as the destination analyzers name it
+ * @param md5sum is the MD5 sum of the file content
+ * @param entry is a pointer to the entry receiving the properties
+ * @return 0 on success, -1 if the file cannot be stat-ed
+ */
+static int describe_written_file(char *dest_path, uint8_t *md5sum, files_list_entry_t *entry) {
+    struct stat sb;
+    if (lstat(dest_path, &sb) == -1) {
+        return -1;
+    }
+    snprintf(entry->path_and_name, PATH_SIZE, "%s", dest_path);
+    entry->entry_type = FICHIER;
+    entry->mtime = sb.st_mtim;
+    entry->size = sb.st_size;
+    entry->inode = sb.st_ino;
+    memcpy(entry->md5sum, md5sum, sizeof(entry->md5sum));
+    return 0;
+}
+
+/*!
+ * @brief manifest_record_copy records the MD5 sum of a file written in the destination (--hash-copies)
+ * The next run finds the file already hashed, as long as its size, mtime and inode did not change.
+ * @param dest_path is the path of the written file, as the destination analyzers name it
+ * @param md5sum is the MD5 sum of the file content
+ */
+void manifest_record_copy(char *dest_path, uint8_t *md5sum) {
+    files_list_entry_t entry;
+    if (journal.manifest_fd == -1 || describe_written_file(dest_path, md5sum, &entry) == -1) {
+        return;
+    }
+    uint8_t payload[PATH_SIZE + ANALYSIS_FIELDS_SIZE];
+    append_record(journal.manifest_fd, JOURNAL_RECORD_ANALYSIS, payload, encode_analysis(&entry, payload));
+    ++journal.manifest_records;
+
+    // Keep the in-memory cache up to date, it is written back when the manifest is compacted
+    journal_slot_t *slot = get_slot(entry.path_and_name);
+    if (slot != NULL) {
+        slot->mtime = entry.mtime;
+        slot->size = entry.size;
+        slot->inode = entry.inode;
+        memcpy(slot->md5sum, md5sum, sizeof(slot->md5sum));
+        slot->has_analysis = true;
+        slot->is_manifest = true;
+    }
+}
+
+/*!
+ * @brief journal_record_sum records the MD5 sum of a file written in the destination, as an analysis record
+ * A resumed run then reuses the sum instead of hashing the file again (@see journal_reuse_analysis).
+ * @param dest_path is the path of the written file, as the destination analyzers name it
+ * @param md5sum is the MD5 sum of the file content
+ */
+void journal_record_sum(char *dest_path, uint8_t *md5sum) {
+    files_list_entry_t entry;
+    if (journal.fd == -1 || describe_written_file(dest_path, md5sum, &entry) == -1) {
+        return;
+    }
+    journal_record_analysis(&entry);
+}
+
+/*!
+ * @brief journal_record_copy records the start or the end of a copy
+ * The end of a copy is followed by the analysis of the written file when its sum is known (@see journal_record_sum).
+ * @param destination_path is the path of the file written in the destination
+ * @param is_done is false when the copy starts, true when it is complete
+ * @param md5sum is the MD5 sum of the complete copy, NULL if unknown (or when the copy starts)
+ */
+void journal_record_copy(char *destination_path, bool is_done, uint8_t *md5sum) {
+    append_record(journal.fd, is_done ? JOURNAL_RECORD_COPY_DONE : JOURNAL_RECORD_COPY_START, destination_path,
+                  (uint16_t) strnlen(destination_path, PATH_SIZE - 1));
+    if (is_done && md5sum != NULL) {
+        journal_record_sum(destination_path, md5sum);
+    }
+}
+
+/*!
+ * @brief compact_manifest rewrites the manifest with one record per file, once it holds mostly outdated records
+ * @param the_config is a pointer to the configuration
+ */
+static void compact_manifest(configuration_t *the_config) {
+    size_t live_records = 0;
+    for (size_t i=0; i<journal.capacity; ++i) {
+        live_records += journal.slots[i].path != NULL && journal.slots[i].is_manifest && journal.slots[i].has_analysis;
+    }
+    char path[PATH_SIZE];
+    char compacted_path[PATH_SIZE];
+    if (journal.manifest_records <= 2 * live_records + 1024
+        || concat_path(path, the_config->destination, MANIFEST_FILE_NAME) == NULL
+        || snprintf(compacted_path, PATH_SIZE, "%s.new", path) >= PATH_SIZE) {
+        return;
+    }
+    int fd = open(compacted_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return;
+    }
+    for (size_t i=0; i<journal.capacity; ++i) {
+        journal_slot_t *slot = &journal.slots[i];
+        if (slot->path == NULL || !slot->is_manifest || !slot->has_analysis) {
+            continue;
+        }
+        files_list_entry_t entry;
+        strncpy(entry.path_and_name, slot->path, PATH_SIZE - 1);
+        entry.path_and_name[PATH_SIZE - 1] = '\0';
+        entry.mtime = slot->mtime;
+        entry.size = slot->size;
+        entry.inode = slot->inode;
+        memcpy(entry.md5sum, slot->md5sum, sizeof(entry.md5sum));
+        uint8_t payload[PATH_SIZE + ANALYSIS_FIELDS_SIZE];
+        append_record(fd, JOURNAL_RECORD_ANALYSIS, payload, encode_analysis(&entry, payload));
+    }
+    if (fdatasync(fd) == 0) {
+        rename(compacted_path, path);
+    } else {
+        unlink(compacted_path);
+    }
+    close(fd);
+}
+
+/*!
+ * @brief finish_journal removes the journal and closes the manifest once the synchronization completed
+ * @param the_config is a pointer to the configuration
+ */
+void finish_journal(configuration_t *the_config) {
+    if (journal.manifest_fd != -1) {
+        fdatasync(journal.manifest_fd);
+        close(journal.manifest_fd);
+        journal.manifest_fd = -1;
+        compact_manifest(the_config);
+    }
+    if (journal.fd != -1) {
+        close(journal.fd);
+        journal.fd = -1;
+        char journal_path[PATH_SIZE];
+        if (concat_path(journal_path, the_config->destination, JOURNAL_FILE_NAME) != NULL) {
+            unlink(journal_path);
+        }
+    }
+    for (size_t i=0; i<journal.capacity; ++i) {
+        free(journal.slots[i].path);
+    }
+    free(journal.slots);
+    journal.slots = NULL;
+    journal.capacity = 0;
+    journal.count = 0;
+}
@@ -0,0 +1,126 @@
+#include "locality.h"
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// On rotational disks and some network filesystems, the lexical order of the paths is a random order on the
+// device. Pending work is batched and sorted by physical location before being dispatched, so that the reads
+// mostly move forward. Only the dispatch order changes: lists are still sorted by path afterwards.
+
+/*!
+ * @brief first_extent gets the physical offset of the first extent of a file with FIEMAP
+ * @param path is the path of the file
+ * @param offset is a pointer to the physical offset to fill
+ * @return 0 on success, -1 if the file has no mapped extent or the filesystem does not support FIEMAP
+ */
+static int first_extent(char *path, uint64_t *offset) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    int result = ioctl(fd, FS_IOC_FIEMAP, &request.map);
+    close(fd);
+    if (result == -1 || request.map.fm_mapped_extents == 0) {
+        return -1;
+    }
+    *offset = request.extent.fe_physical;
+    return 0;
+}
+
+/*!
+ * @brief physical_key gives the key used to order an entry by physical location
+ * @param entry is the entry, whose inode must be set
+ * @param mode is LOCALITY_INODE, or LOCALITY_EXTENT to use the first extent of files (inode as a fallback)
+ * @return the key
+ */
+uint64_t physical_key(files_list_entry_t *entry, locality_mode_t mode) {
+    uint64_t offset;
+    if (mode == LOCALITY_EXTENT && entry->entry_type == FICHIER && first_extent(entry->path_and_name, &offset) == 0) {
+        return offset;
+    }
+    return (uint64_t) entry->inode;
+}
+
+/*!
+ * @brief compare_order orders batched entries by key, then by arrival
+ */
+static int compare_order(const void *lhs, const void *rhs) {
+    const locality_order_t *lhs_order = (const locality_order_t *) lhs;
+    const locality_order_t *rhs_order = (const locality_order_t *) rhs;
+    if (lhs_order->key != rhs_order->key) {
+        return lhs_order->key < rhs_order->key ? -1 : 1;
+    }
+    return lhs_order->index < rhs_order->index ? -1 : (lhs_order->index > rhs_order->index);
+}
+
+/*!
+ * @brief init_locality_batch initializes an empty batch
+ * @param batch is a pointer to the batch
+ * @param mode is the ordering mode
+ * @return 0 on success, -1 else
+ */
+int init_locality_batch(locality_batch_t *batch, locality_mode_t mode) {
+    batch->mode = mode;
+    batch->count = 0;
+    batch->entries = malloc(LOCALITY_BATCH_SIZE * sizeof(files_list_entry_t));
+    batch->order = malloc(LOCALITY_BATCH_SIZE * sizeof(locality_order_t));
+    if (batch->entries == NULL || batch->order == NULL) {
+        clear_locality_batch(batch);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief locality_batch_add adds a copy of an entry to the batch
+ * @param batch is a pointer to the batch, which must not be full
+ * @param entry is the entry to add
+ * @return true when the batch is full and must be flushed
+ */
+bool locality_batch_add(locality_batch_t *batch, files_list_entry_t *entry) {
+    memcpy(&batch->entries[batch->count], entry, sizeof(files_list_entry_t));
+    ++batch->count;
+    return batch->count == LOCALITY_BATCH_SIZE;
+}
+
+/*!
+ * @brief locality_batch_flush applies a function to all the batched entries in physical order, and empties the batch
+ * @param batch is a pointer to the batch
+ * @param apply is the function to call on each entry
+ * @param context is passed as is to apply
+ */
+void locality_batch_flush(locality_batch_t *batch, locality_apply_t apply, void *context) {
+    for (size_t i=0; i<batch->count; ++i) {
+        batch->order[i].key = physical_key(&batch->entries[i], batch->mode);
+        batch->order[i].index = i;
+    }
+    qsort(batch->order, batch->count, sizeof(locality_order_t), compare_order);
+    for (size_t i=0; i<batch->count; ++i) {
+        apply(&batch->entries[batch->order[i].index], context);
+    }
+    batch->count = 0;
+}
+
+/*!
+ * @brief clear_locality_batch frees the memory of a batch
+ * @param batch is a pointer to the batch
+ */
+void clear_locality_batch(locality_batch_t *batch) {
+    free(batch->entries);
+    free(batch->order);
+    batch->entries = NULL;
+    batch->order = NULL;
+    batch->count = 0;
+}
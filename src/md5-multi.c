@@ -0,0 +1,276 @@
+#include "md5-multi.h"
+
+#include <openssl/evp.h>
+#include <string.h>
+
+// Multi-buffer MD5: one MD5 cannot be split, each block depends on the previous one, but the blocks of independent
+// messages can be hashed in lockstep, one message per lane of a vector. The kernels are written once with the GCC
+// vector extensions, then compiled for each instruction set and chosen at runtime. Digests are the ones of EVP.
+
+#define MD5_BLOCK_SIZE 64
+
+typedef void (*md5_kernel_t)(uint32_t state[4][MD5_LANES_MAX], const uint8_t **blocks);
+
+typedef struct {
+    char *name;
+    int lanes; // 1 for the scalar kernel, which is EVP itself
+    md5_kernel_t function;
+    bool is_supported;
+} md5_kernel_info_t;
+
+typedef struct {
+    md5_job_t *job; // NULL while the lane is idle
+    size_t block; // Next block to hash
+    size_t full_blocks; // Blocks read from the job data, the following ones are in tail
+    size_t blocks_count;
+    uint8_t tail[2 * MD5_BLOCK_SIZE]; // End of the data, padding and length
+} md5_lane_t;
+
+static const uint32_t md5_constants[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const int md5_shifts[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static const uint32_t md5_initial_state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+static const uint8_t idle_block[MD5_BLOCK_SIZE]; // Hashed by the idle lanes, the result is dropped
+
+static inline uint32_t load_le32(const uint8_t *bytes) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap32(word);
+#endif
+    return word;
+}
+
+/*
+ * MD5_KERNEL defines a kernel hashing one block per lane: state holds the a, b, c and d words of every lane,
+ * blocks the next block of every lane. The 64 steps are unrolled, so shifts, constants and message words are
+ * resolved at compile time.
+ */
+#define MD5_KERNEL(name, lanes_count, attributes) \
+    typedef uint32_t name##_vector_t __attribute__((vector_size(4 * (lanes_count)))); \
+    attributes static void name(uint32_t state[4][MD5_LANES_MAX], const uint8_t **blocks) { \
+        name##_vector_t words[16]; \
+        for (int i=0; i<16; ++i) { \
+            for (int lane=0; lane<(lanes_count); ++lane) { \
+                words[i][lane] = load_le32(blocks[lane] + 4 * i); \
+            } \
+        } \
+        name##_vector_t a, b, c, d; \
+        memcpy(&a, state[0], sizeof(a)); \
+        memcpy(&b, state[1], sizeof(b)); \
+        memcpy(&c, state[2], sizeof(c)); \
+        memcpy(&d, state[3], sizeof(d)); \
+        name##_vector_t a0 = a, b0 = b, c0 = c, d0 = d; \
+        _Pragma("GCC unroll 64") \
+        for (int i=0; i<64; ++i) { \
+            name##_vector_t f; \
+            int g; \
+            if (i < 16) { \
+                f = d ^ (b & (c ^ d)); \
+                g = i; \
+            } else if (i < 32) { \
+                f = c ^ (d & (b ^ c)); \
+                g = (5 * i + 1) & 15; \
+            } else if (i < 48) { \
+                f = b ^ c ^ d; \
+                g = (3 * i + 5) & 15; \
+            } else { \
+                f = c ^ (b | ~d); \
+                g = (7 * i) & 15; \
+            } \
+            f += a + md5_constants[i] + words[g]; \
+            a = d; \
+            d = c; \
+            c = b; \
+            b += (f << md5_shifts[i]) | (f >> (32 - md5_shifts[i])); \
+        } \
+        a += a0; \
+        b += b0; \
+        c += c0; \
+        d += d0; \
+        memcpy(state[0], &a, sizeof(a)); \
+        memcpy(state[1], &b, sizeof(b)); \
+        memcpy(state[2], &c, sizeof(c)); \
+        memcpy(state[3], &d, sizeof(d)); \
+    }
+
+// Sans attribut, le noyau à 4 voies utilise le jeu d'instructions de base (SSE2 sur x86-64)
+MD5_KERNEL(md5_kernel_4, 4, )
+#if defined(__x86_64__) || defined(__i386__)
+#define MD5_HAS_X86_KERNELS
+MD5_KERNEL(md5_kernel_avx2, 8, __attribute__((target("avx2"))))
+MD5_KERNEL(md5_kernel_avx512, 16, __attribute__((target("avx512f"))))
+#endif
+
+// From the widest to the narrowest
+static md5_kernel_info_t kernels[] = {
+#ifdef MD5_HAS_X86_KERNELS
+    {"avx512", 16, md5_kernel_avx512, false},
+    {"avx2", 8, md5_kernel_avx2, false},
+#endif
+    {"vector4", 4, md5_kernel_4, true},
+    {"scalar", 1, NULL, true},
+};
+
+#define KERNELS_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+static size_t best_kernel = KERNELS_COUNT; // Widest kernel allowed, KERNELS_COUNT until the CPU is checked
+
+/*!
+ * @brief detect_kernels checks the kernels supported by the CPU, once
+ */
+static void detect_kernels(void) {
+    if (best_kernel != KERNELS_COUNT) {
+        return;
+    }
+#ifdef MD5_HAS_X86_KERNELS
+    __builtin_cpu_init();
+    kernels[0].is_supported = __builtin_cpu_supports("avx512f");
+    kernels[1].is_supported = __builtin_cpu_supports("avx2");
+#endif
+    for (best_kernel=0; !kernels[best_kernel].is_supported; ++best_kernel) {
+    }
+}
+
+/*!
+ * @brief md5_kernel_name gives the name of the widest kernel in use
+ * @return the kernel name ("avx512", "avx2", "vector4" or "scalar")
+ */
+const char *md5_kernel_name(void) {
+    detect_kernels();
+    return kernels[best_kernel].name;
+}
+
+/*!
+ * @brief use_md5_kernel limits the kernels to a given one and the narrower ones (used by the micro-benchmarks)
+ * @param name is the name of the kernel
+ * @return true if the kernel is supported, false else (nothing is changed)
+ */
+bool use_md5_kernel(const char *name) {
+    detect_kernels();
+    for (size_t k=0; k<KERNELS_COUNT; ++k) {
+        if (strcmp(kernels[k].name, name) == 0 && kernels[k].is_supported) {
+            best_kernel = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * @brief start_lane gives a job to a lane, building its padded tail
+ * @param lane is the lane
+ * @param state is the state of all the lanes
+ * @param index is the index of the lane
+ * @param job is the job, NULL to make the lane idle
+ */
+static void start_lane(md5_lane_t *lane, uint32_t state[4][MD5_LANES_MAX], int index, md5_job_t *job) {
+    lane->job = job;
+    if (job == NULL) {
+        return;
+    }
+    for (int i=0; i<4; ++i) {
+        state[i][index] = md5_initial_state[i];
+    }
+    // La fin des données est suivie du bit 1, de zéros, puis de la longueur en bits (petit-boutiste)
+    size_t remaining = job->length % MD5_BLOCK_SIZE;
+    size_t tail_size = remaining + 1 + 8 <= MD5_BLOCK_SIZE ? MD5_BLOCK_SIZE : 2 * MD5_BLOCK_SIZE;
+    memset(lane->tail, 0, sizeof(lane->tail));
+    if (remaining > 0) {
+        memcpy(lane->tail, job->data + job->length - remaining, remaining);
+    }
+    lane->tail[remaining] = 0x80;
+    uint64_t bits = (uint64_t) job->length * 8;
+    for (int i=0; i<8; ++i) {
+        lane->tail[tail_size - 8 + i] = (uint8_t) (bits >> (8 * i));
+    }
+    lane->block = 0;
+    lane->full_blocks = job->length / MD5_BLOCK_SIZE;
+    lane->blocks_count = lane->full_blocks + tail_size / MD5_BLOCK_SIZE;
+}
+
+/*!
+ * @brief finish_lane writes the digest of the job of a lane
+ */
+static void finish_lane(md5_lane_t *lane, uint32_t state[4][MD5_LANES_MAX], int index) {
+    for (int i=0; i<4; ++i) {
+        for (int byte=0; byte<4; ++byte) {
+            lane->job->digest[4 * i + byte] = (uint8_t) (state[i][index] >> (8 * byte));
+        }
+    }
+}
+
+/*!
+ * @brief hash_with_kernel hashes jobs with a vector kernel, a lane takes the next job as soon as its job is done
+ */
+static void hash_with_kernel(md5_kernel_info_t *kernel, md5_job_t *jobs, size_t count) {
+    md5_lane_t lanes[MD5_LANES_MAX];
+    uint32_t state[4][MD5_LANES_MAX];
+    const uint8_t *blocks[MD5_LANES_MAX];
+    size_t next_job = 0;
+    int active_lanes = 0;
+    for (int l=0; l<kernel->lanes; ++l) {
+        start_lane(&lanes[l], state, l, next_job < count ? &jobs[next_job++] : NULL);
+        active_lanes += lanes[l].job != NULL;
+    }
+
+    while (active_lanes > 0) {
+        for (int l=0; l<kernel->lanes; ++l) {
+            md5_lane_t *lane = &lanes[l];
+            if (lane->job == NULL) {
+                blocks[l] = idle_block;
+            } else if (lane->block < lane->full_blocks) {
+                blocks[l] = lane->job->data + lane->block * MD5_BLOCK_SIZE;
+            } else {
+                blocks[l] = lane->tail + (lane->block - lane->full_blocks) * MD5_BLOCK_SIZE;
+            }
+        }
+        kernel->function(state, blocks);
+        for (int l=0; l<kernel->lanes; ++l) {
+            md5_lane_t *lane = &lanes[l];
+            if (lane->job != NULL && ++lane->block == lane->blocks_count) {
+                finish_lane(lane, state, l);
+                start_lane(lane, state, l, next_job < count ? &jobs[next_job++] : NULL);
+                active_lanes -= lane->job == NULL;
+            }
+        }
+    }
+}
+
+/*!
+ * @brief md5_hash_jobs computes the MD5 sums of independent buffers, several at once
+ * The narrowest kernel with a lane for every job is used (the widest allowed one beyond), a single job is hashed
+ * by EVP. Lanes are refilled as their jobs end, so jobs of different lengths can be mixed.
+ * @param jobs is the array of jobs, their digests are written
+ * @param count is the number of jobs
+ */
+void md5_hash_jobs(md5_job_t *jobs, size_t count) {
+    detect_kernels();
+    size_t k = best_kernel;
+    while (k + 1 < KERNELS_COUNT && kernels[k + 1].lanes >= (int) count && kernels[k + 1].is_supported) {
+        ++k;
+    }
+    if (count <= 1 || kernels[k].function == NULL) {
+        for (size_t i=0; i<count; ++i) {
+            EVP_Digest(jobs[i].data, jobs[i].length, jobs[i].digest, NULL, EVP_md5(), NULL);
+        }
+        return;
+    }
+    hash_with_kernel(&kernels[k], jobs, count);
+}
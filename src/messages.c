@@ -34,7 +34,8 @@ int send_analyze_dir_command(int msg_queue, int recipient, char *target_dir) {
     analyze_dir_command_t message;
     message.mtype = recipient;
     message.op_code = COMMAND_CODE_ANALYZE_DIR;
-    strncpy(message.target, target_dir, sizeof(PATH_SIZE) - 1);
+    strncpy(message.target, target_dir, sizeof(message.target) - 1);
+    message.target[sizeof(message.target) - 1] = '\0';
 
     size_t message_size = sizeof(message) - sizeof(long);
     return msgsnd(msg_queue, &message, message_size, 0);
@@ -54,6 +55,27 @@ int send_analyze_file_command(int msg_queue, int recipient, files_list_entry_t *
     return send_file_entry(msg_queue, recipient, file_entry, COMMAND_CODE_ANALYZE_FILE);
 }
 
+/*!
+ * @brief send_analyze_files_command sends several entries to be analyzed by the same analyzer
+ * @param msg_queue the MQ identifier through which to send the entries
+ * @param recipient is the id of the recipient (as specified by mtype)
+ * @param paths contains the paths of the entries, each followed by a '\0'
+ * @param length is the length of paths, at most PATH_SIZE - 1 (an empty path ends the list)
+ * @param msg_flags are the flags of msgsnd (IPC_NOWAIT not to wait for room in the MQ)
+ * @return the result of msgsnd
+ */
+int send_analyze_files_command(int msg_queue, int recipient, char *paths, size_t length, int msg_flags) {
+    analyze_files_command_t message;
+    message.mtype = recipient;
+    message.op_code = COMMAND_CODE_ANALYZE_FILES;
+    memcpy(message.paths, paths, length);
+    message.paths[length] = '\0';
+
+    // Seuls les chemins sont envoyés : les requêtes occupent peu de place dans la MQ, que les réponses partagent
+    size_t message_size = sizeof(message.op_code) + length + 1;
+    return msgsnd(msg_queue, &message, message_size, msg_flags);
+}
+
 /*!
  * @brief send_analyze_file_response sends a file entry after analyze
  * @param msg_queue the MQ identifier through which to send the entry
@@ -85,8 +107,25 @@ int send_files_list_element(int msg_queue, int recipient, files_list_entry_t *fi
  * @return the result of msgsnd
  */
 int send_list_end(int msg_queue, int recipient) {
-    
-    //return msgsnd(msg_queue, &message, message_size, 0);
+    simple_command_t list_end;
+    list_end.mtype = recipient;
+    list_end.message = COMMAND_CODE_LIST_COMPLETE;
+    return msgsnd(msg_queue, &list_end, sizeof(char), 0);
+}
+
+/*!
+ * @brief send_entries_request asks a lister for the next window of its sorted files list
+ * The lister answers with at most STREAM_WINDOW_SIZE entries, followed by a list end when its list is exhausted.
+ * Pulling the entries lets main read one list at a time without the other lister filling the MQ.
+ * @param msg_queue is the id of the MQ used to send the message
+ * @param recipient is the lister to request the entries from
+ * @return the result of msgsnd
+ */
+int send_entries_request(int msg_queue, int recipient) {
+    simple_command_t request;
+    request.mtype = recipient;
+    request.message = COMMAND_CODE_REQUEST_ENTRIES;
+    return msgsnd(msg_queue, &request, sizeof(char), 0);
 }
 
 /*!
@@ -0,0 +1,180 @@
+#include "moves.h"
+#include "utility.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Move detection matches files missing in the destination with destination files that no longer exist in the
+// source, based on their size and MD5 sum. A match is renamed in place instead of being copied again.
+
+/*!
+ * @brief hash_entry computes the slot of an entry from its size and MD5 sum
+ */
+static size_t hash_entry(files_list_entry_t *entry, size_t capacity) {
+    uint64_t hash;
+    memcpy(&hash, entry->md5sum, sizeof(hash));
+    hash ^= entry->size * 0x9E3779B97F4A7C15ULL;
+    return hash % capacity;
+}
+
+/*!
+ * @brief same_content tells if two file entries have the same size and MD5 sum
+ */
+static bool same_content(files_list_entry_t *lhd, files_list_entry_t *rhd) {
+    return lhd->size == rhd->size && memcmp(lhd->md5sum, rhd->md5sum, sizeof(lhd->md5sum)) == 0;
+}
+
+/*!
+ * @brief same_metadata tells if two file entries have the same mode and mtime, which a hard link would share
+ */
+static bool same_metadata(files_list_entry_t *lhd, files_list_entry_t *rhd) {
+    return (lhd->mode & 07777) == (rhd->mode & 07777)
+        && lhd->mtime.tv_sec == rhd->mtime.tv_sec && lhd->mtime.tv_nsec == rhd->mtime.tv_nsec;
+}
+
+/*!
+ * @brief init_moves_index indexes the destination files that do not exist in the source
+ * @param index is a pointer to the index to initialize
+ * @param destination_list is the destination files list, whose entries are referenced (not copied) by the index
+ * @param source_list is the source files list
+ * @param the_config is a pointer to the configuration
+ * @return 0 on success, -1 else
+ */
+int init_moves_index(moves_index_t *index, files_list_t *destination_list, files_list_t *source_list, configuration_t *the_config) {
+    memset(index, 0, sizeof(moves_index_t));
+    size_t source_prefix = path_prefix_length(the_config->source);
+    size_t destination_prefix = path_prefix_length(the_config->destination);
+
+    size_t extras_count = 0;
+    for (files_list_entry_t *cursor=destination_list->head; cursor!=NULL; cursor=cursor->next) {
+        ++extras_count;
+    }
+    index->capacity = 2 * extras_count + 1;
+    index->slots = calloc(index->capacity, sizeof(files_list_entry_t *));
+    index->is_moved = calloc(index->capacity, sizeof(bool));
+    if (index->slots == NULL || index->is_moved == NULL) {
+        clear_moves_index(index);
+        return -1;
+    }
+
+    // Les deux listes sont triées par chemin : le curseur de la source ne fait qu'avancer
+    files_list_entry_t *source_cursor = source_list->head;
+    for (files_list_entry_t *cursor=destination_list->head; cursor!=NULL; cursor=cursor->next) {
+        if (cursor->entry_type != FICHIER || cursor->size == 0) {
+            continue;
+        }
+        if (find_next_entry_by_name(&source_cursor, cursor->path_and_name, source_prefix, destination_prefix) != NULL) {
+            continue;
+        }
+        size_t slot = hash_entry(cursor, index->capacity);
+        while (index->slots[slot] != NULL) {
+            slot = (slot + 1) % index->capacity;
+        }
+        index->slots[slot] = cursor;
+    }
+    return 0;
+}
+
+/*!
+ * @brief apply_source_metadata gives a moved file the mode and mtime of its source entry
+ * @param path is the new path of the file in the destination
+ * @param source_entry is the source entry
+ */
+static void apply_source_metadata(char *path, files_list_entry_t *source_entry) {
+    struct timespec times[2] = {{0, UTIME_OMIT}, source_entry->mtime};
+    chmod(path, source_entry->mode & 07777);
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+/*!
+ * @brief try_move_entry tries to get a missing source file from an extra destination file with the same content
+ * The first match is renamed to the new path. If that file was already moved for another source entry with the same
+ * mode and mtime, the new path becomes a hard link to it, so that no data is copied either. A hard link shares the
+ * metadata, so files with other metadata are copied.
+ * @param index is a pointer to the moves index
+ * @param source_entry is the source file missing or different in the destination
+ * @param the_config is a pointer to the configuration
+ * @return true if the file was moved or linked (nothing left to copy), false else
+ */
+bool try_move_entry(moves_index_t *index, files_list_entry_t *source_entry, configuration_t *the_config) {
+    if (index == NULL || index->capacity == 0 || source_entry->entry_type != FICHIER || source_entry->size == 0) {
+        return false;
+    }
+
+    // Prefer a file not moved yet, fallback to linking one already moved
+    ssize_t unmoved_slot = -1;
+    ssize_t moved_slot = -1;
+    for (size_t slot=hash_entry(source_entry, index->capacity); index->slots[slot]!=NULL; slot=(slot+1)%index->capacity) {
+        if (!same_content(index->slots[slot], source_entry)) {
+            continue;
+        }
+        if (!index->is_moved[slot]) {
+            unmoved_slot = (ssize_t) slot;
+            break;
+        }
+        if (moved_slot == -1 && same_metadata(index->slots[slot], source_entry)) {
+            moved_slot = (ssize_t) slot;
+        }
+    }
+    if (unmoved_slot == -1 && moved_slot == -1) {
+        return false;
+    }
+
+    char destination_path[PATH_SIZE];
+    if (concat_path(destination_path, the_config->destination, source_entry->path_and_name + path_prefix_length(the_config->source)) == NULL) {
+        return false;
+    }
+
+    size_t slot = unmoved_slot != -1 ? (size_t) unmoved_slot : (size_t) moved_slot;
+    files_list_entry_t *match = index->slots[slot];
+    if (the_config->verbose || the_config->dry_run) {
+        printf("%s %s -> %s\n", unmoved_slot != -1 ? "Moving" : "Linking", match->path_and_name, destination_path);
+    }
+    if (!the_config->dry_run) {
+        int result = unmoved_slot != -1
+            ? renameat(AT_FDCWD, match->path_and_name, AT_FDCWD, destination_path)
+            : linkat(AT_FDCWD, match->path_and_name, AT_FDCWD, destination_path, 0);
+        if (result == -1) {
+            perror("Unable to move file in destination");
+            return false;
+        }
+        apply_source_metadata(destination_path, source_entry);
+    }
+
+    if (unmoved_slot != -1) {
+        // The index entry now stands for the file at its new location, with the metadata of its source
+        snprintf(match->path_and_name, sizeof(match->path_and_name), "%s", destination_path);
+        match->mode = source_entry->mode;
+        match->mtime = source_entry->mtime;
+        index->is_moved[slot] = true;
+        ++index->moves_count;
+    } else {
+        ++index->links_count;
+    }
+    index->bytes_saved += source_entry->size;
+    return true;
+}
+
+/*!
+ * @brief display_moves_report displays the number of moves and links, and the bytes they saved
+ * @param index is a pointer to the moves index
+ */
+void display_moves_report(moves_index_t *index) {
+    printf("Detected moves: %zu, links: %zu, bytes not transferred: %llu\n",
+           index->moves_count, index->links_count, (unsigned long long) index->bytes_saved);
+}
+
+/*!
+ * @brief clear_moves_index frees the index (the indexed entries belong to the destination list)
+ * @param index is a pointer to the moves index
+ */
+void clear_moves_index(moves_index_t *index) {
+    free(index->slots);
+    free(index->is_moved);
+    index->slots = NULL;
+    index->is_moved = NULL;
+    index->capacity = 0;
+}
@@ -2,6 +2,13 @@
 #include <../include/messages.h>
 #include <../include/file-properties.h>
 #include <../include/sync.h>
+#include <../include/external-sort.h>
+#include <../include/autoscale.h>
+#include <../include/throttle.h>
+#include <../include/locality.h>
+#include <../include/journal.h>
+#include <../include/filter.h>
+#include <../include/progress.h>
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,38 +16,98 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/wait.h>
 
 #include <signal.h>
+#include <time.h>
+
+#define LISTER_RETRY_NS 1000000L // Wait before sending again to a full MQ, with no response to receive meanwhile
 
 /*!
  * @brief prepare prepares (only when parallel is enabled) the processes used for the synchronization.
+ * The I/O throttle and class are set up in all modes, since the main process copies the files.
  * @param the_config is a pointer to the program configuration
  * @param p_context is a pointer to the program processes context
  * @return 0 if all went good, -1 else
  */
 int prepare(configuration_t *the_config, process_context_t *p_context) {
+    // Shared by all the processes, so it must exist before forking
+    if (init_io_throttle(the_config) == -1) {
+        return -1;
+    }
+    p_context->io_class = the_config->io_class;
+    if (apply_io_class(p_context->io_class) == -1) {
+        perror("Unable to set the I/O class");
+    }
+    // The analyzers inherit the records loaded by --resume (or from the manifest) and append to the same journal
+    if (init_journal(the_config) == -1) {
+        return -1;
+    }
+    // The reporter renders the counters that every process updates (--progress, --progress-fd, --progress-socket)
+    p_context->progress_pid = -1;
+    if ((the_config->progress || the_config->progress_fd != -1 || the_config->progress_socket[0] != '\0')
+        && init_progress(the_config) == 0) {
+        p_context->progress_pid = make_process(p_context, progress_process_loop, the_config);
+    }
+
     // Check if parallel is enabled
-    if (the_config->is_parallel) {
-        // Create lister process
-        p_context->source_lister_pid = make_process(p_context, lister_process_loop, &the_config->processes_count);
-        if (p_context->source_lister_pid == -1) {
-            return -1; // Failed to create lister process
-        }
+    if (!the_config->is_parallel) {
+        return 0;
+    }
 
-        // Create analyzer process
-        p_context->source_analyzers_pids = make_process(p_context, analyzer_process_loop, &the_config->processes_count);
-        if (p_context->source_analyzers_pids == -1) {
-            // Terminate lister process
-            kill(p_context->source_lister_pid, SIGTERM);
-            return -1; // Failed to create analyzer process
-        }
+    p_context->processes_count = the_config->processes_count;
+    p_context->main_process_pid = getpid();
+    p_context->shared_key = ftok(the_config->source, 'L');
+    p_context->message_queue_id = msgget(p_context->shared_key, IPC_CREAT | 0666);
+    if (p_context->message_queue_id == -1) {
+        perror("Unable to create the message queue");
+        return -1;
+    }
 
-        // Wait for both processes to initialize
-        if (wait_for_processes(p_context) == -1) {
-            // Terminate lister and analyzer processes
-            kill(p_context->source_lister_pid, SIGTERM);
-            kill(p_context->source_analyzers_pids, SIGTERM);
-            return -1; // Failed to wait for processes
+    // Listers configurations (copied into the children by fork)
+    lister_configuration_t source_lister = {
+        .my_recipient_id = MSG_TYPE_TO_SOURCE_ANALYZERS,
+        .my_receiver_id = MSG_TYPE_TO_SOURCE_LISTER,
+        .analyzers_count = the_config->processes_count,
+        .auto_scale = the_config->auto_processes,
+        .verbose = the_config->verbose,
+        .my_main_recipient_id = MSG_TYPE_SOURCE_LIST_TO_MAIN,
+        .memory_limit = the_config->memory_limit,
+        .locality = the_config->locality,
+        .mq_key = p_context->shared_key,
+    };
+    lister_configuration_t destination_lister = source_lister;
+    destination_lister.my_recipient_id = MSG_TYPE_TO_DESTINATION_ANALYZERS;
+    destination_lister.my_receiver_id = MSG_TYPE_TO_DESTINATION_LISTER;
+    destination_lister.my_main_recipient_id = MSG_TYPE_DESTINATION_LIST_TO_MAIN;
+
+    // Analyzers configurations
+    analyzer_configuration_t source_analyzer = {
+        .my_recipient_id = MSG_TYPE_TO_SOURCE_LISTER,
+        .my_receiver_id = MSG_TYPE_TO_SOURCE_ANALYZERS,
+        .mq_key = p_context->shared_key,
+        .use_md5 = the_config->uses_md5,
+    };
+    analyzer_configuration_t destination_analyzer = source_analyzer;
+    destination_analyzer.my_recipient_id = MSG_TYPE_TO_DESTINATION_LISTER;
+    destination_analyzer.my_receiver_id = MSG_TYPE_TO_DESTINATION_ANALYZERS;
+
+    p_context->source_lister_pid = make_process(p_context, lister_process_loop, &source_lister);
+    p_context->destination_lister_pid = make_process(p_context, lister_process_loop, &destination_lister);
+    if (p_context->source_lister_pid == -1 || p_context->destination_lister_pid == -1) {
+        return -1; // Failed to create lister processes
+    }
+
+    p_context->source_analyzers_pids = malloc(p_context->processes_count * sizeof(pid_t));
+    p_context->destination_analyzers_pids = malloc(p_context->processes_count * sizeof(pid_t));
+    if (p_context->source_analyzers_pids == NULL || p_context->destination_analyzers_pids == NULL) {
+        return -1;
+    }
+    for (int i=0; i<p_context->processes_count; ++i) {
+        p_context->source_analyzers_pids[i] = make_process(p_context, analyzer_process_loop, &source_analyzer);
+        p_context->destination_analyzers_pids[i] = make_process(p_context, analyzer_process_loop, &destination_analyzer);
+        if (p_context->source_analyzers_pids[i] == -1 || p_context->destination_analyzers_pids[i] == -1) {
+            return -1; // Failed to create analyzer processes
         }
     }
 
@@ -55,24 +122,285 @@ int prepare(configuration_t *the_config, process_context_t *p_context) {
  * @return the PID of the child process (it never returns in the child process)
  */
 int make_process(process_context_t *p_context, process_loop_t func, void *parameters) {
+    // The child inherits the stdio buffers: they are flushed first, so that it never prints them again
+    fflush(stdout);
+    fflush(stderr);
     pid_t pid = fork();
     if (pid == -1) {
         return -1; // Failed to create child process
     } else if (pid == 0) {
         // Child process
+        apply_io_class(p_context->io_class);
+        reset_progress_slot();
         func(parameters);
-        exit(0); // Exit child process
+        fflush(stdout);
+        _exit(0); // Exit child process, without flushing the inherited buffers again
     } else {
         // Parent process
         return pid; // Return child process ID to the parent
     }
 }
 
+typedef struct {
+    int msg_queue;
+    lister_configuration_t *cfg;
+    external_sorter_t *sorter;
+    int current_analyzers; // Analyze requests without response yet
+    int pending_requests; // Entries requests received from main before the list was complete
+    autoscale_t autoscale; // Used with auto_scale only
+    locality_batch_t batch; // Entries waiting to be dispatched in physical order, used with locality only
+    char files_batch[PATH_SIZE]; // Paths of the next analyze files request, without auto_scale only
+    size_t files_batch_length;
+    int files_batch_count;
+} lister_state_t;
+
+/*!
+ * @brief receive_lister_message waits for one message while the lister is analyzing its tree
+ * Analyzed entries are added to the sorter, entries requests from main are kept for later
+ * @param state is a pointer to the lister state
+ * @return 0 when a message was processed, -1 on MQ error
+ */
+static int receive_lister_message(lister_state_t *state) {
+    any_message_t message;
+    if (msgrcv(state->msg_queue, &message, sizeof(any_message_t) - sizeof(long), state->cfg->my_receiver_id, 0) == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    switch (message.simple_command.message) {
+        case COMMAND_CODE_FILE_ANALYZED:
+            --state->current_analyzers;
+            if (state->cfg->auto_scale) {
+                files_list_entry_t *entry = &message.list_entry.payload;
+                autoscale_record(&state->autoscale, entry->entry_type == FICHIER ? entry->size : 0);
+            }
+            // An empty path means the analyzer could not get the entry properties
+            if (message.list_entry.payload.path_and_name[0] != '\0') {
+                external_sorter_add(state->sorter, &message.list_entry.payload);
+            }
+            break;
+        case COMMAND_CODE_REQUEST_ENTRIES:
+            ++state->pending_requests;
+            break;
+    }
+    return 0;
+}
+
+/*!
+ * @brief send_files_batch sends the batched entries to an analyzer, which hashes the small files together
+ * Each analyzer has at most one batch in flight. The responses of the other analyzers may fill the MQ, so they are
+ * received while there is no room for the batch.
+ * @param state is a pointer to the lister state
+ */
+static void send_files_batch(lister_state_t *state) {
+    if (state->files_batch_count == 0) {
+        return;
+    }
+    while (state->current_analyzers + state->files_batch_count > state->cfg->analyzers_count * MD5_BATCH_FILES) {
+        if (receive_lister_message(state) == -1) {
+            return;
+        }
+    }
+    while (send_analyze_files_command(state->msg_queue, state->cfg->my_recipient_id, state->files_batch,
+                                      state->files_batch_length, IPC_NOWAIT) == -1) {
+        if (errno != EAGAIN) {
+            return;
+        }
+        // Sans requête en cours, aucune réponse ne viendra : la MQ est remplie par l'autre lister et ses analyseurs
+        if (state->current_analyzers == 0) {
+            struct timespec wait = {0, LISTER_RETRY_NS};
+            nanosleep(&wait, NULL);
+        } else if (receive_lister_message(state) == -1) {
+            return;
+        }
+    }
+    state->current_analyzers += state->files_batch_count;
+    state->files_batch_length = 0;
+    state->files_batch_count = 0;
+}
+
+/*!
+ * @brief dispatch_entry sends an entry to an analyzer, waiting for one to be available
+ * Without auto_scale, entries are sent by batches of MD5_BATCH_FILES (@see send_files_batch).
+ * @param entry is the entry to analyze (only its path is needed)
+ * @param context is a pointer to the lister state
+ */
+static void dispatch_entry(files_list_entry_t *entry, void *context) {
+    lister_state_t *state = (lister_state_t *) context;
+    size_t length = strlen(entry->path_and_name) + 1;
+    if (!state->cfg->auto_scale && length < PATH_SIZE) {
+        if (state->files_batch_length + length >= PATH_SIZE) {
+            send_files_batch(state);
+        }
+        memcpy(state->files_batch + state->files_batch_length, entry->path_and_name, length);
+        state->files_batch_length += length;
+        if (++state->files_batch_count == MD5_BATCH_FILES) {
+            send_files_batch(state);
+        }
+        return;
+    }
+    // Un chemin trop long pour un lot est envoyé seul
+    int allowed_analyzers = state->cfg->analyzers_count * MD5_BATCH_FILES;
+    if (state->cfg->auto_scale) {
+        bool has_waited = state->current_analyzers >= state->autoscale.current_count;
+        allowed_analyzers = autoscale_update(&state->autoscale, state->current_analyzers, has_waited);
+    }
+    while (state->current_analyzers >= allowed_analyzers) {
+        if (receive_lister_message(state) == -1) {
+            return;
+        }
+    }
+    request_element_details(state->msg_queue, entry, state->cfg, &state->current_analyzers);
+}
+
+/*!
+ * @brief list_entry is the walk_tree callback of the lister: it dispatches an entry, or batches it with locality
+ * @param path is the path of the entry
+ * @param dir_entry is the directory entry of path, giving its inode without a stat
+ * @param context is a pointer to the lister state
+ */
+static void list_entry(char *path, struct dirent *dir_entry, void *context) {
+    lister_state_t *state = (lister_state_t *) context;
+    files_list_entry_t entry;
+    memset(&entry, 0, sizeof(files_list_entry_t));
+    strncpy(entry.path_and_name, path, sizeof(entry.path_and_name) - 1);
+    entry.entry_type = dir_entry->d_type == DT_DIR ? DOSSIER : FICHIER;
+    entry.inode = dir_entry->d_ino;
+    if (state->batch.entries == NULL) {
+        dispatch_entry(&entry, state);
+    } else if (locality_batch_add(&state->batch, &entry)) {
+        locality_batch_flush(&state->batch, dispatch_entry, state);
+    }
+}
+
+/*!
+ * @brief send_entries_window sends the next window of the sorted list to main, and the list end once exhausted
+ * @param state is a pointer to the lister state
+ */
+static void send_entries_window(lister_state_t *state) {
+    files_list_entry_t entry;
+    for (int i=0; i<STREAM_WINDOW_SIZE; ++i) {
+        if (!external_sorter_next(state->sorter, &entry)) {
+            send_list_end(state->msg_queue, state->cfg->my_main_recipient_id);
+            return;
+        }
+        send_files_list_element(state->msg_queue, state->cfg->my_main_recipient_id, &entry);
+    }
+}
+
 /*!
  * @brief lister_process_loop is the lister process function (@see make_process)
+ * The lister walks its tree and keeps at most one batch of MD5_BATCH_FILES entries in flight per analyzer (or one
+ * entry per analyzer in use with auto_scale, their count being chosen at runtime). Analyzed entries go to
+ * an external sorter, which spills sorted runs to temporary files beyond the memory limit. The sorted list is then
+ * streamed to main, one window per entries request.
  * @param parameters is a pointer to its parameters, to be cast to a lister_configuration_t
  */
 void lister_process_loop(void *parameters) {
+    lister_configuration_t *cfg = (lister_configuration_t *) parameters;
+    external_sorter_t sorter;
+    lister_state_t state = {
+        .msg_queue = msgget(cfg->mq_key, 0666),
+        .cfg = cfg,
+        .sorter = &sorter,
+        .current_analyzers = 0,
+        .pending_requests = 0,
+        .files_batch_length = 0,
+        .files_batch_count = 0,
+    };
+    if (state.msg_queue == -1 || init_external_sorter(&sorter, cfg->memory_limit) == -1) {
+        return;
+    }
+    state.batch.entries = NULL;
+    if (cfg->locality != LOCALITY_NONE) {
+        init_locality_batch(&state.batch, cfg->locality);
+    }
+
+    bool is_listed = false;
+    any_message_t message;
+    while (true) {
+        if (msgrcv(state.msg_queue, &message, sizeof(any_message_t) - sizeof(long), cfg->my_receiver_id, 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        switch (message.simple_command.message) {
+            case COMMAND_CODE_ANALYZE_DIR:
+                // The destination lister lists every destination in turn
+                if (is_listed) {
+                    clear_external_sorter(&sorter);
+                    if (init_external_sorter(&sorter, cfg->memory_limit) == -1) {
+                        return;
+                    }
+                    is_listed = false;
+                }
+                if (cfg->auto_scale) {
+                    char *name = cfg->my_receiver_id == MSG_TYPE_TO_SOURCE_LISTER ? "source" : "destination";
+                    uint16_t initial_count = initial_analyzers_count(message.analyze_dir_command.target, cfg->analyzers_count);
+                    init_autoscale(&state.autoscale, name, initial_count, cfg->analyzers_count, cfg->verbose);
+                    if (cfg->verbose) {
+                        printf("[%s] starting with %u analyzers out of %d\n", name, initial_count, cfg->analyzers_count);
+                    }
+                }
+                walk_tree(message.analyze_dir_command.target, cfg->my_receiver_id != MSG_TYPE_TO_SOURCE_LISTER, list_entry, &state);
+                if (cfg->verbose) {
+                    display_filter_report(message.analyze_dir_command.target);
+                }
+                if (state.batch.entries != NULL) {
+                    locality_batch_flush(&state.batch, dispatch_entry, &state);
+                }
+                send_files_batch(&state);
+                while (state.current_analyzers > 0) {
+                    if (receive_lister_message(&state) == -1) {
+                        break;
+                    }
+                }
+                external_sorter_finish(&sorter);
+                is_listed = true;
+                for (; state.pending_requests > 0; --state.pending_requests) {
+                    send_entries_window(&state);
+                }
+                break;
+            case COMMAND_CODE_REQUEST_ENTRIES:
+                if (is_listed) {
+                    send_entries_window(&state);
+                } else {
+                    ++state.pending_requests;
+                }
+                break;
+            case COMMAND_CODE_TERMINATE:
+                clear_external_sorter(&sorter);
+                clear_locality_batch(&state.batch);
+                send_terminate_confirm(state.msg_queue, MSG_TYPE_TO_MAIN);
+                return;
+        }
+    }
+    clear_external_sorter(&sorter);
+    clear_locality_batch(&state.batch);
+}
+
+/*!
+ * @brief analyze_files analyzes the entries of an analyze files request, then sends their responses
+ * The small files are hashed together once all the entries are stat-ed (@see flush_md5_batch).
+ * @param msg_queue is the id of the MQ
+ * @param cfg is a pointer to the analyzer configuration
+ * @param paths contains the paths of the entries, each followed by a '\0', then an empty path
+ * @param batch is the batch of small files of the analyzer
+ */
+static void analyze_files(int msg_queue, analyzer_configuration_t *cfg, char *paths, md5_batch_t *batch) {
+    static files_list_entry_t entries[MD5_BATCH_FILES];
+    int count = 0;
+    for (char *path=paths; *path != '\0' && count < MD5_BATCH_FILES; path += strlen(path) + 1) {
+        files_list_entry_t *entry = &entries[count++];
+        memset(entry, 0, sizeof(files_list_entry_t));
+        snprintf(entry->path_and_name, sizeof(entry->path_and_name), "%s", path);
+        if (get_file_stats_batched(entry, batch) == -1) {
+            entry->path_and_name[0] = '\0';
+        }
+    }
+    flush_md5_batch(batch);
+    for (int i=0; i<count; ++i) {
+        send_analyze_file_response(msg_queue, cfg->my_recipient_id, &entries[i]);
+    }
 }
 
 /*!
@@ -80,6 +408,38 @@ void lister_process_loop(void *parameters) {
  * @param parameters is a pointer to its parameters, to be cast to an analyzer_configuration_t
  */
 void analyzer_process_loop(void *parameters) {
+    analyzer_configuration_t *cfg = (analyzer_configuration_t *) parameters;
+    int msg_queue = msgget(cfg->mq_key, 0666);
+    md5_batch_t batch;
+    if (msg_queue == -1 || init_md5_batch(&batch) == -1) {
+        return;
+    }
+
+    any_message_t message;
+    while (true) {
+        if (msgrcv(msg_queue, &message, sizeof(any_message_t) - sizeof(long), cfg->my_receiver_id, 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            clear_md5_batch(&batch);
+            return;
+        }
+        if (message.simple_command.message == COMMAND_CODE_TERMINATE) {
+            clear_md5_batch(&batch);
+            send_terminate_confirm(msg_queue, MSG_TYPE_TO_MAIN);
+            return;
+        }
+        if (message.simple_command.message == COMMAND_CODE_ANALYZE_FILES) {
+            analyze_files(msg_queue, cfg, message.analyze_files_command.paths, &batch);
+        }
+        if (message.simple_command.message == COMMAND_CODE_ANALYZE_FILE) {
+            files_list_entry_t *entry = &message.analyze_file_command.payload;
+            if (get_file_stats(entry) == -1) {
+                entry->path_and_name[0] = '\0';
+            }
+            send_analyze_file_response(msg_queue, cfg->my_recipient_id, entry);
+        }
+    }
 }
 
 /*!
@@ -88,22 +448,48 @@ void analyzer_process_loop(void *parameters) {
  * @param p_context is a pointer to the processes context
  */
 void clean_processes(configuration_t *the_config, process_context_t *p_context) {
+    finish_progress(p_context->progress_pid);
+
     // Do nothing if not parallel
     if (!the_config->is_parallel) {
         return;
     }
 
     // Send terminate
-    send_terminate_signal(p_context->source_lister_pid);
-    send_terminate_signal(p_context->source_analyzers_pids);
+    send_terminate_command(p_context->message_queue_id, MSG_TYPE_TO_SOURCE_LISTER);
+    send_terminate_command(p_context->message_queue_id, MSG_TYPE_TO_DESTINATION_LISTER);
+    for (int i=0; i<p_context->processes_count; ++i) {
+        send_terminate_command(p_context->message_queue_id, MSG_TYPE_TO_SOURCE_ANALYZERS);
+        send_terminate_command(p_context->message_queue_id, MSG_TYPE_TO_DESTINATION_ANALYZERS);
+    }
 
     // Wait for responses
-    wait_for_process_termination(p_context->source_lister_pid);
-    wait_for_process_termination(p_context->source_analyzers_pids);
+    simple_command_t confirm;
+    for (int i=0; i<2 + 2 * p_context->processes_count; ++i) {
+        if (msgrcv(p_context->message_queue_id, &confirm, sizeof(char), MSG_TYPE_TO_MAIN, 0) == -1 && errno != EINTR) {
+            break;
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
 
     // Free allocated memory
     free(p_context->source_analyzers_pids);
+    free(p_context->destination_analyzers_pids);
 
     // Free the MQ
     msgctl(p_context->message_queue_id, IPC_RMID, NULL);
 }
+
+/*!
+ * @brief request_element_details sends an entry to the analyzers and counts it as a pending request
+ * @param msg_queue is the id of the MQ used to send the request
+ * @param entry is the entry to analyze (only its path is set)
+ * @param cfg is a pointer to the lister configuration
+ * @param current_analyzers is a pointer to the count of pending requests
+ */
+void request_element_details(int msg_queue, files_list_entry_t *entry, lister_configuration_t *cfg, int *current_analyzers) {
+    if (send_analyze_file_command(msg_queue, cfg->my_recipient_id, entry) != -1) {
+        ++(*current_analyzers);
+    }
+}
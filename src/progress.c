@@ -0,0 +1,327 @@
+#include "progress.h"
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// The progress is mapped in anonymous shared memory before the processes are forked. Every process adds to the
+// counters with relaxed atomics and writes the file it handles in its own slot: nothing waits and nothing is
+// formatted on the hot path. A reporter process renders the counters periodically, on stderr (--progress) and as
+// one JSON object per line (--progress-fd, --progress-socket).
+
+static progress_t *shared_progress = NULL;
+static int progress_output = -1; // Where the JSON lines are written, -1 if none
+static double start_time;
+static int my_slot = -1; // Slot of the current process, claimed on its first file
+
+static const char *counters_names[PROGRESS_COUNTERS] = {
+    "listed", "analyzed", "bytes_hashed", "files_to_copy", "bytes_to_copy", "files_copied", "bytes_copied"
+};
+
+/*!
+ * @brief now_seconds gives a monotonic time in seconds
+ */
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*!
+ * @brief connect_progress_socket connects to the Unix socket receiving the JSON lines
+ * @param path is the path of the socket
+ * @return the connected socket, -1 on failure
+ */
+static int connect_progress_socket(char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*!
+ * @brief init_progress creates the shared progress when --progress, --progress-fd or --progress-socket is used
+ * Must be called before forking the processes. The calling process gets the main slot.
+ * @param the_config is a pointer to the configuration
+ * @return 0 on success (or when the progress is not followed), -1 else
+ */
+int init_progress(configuration_t *the_config) {
+    if (!the_config->progress && the_config->progress_fd == -1 && the_config->progress_socket[0] == '\0') {
+        return 0;
+    }
+    progress_output = the_config->progress_fd;
+    if (the_config->progress_socket[0] != '\0') {
+        progress_output = connect_progress_socket(the_config->progress_socket);
+        if (progress_output == -1) {
+            perror("Unable to connect to the progress socket");
+            return -1;
+        }
+    }
+    progress_t *progress = mmap(NULL, sizeof(progress_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (progress == MAP_FAILED) {
+        perror("Unable to map the progress");
+        return -1;
+    }
+    // An anonymous mapping is zeroed
+    progress->slots[0].role = 'm';
+    progress->slots[0].pid = getpid();
+    progress->slots_count = 1;
+    my_slot = 0;
+    start_time = now_seconds();
+    shared_progress = progress;
+    return 0;
+}
+
+/*!
+ * @brief reset_progress_slot forgets the slot inherited from the parent process, called by every forked process
+ */
+void reset_progress_slot(void) {
+    my_slot = -1;
+}
+
+/*!
+ * @brief count_progress adds to a shared counter, does nothing when the progress is not followed
+ * @param counter is the counter to increase
+ * @param value is added to the counter
+ */
+void count_progress(progress_counter_t counter, uint64_t value) {
+    progress_t *progress = shared_progress;
+    if (progress == NULL) {
+        return;
+    }
+    __atomic_fetch_add(&progress->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief set_progress_file shows the file handled by the current process
+ * A process gets a slot on its first call (only main has one beforehand). The end of the path is kept, it tells the
+ * most about the file.
+ * @param path is the path of the file
+ */
+void set_progress_file(char *path) {
+    progress_t *progress = shared_progress;
+    if (progress == NULL || my_slot == PROGRESS_SLOTS) {
+        return;
+    }
+    if (my_slot == -1) {
+        uint32_t index = __atomic_fetch_add(&progress->slots_count, 1, __ATOMIC_RELAXED);
+        if (index >= PROGRESS_SLOTS) {
+            my_slot = PROGRESS_SLOTS;
+            return;
+        }
+        my_slot = index;
+        progress->slots[index].role = 'a';
+        __atomic_store_n(&progress->slots[index].pid, getpid(), __ATOMIC_RELEASE);
+    }
+    size_t length = strlen(path);
+    char *tail = length < PROGRESS_NAME_SIZE ? path : path + length - (PROGRESS_NAME_SIZE - 1);
+    memcpy(progress->slots[my_slot].current, tail, strlen(tail) + 1);
+}
+
+/*!
+ * @brief format_size writes a size with a binary unit
+ * @param buffer receives the size, 16 bytes are enough
+ * @param bytes is the size to format
+ * @return buffer
+ */
+static char *format_size(char *buffer, double bytes) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024.0 && unit < 4) {
+        bytes /= 1024.0;
+        ++unit;
+    }
+    snprintf(buffer, 16, unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+    return buffer;
+}
+
+/*!
+ * @brief format_duration writes a duration as [h:]mm:ss, or -- when it is unknown
+ * @param buffer receives the duration, 16 bytes are enough
+ * @param seconds is the duration, negative when unknown
+ * @return buffer
+ */
+static char *format_duration(char *buffer, double seconds) {
+    if (seconds < 0.0 || seconds > 359999.0) {
+        snprintf(buffer, 16, "--:--");
+        return buffer;
+    }
+    unsigned int total = (unsigned int) seconds;
+    if (total >= 3600) {
+        snprintf(buffer, 16, "%u:%02u:%02u", total / 3600, total / 60 % 60, total % 60);
+    } else {
+        snprintf(buffer, 16, "%02u:%02u", total / 60, total % 60);
+    }
+    return buffer;
+}
+
+/*!
+ * @brief copy_slot_file reads the current file of a slot, terminated even if it was torn while being copied
+ * @param progress is a pointer to the shared progress
+ * @param index is the index of the slot
+ * @param file receives the file, of PROGRESS_NAME_SIZE bytes
+ */
+static void copy_slot_file(progress_t *progress, uint32_t index, char *file) {
+    memcpy(file, progress->slots[index].current, PROGRESS_NAME_SIZE);
+    file[PROGRESS_NAME_SIZE - 1] = '\0';
+}
+
+/*!
+ * @brief render_line displays the progress on a single line of stderr, rewritten in place on a terminal
+ */
+static void render_line(progress_t *progress, uint64_t *counters, double hash_rate, double copy_rate, double eta, bool is_done) {
+    char hashed[16], hash_speed[16], copied[16], to_copy[16], copy_speed[16], remaining[16];
+    char file[PROGRESS_NAME_SIZE];
+    copy_slot_file(progress, 0, file);
+    bool is_terminal = isatty(STDERR_FILENO);
+    fprintf(stderr, "%s%llu/%llu entries, %s hashed (%s/s), %s/%s copied (%s/s), ETA %s %s%s",
+            is_terminal ? "\r" : "",
+            (unsigned long long) counters[PROGRESS_ANALYZED], (unsigned long long) counters[PROGRESS_LISTED],
+            format_size(hashed, counters[PROGRESS_BYTES_HASHED]), format_size(hash_speed, hash_rate),
+            format_size(copied, counters[PROGRESS_BYTES_COPIED]), format_size(to_copy, counters[PROGRESS_BYTES_TO_COPY]),
+            format_size(copy_speed, copy_rate), format_duration(remaining, eta), is_done ? "" : file,
+            is_terminal ? "\033[K" : "\n");
+    if (is_terminal && is_done) {
+        fputc('\n', stderr);
+    }
+    fflush(stderr);
+}
+
+/*!
+ * @brief write_json_string writes a string as a JSON string, escaping quotes, backslashes and control characters
+ */
+static void write_json_string(FILE *output, char *string) {
+    fputc('"', output);
+    for (unsigned char *c=(unsigned char *) string; *c!='\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', output);
+            fputc(*c, output);
+        } else if (*c < 0x20) {
+            fprintf(output, "\\u%04x", *c);
+        } else {
+            fputc(*c, output);
+        }
+    }
+    fputc('"', output);
+}
+
+/*!
+ * @brief write_json_line writes the progress as one JSON object on one line
+ * @return 0 on success, -1 when the reader is gone
+ */
+static int write_json_line(FILE *output, progress_t *progress, uint64_t *counters, double hash_rate, double copy_rate, double eta, bool is_done) {
+    fprintf(output, "{\"elapsed\":%.3f", now_seconds() - start_time);
+    for (int i=0; i<PROGRESS_COUNTERS; ++i) {
+        fprintf(output, ",\"%s\":%llu", counters_names[i], (unsigned long long) counters[i]);
+    }
+    fprintf(output, ",\"hash_rate\":%.0f,\"copy_rate\":%.0f,", hash_rate, copy_rate);
+    if (eta < 0.0) {
+        fprintf(output, "\"eta\":null");
+    } else {
+        fprintf(output, "\"eta\":%.1f", eta);
+    }
+    fprintf(output, ",\"done\":%s,\"processes\":[", is_done ? "true" : "false");
+    uint32_t slots_count = __atomic_load_n(&progress->slots_count, __ATOMIC_RELAXED);
+    bool is_first = true;
+    for (uint32_t i=0; i<slots_count && i<PROGRESS_SLOTS; ++i) {
+        pid_t pid = __atomic_load_n(&progress->slots[i].pid, __ATOMIC_ACQUIRE);
+        if (pid == 0) {
+            continue;
+        }
+        char file[PROGRESS_NAME_SIZE];
+        copy_slot_file(progress, i, file);
+        fprintf(output, "%s{\"pid\":%d,\"role\":\"%s\",\"file\":", is_first ? "" : ",", (int) pid,
+                progress->slots[i].role == 'm' ? "main" : "analyzer");
+        write_json_string(output, file);
+        fputc('}', output);
+        is_first = false;
+    }
+    fprintf(output, "]}\n");
+    return fflush(output) == 0 ? 0 : -1;
+}
+
+/*!
+ * @brief progress_process_loop is the reporter process function: it renders the progress until the end
+ * Throughputs are smoothed over the intervals, the ETA is the remaining bytes to copy at the copy throughput.
+ * @param parameters is a pointer to the configuration
+ */
+void progress_process_loop(void *parameters) {
+    configuration_t *the_config = (configuration_t *) parameters;
+    progress_t *progress = shared_progress;
+    if (progress == NULL) {
+        return;
+    }
+    // Un lecteur disparu ne doit pas tuer le processus
+    signal(SIGPIPE, SIG_IGN);
+    FILE *output = progress_output != -1 ? fdopen(progress_output, "w") : NULL;
+    pid_t main_pid = getppid();
+
+    uint64_t previous[PROGRESS_COUNTERS] = {0};
+    double hash_rate = 0.0;
+    double copy_rate = 0.0;
+    double last_time = now_seconds();
+    bool is_done = false;
+    while (!is_done) {
+        struct timespec poll = {0, PROGRESS_POLL_NS};
+        nanosleep(&poll, NULL);
+        // Main may have died without finishing the progress
+        is_done = __atomic_load_n(&progress->is_done, __ATOMIC_ACQUIRE) || getppid() != main_pid;
+        double now = now_seconds();
+        if (!is_done && now - last_time < PROGRESS_INTERVAL) {
+            continue;
+        }
+
+        uint64_t counters[PROGRESS_COUNTERS];
+        for (int i=0; i<PROGRESS_COUNTERS; ++i) {
+            counters[i] = __atomic_load_n(&progress->counters[i], __ATOMIC_RELAXED);
+        }
+        double elapsed = now - last_time;
+        hash_rate += PROGRESS_RATE_SMOOTHING * ((counters[PROGRESS_BYTES_HASHED] - previous[PROGRESS_BYTES_HASHED]) / elapsed - hash_rate);
+        copy_rate += PROGRESS_RATE_SMOOTHING * ((counters[PROGRESS_BYTES_COPIED] - previous[PROGRESS_BYTES_COPIED]) / elapsed - copy_rate);
+        memcpy(previous, counters, sizeof(previous));
+        last_time = now;
+
+        double eta = -1.0;
+        if (is_done) {
+            eta = 0.0;
+        } else if (copy_rate > 1.0 && counters[PROGRESS_BYTES_TO_COPY] > counters[PROGRESS_BYTES_COPIED]) {
+            eta = (counters[PROGRESS_BYTES_TO_COPY] - counters[PROGRESS_BYTES_COPIED]) / copy_rate;
+        }
+        if (the_config->progress) {
+            render_line(progress, counters, hash_rate, copy_rate, eta, is_done);
+        }
+        if (output != NULL && write_json_line(output, progress, counters, hash_rate, copy_rate, eta, is_done) == -1) {
+            fclose(output);
+            output = NULL;
+        }
+    }
+    if (output != NULL) {
+        fclose(output);
+    }
+}
+
+/*!
+ * @brief finish_progress tells the reporter that the synchronization is over and waits for its last rendering
+ * @param reporter_pid is the PID of the reporter process, -1 if there is none
+ */
+void finish_progress(pid_t reporter_pid) {
+    if (shared_progress == NULL) {
+        return;
+    }
+    __atomic_store_n(&shared_progress->is_done, 1, __ATOMIC_RELEASE);
+    if (reporter_pid > 0) {
+        waitpid(reporter_pid, NULL, 0);
+    }
+}
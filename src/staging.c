@@ -0,0 +1,191 @@
+#define _GNU_SOURCE // O_TMPFILE and syncfs
+
+#include "staging.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Copies are written to a temporary file in the directory of their destination, then published with a link or a
+// rename, so that a destination file is always either the previous version or the complete new one. Instead of an
+// fsync per file, a batch of staged files is made durable with one syncfs before being published, and a second
+// syncfs makes the new names durable.
+
+static unsigned int temp_counter = 0;
+
+/*!
+ * @brief open_named_temp creates a temporary file next to a destination file
+ * @param temp_path is the buffer receiving the path of the temporary file
+ * @param final_path is the path of the destination file
+ * @param mode is the mode of the temporary file
+ * @return the file descriptor, -1 on failure
+ */
+int open_named_temp(char *temp_path, char *final_path, mode_t mode) {
+    char *slash = strrchr(final_path, '/');
+    int directory_length = slash == NULL ? 0 : (int) (slash - final_path + 1);
+    for (int attempt=0; attempt<16; ++attempt) {
+        if (snprintf(temp_path, PATH_SIZE, "%.*s%s%d.%u", directory_length, final_path, STAGING_PREFIX, getpid(), ++temp_counter) >= PATH_SIZE) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        int fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, mode);
+        if (fd != -1 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/*!
+ * @brief publish_staged_file gives its final name to a staged file, replacing the previous version if any
+ * @param file is the staged file
+ * @return 0 on success, -1 else
+ */
+static int publish_staged_file(staged_file_t *file) {
+    if (file->temp_path[0] == '\0') {
+        // An anonymous file can only be linked to a free name
+        char fd_path[64];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", file->fd);
+        if (linkat(AT_FDCWD, fd_path, AT_FDCWD, file->final_path, AT_SYMLINK_FOLLOW) == 0) {
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+        int probe = open_named_temp(file->temp_path, file->final_path, 0600);
+        if (probe == -1) {
+            return -1;
+        }
+        close(probe);
+        unlink(file->temp_path);
+        if (linkat(AT_FDCWD, fd_path, AT_FDCWD, file->temp_path, AT_SYMLINK_FOLLOW) == -1) {
+            return -1;
+        }
+    }
+    if (rename(file->temp_path, file->final_path) == -1) {
+        unlink(file->temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief init_staging_batch prepares the staging of the copies to a destination
+ * @param batch is a pointer to the batch to initialize
+ * @param destination is the destination directory
+ * @param published is called for each published file
+ * @param context is given to published
+ * @return 0 on success, -1 else
+ */
+int init_staging_batch(staging_batch_t *batch, char *destination, staging_published_t published, void *context) {
+    batch->files = malloc(STAGING_BATCH_SIZE * sizeof(staged_file_t));
+    if (batch->files == NULL) {
+        return -1;
+    }
+    batch->sync_fd = open(destination, O_RDONLY | O_DIRECTORY);
+    if (batch->sync_fd == -1) {
+        free(batch->files);
+        batch->files = NULL;
+        return -1;
+    }
+    batch->count = 0;
+    batch->published = published;
+    batch->context = context;
+    return 0;
+}
+
+/*!
+ * @brief stage_file opens the temporary file of a copy, in the directory of its destination
+ * The file must then be committed (@see commit_staged_file) or discarded (@see discard_staged_file).
+ * @param batch is a pointer to the batch
+ * @param final_path is the path of the destination file
+ * @param mode is the mode of the temporary file
+ * @return the file descriptor to write the copy to, -1 on failure
+ */
+int stage_file(staging_batch_t *batch, char *final_path, mode_t mode) {
+    staged_file_t *file = &batch->files[batch->count];
+    strncpy(file->final_path, final_path, PATH_SIZE - 1);
+    file->final_path[PATH_SIZE - 1] = '\0';
+    file->temp_path[0] = '\0';
+
+    char directory[PATH_SIZE];
+    char *slash = strrchr(file->final_path, '/');
+    if (slash == NULL) {
+        strcpy(directory, ".");
+    } else {
+        snprintf(directory, PATH_SIZE, "%.*s", (int) (slash - file->final_path), file->final_path);
+    }
+    file->fd = open(directory, O_WRONLY | O_TMPFILE, mode);
+    if (file->fd == -1) {
+        // Not supported by every file system
+        file->fd = open_named_temp(file->temp_path, file->final_path, mode);
+    }
+    return file->fd;
+}
+
+/*!
+ * @brief commit_staged_file adds the last staged file to the batch, publishing the batch when it is full
+ * @param batch is a pointer to the batch
+ * @param entry is the copied source entry, given back when the file is published (with the sum of the copy, if any)
+ */
+void commit_staged_file(staging_batch_t *batch, files_list_entry_t *entry) {
+    memcpy(&batch->files[batch->count].entry, entry, sizeof(files_list_entry_t));
+    if (++batch->count == STAGING_BATCH_SIZE) {
+        flush_staging_batch(batch);
+    }
+}
+
+/*!
+ * @brief discard_staged_file drops the last staged file after a failed copy
+ * @param batch is a pointer to the batch
+ */
+void discard_staged_file(staging_batch_t *batch) {
+    staged_file_t *file = &batch->files[batch->count];
+    close(file->fd);
+    if (file->temp_path[0] != '\0') {
+        unlink(file->temp_path);
+    }
+}
+
+/*!
+ * @brief flush_staging_batch makes the staged files durable and publishes them
+ * @param batch is a pointer to the batch
+ */
+void flush_staging_batch(staging_batch_t *batch) {
+    if (batch->files == NULL || batch->count == 0) {
+        return;
+    }
+    // Le contenu doit être sur le disque avant que le nom ne le désigne
+    if (syncfs(batch->sync_fd) == -1) {
+        for (size_t i=0; i<batch->count; ++i) {
+            fsync(batch->files[i].fd);
+        }
+    }
+    for (size_t i=0; i<batch->count; ++i) {
+        staged_file_t *file = &batch->files[i];
+        if (publish_staged_file(file) == -1) {
+            perror("Error publishing copied file");
+        } else if (batch->published != NULL) {
+            batch->published(&file->entry, file->final_path, batch->context);
+        }
+        close(file->fd);
+    }
+    syncfs(batch->sync_fd);
+    batch->count = 0;
+}
+
+/*!
+ * @brief clear_staging_batch publishes the remaining staged files and frees the batch
+ * @param batch is a pointer to the batch
+ */
+void clear_staging_batch(staging_batch_t *batch) {
+    if (batch->files == NULL) {
+        return;
+    }
+    flush_staging_batch(batch);
+    close(batch->sync_fd);
+    free(batch->files);
+    batch->files = NULL;
+}
@@ -3,6 +3,17 @@
 #include <../include/utility.h>
 #include <../include/messages.h>
 #include <../include/file-properties.h>
+#include <../include/external-sort.h>
+#include <../include/moves.h>
+#include <../include/dedup.h>
+#include <../include/throttle.h>
+#include <../include/locality.h>
+#include <../include/journal.h>
+#include <../include/staging.h>
+#include <../include/filter.h>
+#include <../include/agent.h>
+#include <../include/progress.h>
+#include <../include/async-engine.h>
 
 #include <dirent.h>
 #include <string.h>
@@ -13,6 +24,575 @@
 #include <sys/msg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+
+static dedup_index_t dedup_index; // Contents already in the destination, used by copy_entry_to_destination
+static staging_batch_t staging = {.files = NULL}; // Copies waiting to be published (--atomic), unused if files is NULL
+static char copy_buffer[COPY_BUFFER_SIZE]; // Copies made with read and write (several destinations, --hash-copies)
+static char compare_buffer[COPY_BUFFER_SIZE]; // Destination side of the byte compares (@see same_content)
+static external_sorter_t directory_updates; // Directories whose mode is updated after the copies (@see update_metadata)
+static bool has_directory_updates = false;
+
+typedef bool (*entries_stream_next_t)(void *stream, files_list_entry_t *entry);
+
+typedef struct {
+    configuration_t *the_config;
+    moves_index_t *moves; // NULL when moves are not detected
+    locality_batch_t batch; // Files waiting to be copied in physical order (--locality), unused if entries is NULL
+} apply_context_t;
+
+/*!
+ * @brief copy_published records a complete copy, once it is visible at its destination path
+ * @param source_entry is the copied source entry
+ * @param dest_path is the path of the copy
+ * @param context is a pointer to the configuration
+ */
+static void copy_published(files_list_entry_t *source_entry, char *dest_path, void *context) {
+    configuration_t *the_config = (configuration_t *) context;
+    // La somme de la source est celle de la copie, une reprise n'a pas à la recalculer
+    journal_record_copy(dest_path, true, the_config->uses_md5 || the_config->hash_copies ? source_entry->md5sum : NULL);
+    if (the_config->dedup) {
+        register_dedup_entry(&dedup_index, source_entry, dest_path);
+    }
+    // La somme a été calculée pendant la copie (@see copy_hashing)
+    if (the_config->hash_copies) {
+        manifest_record_copy(dest_path, source_entry->md5sum);
+    }
+}
+
+/*!
+ * @brief record_source_sum keeps the sum of a file made without copying its bytes (hard links, reflinks)
+ * Its content is the source one, whose sum is known when MD5 sums are used. It goes to the manifest (--hash-copies)
+ * and to the journal, so that a resumed run does not hash the file again.
+ * @param source_entry is the source entry
+ * @param dest_path is the path of the file in the destination
+ * @param the_config is a pointer to the configuration
+ */
+static void record_source_sum(files_list_entry_t *source_entry, char *dest_path, configuration_t *the_config) {
+    if (!the_config->uses_md5) {
+        return;
+    }
+    journal_record_sum(dest_path, source_entry->md5sum);
+    if (the_config->hash_copies) {
+        manifest_record_copy(dest_path, source_entry->md5sum);
+    }
+}
+
+/*!
+ * @brief apply_difference applies one difference to the destination (or only displays it in dry run mode)
+ * @param source_entry is the source entry missing or different in the destination
+ * @param the_config is a pointer to the configuration
+ * @param moves is a pointer to the moves index, NULL when moves are not detected
+ */
+static void apply_difference(files_list_entry_t *source_entry, configuration_t *the_config, moves_index_t *moves) {
+    set_progress_file(source_entry->path_and_name);
+    if (try_move_entry(moves, source_entry, the_config)) {
+        count_progress(PROGRESS_FILES_COPIED, 1);
+        count_progress(PROGRESS_BYTES_COPIED, source_entry->size);
+        return;
+    }
+    if (the_config->verbose || the_config->dry_run) {
+        printf("%s %s\n", the_config->dry_run ? "Would copy" : "Copying", source_entry->path_and_name);
+    }
+    if (!the_config->dry_run) {
+        copy_entry_to_destination(source_entry, the_config);
+        count_progress(PROGRESS_FILES_COPIED, 1);
+    }
+}
+
+/*!
+ * @brief count_difference adds a difference to the progress, before it is applied
+ * @param source_entry is the source entry missing or different in the destination
+ */
+static void count_difference(files_list_entry_t *source_entry) {
+    count_progress(PROGRESS_FILES_TO_COPY, 1);
+    if (source_entry->entry_type == FICHIER) {
+        count_progress(PROGRESS_BYTES_TO_COPY, source_entry->size);
+    }
+}
+
+/*!
+ * @brief init_apply_context prepares the application of the differences
+ * @param context is a pointer to the context to initialize
+ * @param the_config is a pointer to the configuration
+ * @param moves is a pointer to the moves index, NULL when moves are not detected
+ */
+static void init_apply_context(apply_context_t *context, configuration_t *the_config, moves_index_t *moves) {
+    context->the_config = the_config;
+    context->moves = moves;
+    context->batch.entries = NULL;
+    if (the_config->locality != LOCALITY_NONE) {
+        init_locality_batch(&context->batch, the_config->locality);
+    }
+}
+
+static void apply_batched_difference(files_list_entry_t *source_entry, void *context) {
+    apply_difference(source_entry, ((apply_context_t *) context)->the_config, ((apply_context_t *) context)->moves);
+}
+
+/*!
+ * @brief schedule_difference applies a difference, or batches it to copy files in physical order
+ * Directories are always created at once: they come before their content in the lexical order, so the files of a
+ * batch always have their directory already created.
+ * @param source_entry is the source entry missing or different in the destination
+ * @param context is a pointer to the apply context
+ */
+static void schedule_difference(files_list_entry_t *source_entry, apply_context_t *context) {
+    if (context->batch.entries == NULL || source_entry->entry_type != FICHIER) {
+        apply_difference(source_entry, context->the_config, context->moves);
+        return;
+    }
+    if (locality_batch_add(&context->batch, source_entry)) {
+        locality_batch_flush(&context->batch, apply_batched_difference, context);
+    }
+}
+
+/*!
+ * @brief finish_apply_context applies the batched differences and frees the context
+ * @param context is a pointer to the apply context
+ */
+static void finish_apply_context(apply_context_t *context) {
+    if (context->batch.entries != NULL) {
+        locality_batch_flush(&context->batch, apply_batched_difference, context);
+        clear_locality_batch(&context->batch);
+    }
+}
+
+/*!
+ * @brief reference_directory gives the directory the source is compared to
+ * With --link-dest, the destination is a new snapshot, so the source is compared to the previous snapshot.
+ * @param the_config is a pointer to the configuration
+ * @return the path of the reference directory
+ */
+static char *reference_directory(configuration_t *the_config) {
+    return the_config->link_dest[0] != '\0' ? the_config->link_dest : the_config->destination;
+}
+
+/*!
+ * @brief is_linkable tells if an unchanged source entry can be hard linked from the previous snapshot
+ * Hard links share the mode, so it must be unchanged too.
+ * @param source_entry is the source entry
+ * @param previous_entry is the matching entry of the previous snapshot
+ * @param the_config is a pointer to the configuration
+ * @return true when the entry can be linked, false when it must be copied
+ */
+static bool is_linkable(files_list_entry_t *source_entry, files_list_entry_t *previous_entry, configuration_t *the_config) {
+    return the_config->link_dest[0] != '\0'
+        && source_entry->entry_type == FICHIER
+        && (source_entry->mode & 07777) == (previous_entry->mode & 07777);
+}
+
+/*!
+ * @brief link_from_previous hard links an unchanged file of the previous snapshot into the new one
+ * Falls back to a copy when the link cannot be made (i.e. snapshots on different filesystems). Both snapshots then
+ * share the inode: later synchronizations into the new one copy the file again instead of writing it in place
+ * (@see is_shared_file).
+ * @param source_entry is the source entry, unchanged since the previous snapshot
+ * @param the_config is a pointer to the configuration
+ */
+static void link_from_previous(files_list_entry_t *source_entry, configuration_t *the_config) {
+    char *relative_path = source_entry->path_and_name + path_prefix_length(the_config->source);
+    char previous_path[PATH_SIZE];
+    char dest_path[PATH_SIZE];
+    if (concat_path(previous_path, the_config->link_dest, relative_path) == NULL
+        || concat_path(dest_path, the_config->destination, relative_path) == NULL) {
+        return;
+    }
+    if (the_config->verbose || the_config->dry_run) {
+        printf("%s %s\n", the_config->dry_run ? "Would link" : "Linking", dest_path);
+    }
+    if (the_config->dry_run) {
+        return;
+    }
+    if (link(previous_path, dest_path) == -1) {
+        copy_entry_to_destination(source_entry, the_config);
+    } else {
+        record_source_sum(source_entry, dest_path, the_config);
+    }
+}
+
+/*!
+ * @brief apply_unchanged handles a source entry equal to its counterpart in the reference directory
+ * @param source_entry is the source entry
+ * @param reference_entry is the matching entry in the destination (or in the previous snapshot)
+ * @param context is a pointer to the apply context
+ */
+static void apply_unchanged(files_list_entry_t *source_entry, files_list_entry_t *reference_entry, apply_context_t *context) {
+    if (context->the_config->link_dest[0] == '\0') {
+        return;
+    }
+    if (is_linkable(source_entry, reference_entry, context->the_config)) {
+        link_from_previous(source_entry, context->the_config);
+    } else {
+        schedule_difference(source_entry, context);
+    }
+}
+
+/*!
+ * @brief read_all reads a buffer from a file, unless the file ends before
+ * @return the number of bytes read, less than size at the end of the file, -1 on error
+ */
+static ssize_t read_all(int fd, char *buffer, size_t size) {
+    size_t length = 0;
+    while (length < size) {
+        ssize_t bytes = read(fd, buffer + length, size - length);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes == -1) {
+            return -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        length += bytes;
+    }
+    return length;
+}
+
+/*!
+ * @brief same_content compares two files byte by byte, when their content cannot be compared on MD5 sums
+ * @param source_path is the path of the source file
+ * @param destination_path is the path of the destination file
+ * @return true if both files were read and are equal, false else
+ */
+static bool same_content(char *source_path, char *destination_path) {
+    int source_fd = open(source_path, O_RDONLY);
+    int destination_fd = open(destination_path, O_RDONLY);
+    bool is_same = source_fd != -1 && destination_fd != -1;
+    while (is_same) {
+        ssize_t source_bytes = read_all(source_fd, copy_buffer, sizeof(copy_buffer));
+        ssize_t destination_bytes = read_all(destination_fd, compare_buffer, sizeof(compare_buffer));
+        is_same = source_bytes != -1 && source_bytes == destination_bytes && memcmp(copy_buffer, compare_buffer, source_bytes) == 0;
+        if (source_bytes > 0) {
+            throttle_io(2 * source_bytes, 2 * (1 + source_bytes / THROTTLE_OP_SIZE));
+        }
+        if (source_bytes < (ssize_t) sizeof(copy_buffer)) {
+            break;
+        }
+    }
+    if (source_fd != -1) {
+        close(source_fd);
+    }
+    if (destination_fd != -1) {
+        close(destination_fd);
+    }
+    return is_same;
+}
+
+/*!
+ * @brief is_shared_file tells if a destination file shares its inode with other names
+ * Files hard linked by --dedup, --link-dest or a detected move share their content, mode and mtime: writing any of
+ * them in place would change the other names too.
+ * @param path is the path of the destination file
+ * @return true if the file is a regular file with more than one link, false else
+ */
+static bool is_shared_file(char *path) {
+    struct stat sb;
+    return lstat(path, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_nlink > 1;
+}
+
+/*!
+ * @brief allows_metadata_updates tells if the metadata of destination entries can be updated without a copy
+ * A remote destination is only written through copies, and --link-dest builds a new snapshot where the reference
+ * entries are not.
+ * @param the_config is a pointer to the configuration
+ * @return true if mode and mtime can be updated in place, false else
+ */
+static bool allows_metadata_updates(configuration_t *the_config) {
+    return !is_remote_destination(the_config) && the_config->link_dest[0] == '\0';
+}
+
+/*!
+ * @brief classify_difference tells how a source entry differs from its destination counterpart
+ * A destination file whose copy was interrupted (@see journal_was_in_flight) may look unchanged, with the source
+ * mtime and size, but its content is not trusted. Without MD5 sums, files of the same size with another mtime are
+ * compared byte by byte. When metadata cannot be updated in place, a different mtime leads to a copy. So does a
+ * different mode on a remote destination, it is left to the caller with --link-dest (@see is_linkable). Metadata is only updated in place on files with a single link (@see
+ * is_shared_file), others are copied to break the link.
+ * @param source_entry is the source entry
+ * @param destination_entry is the destination entry with the same relative path
+ * @param the_config is a pointer to the configuration
+ * @return MISMATCH_CONTENT if the entry must be copied, else its metadata differences (MISMATCH_NONE if equal)
+ */
+static mismatch_t classify_difference(files_list_entry_t *source_entry, files_list_entry_t *destination_entry, configuration_t *the_config) {
+    mismatch_t differences = mismatch(source_entry, destination_entry, the_config->uses_md5);
+    if (differences & MISMATCH_CONTENT || journal_was_in_flight(destination_entry->path_and_name)) {
+        return MISMATCH_CONTENT;
+    }
+    if (!allows_metadata_updates(the_config)) {
+        // Une destination distante ne change que par des copies, qui lui donnent aussi le mode de la source
+        bool is_copied = differences & MISMATCH_MTIME || (is_remote_destination(the_config) && differences & MISMATCH_MODE);
+        return is_copied ? MISMATCH_CONTENT : MISMATCH_NONE;
+    }
+    if (differences & MISMATCH_MTIME && !the_config->uses_md5
+        && !same_content(source_entry->path_and_name, destination_entry->path_and_name)) {
+        return MISMATCH_CONTENT;
+    }
+    // Un fichier lié ailleurs est recopié, pour ne pas changer le mode ou la date des autres noms
+    if (differences != MISMATCH_NONE && !(differences & MISMATCH_DIRECTORY) && is_shared_file(destination_entry->path_and_name)) {
+        return MISMATCH_CONTENT;
+    }
+    return differences;
+}
+
+/*!
+ * @brief update_metadata gives a destination entry the mode and mtime of its source, when only those differ
+ * Directories are updated once the copies are done (@see apply_directory_updates), a mode without write permission
+ * would prevent copying their content. Dry run mode only displays the updates.
+ * @param source_entry is the source entry
+ * @param dest_path is the path of the destination entry
+ * @param differences are the differences of both entries, without MISMATCH_CONTENT
+ * @param the_config is a pointer to the configuration
+ */
+static void update_metadata(files_list_entry_t *source_entry, char *dest_path, mismatch_t differences, configuration_t *the_config) {
+    if (differences == MISMATCH_NONE) {
+        return;
+    }
+    if (the_config->verbose || the_config->dry_run) {
+        char *kind = (differences & MISMATCH_MODE) && (differences & MISMATCH_MTIME) ? "mode and mtime" : (differences & MISMATCH_MODE ? "mode" : "mtime");
+        printf("%s %s of %s\n", the_config->dry_run ? "Would update" : "Updating", kind, dest_path);
+    }
+    if (the_config->dry_run) {
+        return;
+    }
+    if (differences & MISMATCH_DIRECTORY) {
+        if (!has_directory_updates && init_external_sorter(&directory_updates, the_config->memory_limit) == -1) {
+            return;
+        }
+        has_directory_updates = true;
+        files_list_entry_t update = *source_entry;
+        strncpy(update.path_and_name, dest_path, sizeof(update.path_and_name) - 1);
+        update.path_and_name[sizeof(update.path_and_name) - 1] = '\0';
+        external_sorter_add(&directory_updates, &update);
+        return;
+    }
+    if (differences & MISMATCH_MODE && fchmodat(AT_FDCWD, dest_path, source_entry->mode & 07777, 0) == -1) {
+        perror("Error updating the mode");
+    }
+    struct timespec times[2] = {{0, UTIME_OMIT}, source_entry->mtime};
+    if (differences & MISMATCH_MTIME) {
+        if (utimensat(AT_FDCWD, dest_path, times, AT_SYMLINK_NOFOLLOW) == -1) {
+            perror("Error updating the mtime");
+        } else {
+            // Le contenu est celui de la source, sa somme reste valable avec la nouvelle date
+            record_source_sum(source_entry, dest_path, the_config);
+        }
+    }
+}
+
+/*!
+ * @brief apply_directory_updates updates the mode of the directories, once their content is copied
+ */
+static void apply_directory_updates(void) {
+    if (!has_directory_updates) {
+        return;
+    }
+    files_list_entry_t update;
+    if (external_sorter_finish(&directory_updates) == 0) {
+        while (external_sorter_next(&directory_updates, &update)) {
+            if (fchmodat(AT_FDCWD, update.path_and_name, update.mode & 07777, 0) == -1) {
+                perror("Error updating the mode");
+            }
+        }
+    }
+    clear_external_sorter(&directory_updates);
+    has_directory_updates = false;
+}
+
+/*!
+ * @brief diff_sorted_streams compares two sorted streams of entries and applies the differences on the fly
+ * Both streams are sorted by path, so a single merge-like pass finds the entries missing in the destination or
+ * mismatching, without keeping more than the current entry of each stream.
+ * @param next_source gets the next entry of the source stream
+ * @param source is the source stream
+ * @param next_destination gets the next entry of the destination stream
+ * @param destination is the destination stream
+ * @param the_config is a pointer to the configuration
+ */
+static void diff_sorted_streams(entries_stream_next_t next_source, void *source, entries_stream_next_t next_destination, void *destination, configuration_t *the_config) {
+    apply_context_t context;
+    init_apply_context(&context, the_config, NULL);
+    size_t source_prefix = path_prefix_length(the_config->source);
+    size_t destination_prefix = path_prefix_length(reference_directory(the_config));
+    files_list_entry_t source_entry;
+    files_list_entry_t destination_entry;
+
+    bool has_destination = next_destination(destination, &destination_entry);
+    while (next_source(source, &source_entry)) {
+        int order = -1;
+        // Skip the destination entries that do not exist in the source
+        while (has_destination && (order = strcmp(source_entry.path_and_name + source_prefix, destination_entry.path_and_name + destination_prefix)) > 0) {
+            has_destination = next_destination(destination, &destination_entry);
+        }
+        if (!has_destination) {
+            order = -1;
+        }
+        mismatch_t differences = order < 0 ? MISMATCH_CONTENT : classify_difference(&source_entry, &destination_entry, the_config);
+        if (differences & MISMATCH_CONTENT) {
+            count_difference(&source_entry);
+            schedule_difference(&source_entry, &context);
+        } else {
+            update_metadata(&source_entry, destination_entry.path_and_name, differences, the_config);
+            apply_unchanged(&source_entry, &destination_entry, &context);
+        }
+        if (order == 0) {
+            has_destination = next_destination(destination, &destination_entry);
+        }
+    }
+    finish_apply_context(&context);
+}
+
+static bool sorter_stream_next(void *stream, files_list_entry_t *entry) {
+    return external_sorter_next((external_sorter_t *) stream, entry);
+}
+
+static bool lister_stream_next_entry(void *stream, files_list_entry_t *entry) {
+    return lister_stream_next((lister_stream_t *) stream, entry);
+}
+
+/*!
+ * @brief add_analyzed_entry is the walk_tree callback of the sequential bounded mode: it analyzes an entry and sorts it
+ * @param path is the path of the entry
+ * @param dir_entry is the directory entry of path
+ * @param context is a pointer to the external sorter
+ */
+static void add_analyzed_entry(char *path, struct dirent *dir_entry, void *context) {
+    files_list_entry_t entry;
+    memset(&entry, 0, sizeof(files_list_entry_t));
+    strncpy(entry.path_and_name, path, sizeof(entry.path_and_name) - 1);
+    if (get_file_stats(&entry) == 0) {
+        external_sorter_add((external_sorter_t *) context, &entry);
+    }
+}
+
+/*!
+ * @brief add_sorted_entry is the analyze_tree_async callback: it sorts an analyzed entry
+ * @param entry is the analyzed entry
+ * @param context is a pointer to the external sorter
+ */
+static void add_sorted_entry(files_list_entry_t *entry, void *context) {
+    external_sorter_add((external_sorter_t *) context, entry);
+}
+
+/*!
+ * @brief analyze_tree_sorted analyzes a tree in the calling process into a sorter, without --parallel
+ * The asynchronous engine is used (@see analyze_tree_async), walk_tree and get_file_stats if it cannot start.
+ * @param sorter is a pointer to the sorter receiving the entries
+ * @param target is the tree to analyze
+ * @param is_destination tells if target is a destination (@see is_internal_entry)
+ * @param the_config is a pointer to the configuration
+ */
+static void analyze_tree_sorted(external_sorter_t *sorter, char *target, bool is_destination, configuration_t *the_config) {
+    if (analyze_tree_async(target, is_destination, the_config, add_sorted_entry, sorter) == -1) {
+        walk_tree(target, is_destination, add_analyzed_entry, sorter);
+    }
+    if (the_config->verbose) {
+        display_filter_report(target);
+    }
+}
+
+/*!
+ * @brief synchronize_bounded synchronizes without building the files lists in memory (--memory-limit)
+ * Each side is produced as a sorted stream (by the listers in parallel mode, by external sorters else) and both
+ * streams are compared on the fly.
+ * @param the_config is a pointer to the configuration
+ * @param p_context is a pointer to the processes context
+ */
+static void synchronize_bounded(configuration_t *the_config, process_context_t *p_context) {
+    if (the_config->is_parallel) {
+        lister_stream_t source_stream;
+        lister_stream_t destination_stream;
+        init_lister_stream(&source_stream, p_context->message_queue_id, MSG_TYPE_TO_SOURCE_LISTER, MSG_TYPE_SOURCE_LIST_TO_MAIN);
+        init_lister_stream(&destination_stream, p_context->message_queue_id, MSG_TYPE_TO_DESTINATION_LISTER, MSG_TYPE_DESTINATION_LIST_TO_MAIN);
+        send_analyze_dir_command(p_context->message_queue_id, MSG_TYPE_TO_SOURCE_LISTER, the_config->source);
+        send_analyze_dir_command(p_context->message_queue_id, MSG_TYPE_TO_DESTINATION_LISTER, reference_directory(the_config));
+        diff_sorted_streams(lister_stream_next_entry, &source_stream, lister_stream_next_entry, &destination_stream, the_config);
+        return;
+    }
+
+    external_sorter_t source_sorter;
+    external_sorter_t destination_sorter;
+    if (init_external_sorter(&source_sorter, the_config->memory_limit) == -1) {
+        return;
+    }
+    if (init_external_sorter(&destination_sorter, the_config->memory_limit) == -1) {
+        clear_external_sorter(&source_sorter);
+        return;
+    }
+    analyze_tree_sorted(&source_sorter, the_config->source, false, the_config);
+    analyze_tree_sorted(&destination_sorter, reference_directory(the_config), true, the_config);
+    if (external_sorter_finish(&source_sorter) == 0 && external_sorter_finish(&destination_sorter) == 0) {
+        diff_sorted_streams(sorter_stream_next, &source_sorter, sorter_stream_next, &destination_sorter, the_config);
+    }
+    clear_external_sorter(&source_sorter);
+    clear_external_sorter(&destination_sorter);
+}
+
+/*!
+ * @brief receive_lister_list builds a list from the stream of a lister
+ * Listers stream their lists already sorted, so entries are appended at the tail
+ * @param list is a pointer to the list to build
+ * @param msg_queue is the id of the MQ used for communication
+ * @param lister_id is the topic of the lister
+ * @param topic_id is the topic on which the lister streams its entries
+ */
+static void receive_lister_list(files_list_t *list, int msg_queue, int lister_id, int topic_id) {
+    lister_stream_t stream;
+    files_list_entry_t entry;
+    init_lister_stream(&stream, msg_queue, lister_id, topic_id);
+    while (lister_stream_next(&stream, &entry)) {
+        files_list_entry_t *new_entry = malloc(sizeof(files_list_entry_t));
+        if (new_entry != NULL) {
+            memcpy(new_entry, &entry, sizeof(files_list_entry_t));
+            add_entry_to_tail(list, new_entry);
+        }
+    }
+}
+
+/*!
+ * @brief make_files_list_async builds a list in the calling process, without --parallel
+ * The entries are analyzed in no particular order, they are sorted before being appended to the list.
+ * @param list is a pointer to the list to build
+ * @param target is the tree to list
+ * @param is_destination tells if target is a destination (@see is_internal_entry)
+ * @param the_config is a pointer to the configuration
+ */
+static void make_files_list_async(files_list_t *list, char *target, bool is_destination, configuration_t *the_config) {
+    external_sorter_t sorter;
+    if (init_external_sorter(&sorter, 0) == -1) {
+        return;
+    }
+    analyze_tree_sorted(&sorter, target, is_destination, the_config);
+    files_list_entry_t entry;
+    if (external_sorter_finish(&sorter) == 0) {
+        while (external_sorter_next(&sorter, &entry)) {
+            files_list_entry_t *new_entry = malloc(sizeof(files_list_entry_t));
+            if (new_entry != NULL) {
+                memcpy(new_entry, &entry, sizeof(files_list_entry_t));
+                add_entry_to_tail(list, new_entry);
+            }
+        }
+    }
+    clear_external_sorter(&sorter);
+}
+
+/*!
+ * @brief make_extra_destination_list lists a further destination, after the first one
+ * In parallel mode, the destination lister is reused.
+ * @param list is a pointer to the list to build
+ * @param target is the destination directory
+ * @param the_config is a pointer to the configuration
+ * @param p_context is a pointer to the processes context
+ */
+static void make_extra_destination_list(files_list_t *list, char *target, configuration_t *the_config, process_context_t *p_context) {
+    if (!the_config->is_parallel) {
+        make_files_list_async(list, target, true, the_config);
+        return;
+    }
+    send_analyze_dir_command(p_context->message_queue_id, MSG_TYPE_TO_DESTINATION_LISTER, target);
+    receive_lister_list(list, p_context->message_queue_id, MSG_TYPE_TO_DESTINATION_LISTER, MSG_TYPE_DESTINATION_LIST_TO_MAIN);
+}
 
 /*!
  * @brief synchronize is the main function for synchronization
@@ -22,61 +602,184 @@
  * @param p_context is a pointer to the processes context
  */
 void synchronize(configuration_t *the_config, process_context_t *p_context) {
-    // Logique de synchronisation
+    if (the_config->atomic && !the_config->dry_run
+        && init_staging_batch(&staging, the_config->destination, copy_published, the_config) == -1) {
+        perror("Unable to stage the copies");
+        return;
+    }
+    if (the_config->memory_limit > 0) {
+        synchronize_bounded(the_config, p_context);
+        clear_staging_batch(&staging);
+        apply_directory_updates();
+        finish_journal(the_config);
+        return;
+    }
 
     // Construire les listes source et destination
-    files_list_t source_list;
-    files_list_t destination_list;
-    make_files_lists_parallel(&source_list, &destination_list, the_config, p_context->msg_queue);
+    files_list_t source_list = {NULL, NULL};
+    files_list_t destination_list = {NULL, NULL};
+    if (is_remote_destination(the_config)) {
+        // The agent lists its destination while the source is listed here
+        if (open_remote_destination(the_config) == -1 || request_remote_list() == -1) {
+            close_remote_destination();
+            return;
+        }
+        if (the_config->is_parallel) {
+            send_analyze_dir_command(p_context->message_queue_id, MSG_TYPE_TO_SOURCE_LISTER, the_config->source);
+            receive_lister_list(&source_list, p_context->message_queue_id, MSG_TYPE_TO_SOURCE_LISTER, MSG_TYPE_SOURCE_LIST_TO_MAIN);
+        } else {
+            make_files_list_async(&source_list, the_config->source, false, the_config);
+        }
+        receive_remote_list(&destination_list, the_config->destination);
+    } else if (the_config->is_parallel) {
+        make_files_lists_parallel(&source_list, &destination_list, the_config, p_context->message_queue_id);
+    } else {
+        // Sans processus, les deux arbres sont analysés par le moteur asynchrone (@see analyze_tree_async)
+        make_files_list_async(&source_list, the_config->source, false, the_config);
+        make_files_list_async(&destination_list, reference_directory(the_config), true, the_config);
+    }
+    // The source is listed and analyzed once, whatever the number of destinations
+    files_list_t extra_lists[DESTINATIONS_MAX - 1];
+    size_t extra_prefixes[DESTINATIONS_MAX - 1];
+    for (uint8_t i=1; i<the_config->destinations_count; ++i) {
+        extra_lists[i - 1] = (files_list_t) {NULL, NULL};
+        extra_prefixes[i - 1] = path_prefix_length(get_destination(the_config, i));
+        make_extra_destination_list(&extra_lists[i - 1], get_destination(the_config, i), the_config, p_context);
+    }
+
+    if (the_config->dedup && init_dedup_index(&dedup_index) == -1) {
+        the_config->dedup = false;
+    }
 
     // Créer une troisième liste avec les différences
-    files_list_t differences_list;
-    build_differences_list(&source_list, &destination_list, &differences_list);
+    // With --link-dest, unchanged files go to a fourth list, linked once the directories are created
+    files_list_t differences_list = {NULL, NULL};
+    files_list_t links_list = {NULL, NULL};
+    size_t differences_counts[DESTINATIONS_MAX] = {0};
+    size_t source_prefix = path_prefix_length(the_config->source);
+    size_t destination_prefix = path_prefix_length(reference_directory(the_config));
+    // Les listes sont triées par chemin : un seul parcours de chacune trouve les correspondances
+    files_list_entry_t *destination_cursor = destination_list.head;
+    files_list_entry_t *extra_cursors[DESTINATIONS_MAX - 1];
+    for (uint8_t i=1; i<the_config->destinations_count; ++i) {
+        extra_cursors[i - 1] = extra_lists[i - 1].head;
+    }
+    for (files_list_entry_t *cursor=source_list.head; cursor!=NULL; cursor=cursor->next) {
+        files_list_entry_t *match = find_next_entry_by_name(&destination_cursor, cursor->path_and_name, destination_prefix, source_prefix);
+        files_list_t *target_list = NULL;
+        // Each destination needing the entry gets its bit, the entry is then read once for all of them
+        cursor->destinations = 0;
+        for (uint8_t i=1; i<the_config->destinations_count; ++i) {
+            files_list_entry_t *extra_match = find_next_entry_by_name(&extra_cursors[i - 1], cursor->path_and_name, extra_prefixes[i - 1], source_prefix);
+            mismatch_t differences = extra_match == NULL ? MISMATCH_CONTENT : classify_difference(cursor, extra_match, the_config);
+            if (differences & MISMATCH_CONTENT) {
+                cursor->destinations |= 1 << i;
+                ++differences_counts[i];
+            } else {
+                update_metadata(cursor, extra_match->path_and_name, differences, the_config);
+            }
+        }
+        // Une entrée dont seuls les droits ou la date diffèrent est mise à jour sans être copiée
+        mismatch_t differences = match == NULL ? MISMATCH_CONTENT : classify_difference(cursor, match, the_config);
+        if (!(differences & MISMATCH_CONTENT)) {
+            update_metadata(cursor, match->path_and_name, differences, the_config);
+        }
+        if (differences & MISMATCH_CONTENT) {
+            target_list = &differences_list;
+            cursor->destinations |= 1;
+            ++differences_counts[0];
+        } else if (cursor->destinations != 0) {
+            target_list = &differences_list;
+        } else if (the_config->link_dest[0] != '\0') {
+            target_list = is_linkable(cursor, match, the_config) ? &links_list : &differences_list;
+        } else if (the_config->dedup) {
+            // Unchanged destination files are already there to deduplicate from
+            register_dedup_entry(&dedup_index, match, match->path_and_name);
+        }
+        if (target_list == &differences_list) {
+            count_difference(cursor);
+        }
+        if (target_list != NULL) {
+            files_list_entry_t *difference = malloc(sizeof(files_list_entry_t));
+            if (difference != NULL) {
+                memcpy(difference, cursor, sizeof(files_list_entry_t));
+                add_entry_to_tail(target_list, difference);
+            }
+        }
+    }
+
+    if (the_config->verbose && the_config->destinations_count > 1) {
+        for (uint8_t i=0; i<the_config->destinations_count; ++i) {
+            printf("Destination %s: %zu differences\n", get_destination(the_config, i), differences_counts[i]);
+        }
+    }
 
     // Appliquer les différences à la destination
-    apply_differences(&destination_list, &differences_list, the_config);
-} 
+    moves_index_t moves;
+    bool uses_moves = the_config->detect_moves && init_moves_index(&moves, &destination_list, &source_list, the_config) == 0;
+    apply_context_t context;
+    init_apply_context(&context, the_config, uses_moves ? &moves : NULL);
+    for (files_list_entry_t *cursor=differences_list.head; cursor!=NULL; cursor=cursor->next) {
+        schedule_difference(cursor, &context);
+    }
+    finish_apply_context(&context);
+    clear_staging_batch(&staging);
+    apply_directory_updates();
+    for (files_list_entry_t *cursor=links_list.head; cursor!=NULL; cursor=cursor->next) {
+        link_from_previous(cursor, the_config);
+    }
+    if (uses_moves) {
+        if (the_config->verbose || the_config->dry_run) {
+            display_moves_report(&moves);
+        }
+        clear_moves_index(&moves);
+    }
+    if (the_config->dedup) {
+        if (the_config->verbose) {
+            display_dedup_report(&dedup_index);
+        }
+        clear_dedup_index(&dedup_index);
+    }
+
+    clear_files_list(&source_list);
+    clear_files_list(&destination_list);
+    clear_files_list(&differences_list);
+    clear_files_list(&links_list);
+    for (uint8_t i=1; i<the_config->destinations_count; ++i) {
+        clear_files_list(&extra_lists[i - 1]);
+    }
+    close_remote_destination();
+    finish_journal(the_config);
+}
 
 /*!
- * @brief mismatch tests if two files with the same name (one in source, one in destination) are equal
+ * @brief mismatch classifies the differences of two entries with the same name (one in source, one in destination)
+ * Files differ in content on their size, and on their MD5 sum when enabled. Without MD5 sums, a different mtime
+ * does not prove the content is equal (@see classify_difference). Directories only differ in content when the other
+ * entry is not a directory, their mtime changes with their content and is not compared.
  * @param lhd a files list entry from the source
  * @param rhd a files list entry from the destination
  * @has_md5 a value to enable or disable MD5 sum check
- * @return true if both files are not equal, false else
+ * @return the differences, MISMATCH_NONE if both entries are equal
  */
-bool mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5) {
-    if (has_md5) {//Regade s'il y a un md5
-        for (int i = 0; i < 16; ++i) {
-            if (lhd->md5sum[i] != rhd->md5sum[i]) {
-                return true;
-            }
-        }
-    }  
-    else {//S'il n'y en a pas : 
-        FILE *file1 = fopen(lhd->path_and_name, "rb");//Ouvre 2 fichiers
-        FILE *file2 = fopen(rhd->path_and_name, "rb");
-
-        if (file1 == NULL || file2 == NULL) {//Vérifie que tous deux ne soient pas vide pour passer à la suite
-            if (file1) fclose(file1);
-            if (file2) fclose(file2);
-            fprintf(stderr, "[MISMATCH TEST] : un des 2 fichier n'a pas pu être ouvert\n");
-            exit(-1);
-        }
-        char char1, char2;
-
-        while ((strcpy(char1, fgetc(file1))) != end_of_file && (strcpy(char2,fgetc(file2))) != end_of_file) {//Détecte s'il y a une différence
-            if (strcmp(char1,char2) != 0) {
-                return true;
-                break; //Si c'est le cas, sort
-            }
-        }
-        if ((char1 == EOF && char2 != EOF) || (char1 != EOF && char2 == EOF)) {//Regarde si la longueur des fichiers est différente
-            return true;
-        }
-        fclose(file1);//Ferme les fichiers
-        fclose(file2);
+mismatch_t mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5) {
+    if (lhd->entry_type != rhd->entry_type) {
+        return MISMATCH_CONTENT;
+    }
+    mismatch_t differences = MISMATCH_NONE;
+    if ((lhd->mode & 07777) != (rhd->mode & 07777)) {
+        differences |= MISMATCH_MODE;
+    }
+    if (lhd->entry_type == DOSSIER) {
+        return differences == MISMATCH_NONE ? MISMATCH_NONE : differences | MISMATCH_DIRECTORY;
     }
-    return false;
+    if (lhd->mtime.tv_sec != rhd->mtime.tv_sec || lhd->mtime.tv_nsec != rhd->mtime.tv_nsec) {
+        differences |= MISMATCH_MTIME;
+    }
+    if (lhd->size != rhd->size || (has_md5 && memcmp(lhd->md5sum, rhd->md5sum, sizeof(lhd->md5sum)) != 0)) {
+        differences |= MISMATCH_CONTENT;
+    }
+    return differences;
 }
 
 void make_files_list(files_list_t *list, char *target_path) {
@@ -95,14 +798,11 @@ void make_files_list(files_list_t *list, char *target_path) {
             continue;
         }
 
-        files_list_entry_t *new_entry = malloc(sizeof(files_list_entry_t));//Mémoire allouée pour une nouvelle entrée de la liste de fichiers
-        if (new_entry == NULL) {
-            perror("Unable to allocate memory for new file entry");//Erreur allocation mémoire
-            continue;
-        }
         //Ajout chemin du fichier à la liste des fichiers
-        if (add_file_entry(list, path) != 0) {
+        if (add_file_entry(list, path) == NULL) {
             perror("Unable to add file entry to list");//Erreur ajout fichier
+        } else {
+            count_progress(PROGRESS_LISTED, 1);
         }
     }
 
@@ -116,51 +816,249 @@ void make_files_list(files_list_t *list, char *target_path) {
  * @param msg_queue is the id of the MQ used for communication
  */
 void make_files_lists_parallel(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config, int msg_queue) {
-    // Tâche parallèle pour construire la liste source
-    pthread_t src_thread;
-    pthread_create(&src_thread, NULL, ^{
-        DIR *dir_src = opendir(the_config->source_path);
-        if (dir_src == NULL) {
-            perror("Error opening source directory");
-            exit(EXIT_FAILURE);
-        }
+    send_analyze_dir_command(msg_queue, MSG_TYPE_TO_SOURCE_LISTER, the_config->source);
+    send_analyze_dir_command(msg_queue, MSG_TYPE_TO_DESTINATION_LISTER, reference_directory(the_config));
+    receive_lister_list(src_list, msg_queue, MSG_TYPE_TO_SOURCE_LISTER, MSG_TYPE_SOURCE_LIST_TO_MAIN);
+    receive_lister_list(dst_list, msg_queue, MSG_TYPE_TO_DESTINATION_LISTER, MSG_TYPE_DESTINATION_LIST_TO_MAIN);
+}
 
-        struct dirent *entry_src;
-        while ((entry_src = readdir(dir_src)) != NULL) {
-            // Construit le chemin complet du fichier source
-            char path_src[PATH_MAX];
-            snprintf(path_src, sizeof(path_src), "%s/%s", the_config->source_path, entry_src->d_name);
+/*!
+ * @brief init_lister_stream initializes the reading of a files list streamed by a lister
+ * @param stream is a pointer to the stream to initialize
+ * @param msg_queue is the id of the MQ used for communication
+ * @param lister_id is the MQ topic of the lister
+ * @param topic_id is the MQ topic on which the lister sends its entries
+ */
+void init_lister_stream(lister_stream_t *stream, int msg_queue, int lister_id, int topic_id) {
+    stream->msg_queue = msg_queue;
+    stream->lister_id = lister_id;
+    stream->topic_id = topic_id;
+    stream->window_count = 0;
+    stream->window_position = 0;
+    stream->is_complete = false;
+}
 
-            // A faire : Ajoutez le chemin du fichier source à src_list
+/*!
+ * @brief lister_stream_next gets the next entry of a lister stream, requesting a new window when needed
+ * A requested window is always received entirely, so that unread entries never stay in the MQ.
+ * @param stream is a pointer to the stream
+ * @param entry is a pointer to the entry to fill
+ * @return true if an entry was produced, false at the end of the list
+ */
+bool lister_stream_next(lister_stream_t *stream, files_list_entry_t *entry) {
+    if (stream->window_position == stream->window_count) {
+        if (stream->is_complete) {
+            return false;
         }
+        stream->window_count = 0;
+        stream->window_position = 0;
+        if (send_entries_request(stream->msg_queue, stream->lister_id) == -1) {
+            stream->is_complete = true;
+            return false;
+        }
+        any_message_t message;
+        while (stream->window_count < STREAM_WINDOW_SIZE) {
+            if (msgrcv(stream->msg_queue, &message, sizeof(any_message_t) - sizeof(long), stream->topic_id, 0) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                stream->is_complete = true;
+                break;
+            }
+            if (message.simple_command.message == COMMAND_CODE_LIST_COMPLETE) {
+                stream->is_complete = true;
+                break;
+            }
+            memcpy(&stream->window[stream->window_count++], &message.list_entry.payload, sizeof(files_list_entry_t));
+        }
+        if (stream->window_count == 0) {
+            return false;
+        }
+    }
+    memcpy(entry, &stream->window[stream->window_position++], sizeof(files_list_entry_t));
+    return true;
+}
 
-        closedir(dir_src);
-    });
+/*!
+ * @brief write_all writes a whole buffer, which write may do in several calls
+ * @return 0 on success, -1 else
+ */
+static int write_all(int fd, char *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return 0;
+}
 
-    // Tâche parallèle pour construire la liste de destination
-    pthread_t dst_thread;
-    pthread_create(&dst_thread, NULL, ^{
-        DIR *dir_dst = opendir(the_config->destination_path);
-        if (dir_dst == NULL) {
-            perror("Error opening destination directory");
-            exit(EXIT_FAILURE);
+/*!
+ * @brief copy_hashing copies a file with read and write, computing the MD5 sum of the written bytes (--hash-copies)
+ * The sum is checked against the source one when MD5 sums are used, then kept in the source entry to be recorded
+ * in the manifest once the copy is published (@see copy_published).
+ * @param source_entry is the copied source entry, receives the sum of the copy
+ * @param source_fd is the source file
+ * @param dest_fd is the destination file
+ * @param the_config is a pointer to the configuration
+ * @return 0 when the whole file was copied and matches its source, -1 else
+ */
+static int copy_hashing(files_list_entry_t *source_entry, int source_fd, int dest_fd, configuration_t *the_config) {
+    md5_context_t *md5 = start_md5();
+    if (md5 == NULL) {
+        fprintf(stderr, "Unable to hash %s\n", source_entry->path_and_name);
+        return -1;
+    }
+    ssize_t bytes_read;
+    while ((bytes_read = read(source_fd, copy_buffer, sizeof(copy_buffer))) != 0) {
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error reading source file");
+            break;
         }
+        if (write_all(dest_fd, copy_buffer, bytes_read) == -1) {
+            perror("Error copying file");
+            break;
+        }
+        update_md5(md5, copy_buffer, bytes_read);
+        throttle_io(2 * bytes_read, 2 * (1 + bytes_read / THROTTLE_OP_SIZE));
+        count_progress(PROGRESS_BYTES_COPIED, bytes_read);
+    }
+    uint8_t md5sum[sizeof(source_entry->md5sum)];
+    if (finish_md5(md5, md5sum) == -1 || bytes_read != 0) {
+        return -1;
+    }
+    if (the_config->uses_md5 && memcmp(md5sum, source_entry->md5sum, sizeof(md5sum)) != 0) {
+        fprintf(stderr, "The copy of %s does not match its source (modified while copying?)\n", source_entry->path_and_name);
+        return -1;
+    }
+    memcpy(source_entry->md5sum, md5sum, sizeof(md5sum));
+    return 0;
+}
 
-        struct dirent *entry_dst;
-        while ((entry_dst = readdir(dir_dst)) != NULL) {
-            // Construit le chemin complet du fichier destination
-            char path_dst[PATH_MAX];
-            snprintf(path_dst, sizeof(path_dst), "%s/%s", the_config->destination_path, entry_dst->d_name);
+/*!
+ * @brief open_destination_file opens a destination file to write a new copy in it
+ * A file sharing its inode with other names (--dedup, --link-dest or a detected move) is unlinked first, so that
+ * the copy does not rewrite the other names too.
+ * @param dest_path is the path of the destination file
+ * @param mode is the mode of the file if it is created
+ * @return the file descriptor, -1 on failure
+ */
+static int open_destination_file(char *dest_path, mode_t mode) {
+    if (is_shared_file(dest_path) && unlink(dest_path) == -1) {
+        return -1;
+    }
+    return open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+}
 
-            // A faire: Ajoutez le chemin du fichier destination à dst_list
+/*!
+ * @brief copy_entry_to_destinations copies an entry to every destination that needs it (@see files_list_entry_t)
+ * The source file is read once, each buffer being written to all the destination files.
+ * @param source_entry is the source entry, with its destinations bits
+ * @param the_config is a pointer to the configuration
+ */
+static void copy_entry_to_destinations(files_list_entry_t *source_entry, configuration_t *the_config) {
+    char dest_paths[DESTINATIONS_MAX][PATH_SIZE];
+    int dest_fds[DESTINATIONS_MAX];
+    uint8_t dest_indexes[DESTINATIONS_MAX];
+    int dest_count = 0;
+    size_t source_prefix = path_prefix_length(the_config->source);
+    for (uint8_t i=0; i<the_config->destinations_count; ++i) {
+        if ((source_entry->destinations & (1 << i)) == 0) {
+            continue;
+        }
+        char *dest_path = dest_paths[dest_count];
+        if (concat_path(dest_path, get_destination(the_config, i), source_entry->path_and_name + source_prefix) == NULL) {
+            fprintf(stderr, "Destination path too long for %s\n", source_entry->path_and_name);
+            continue;
+        }
+        if (source_entry->entry_type == DOSSIER) {
+            if (mkdir(dest_path, source_entry->mode & 07777) != 0 && errno != EEXIST) {
+                perror("Error creating directory");
+            }
+            continue;
         }
+        journal_record_copy(dest_path, false, NULL);
+        dest_fds[dest_count] = open_destination_file(dest_path, source_entry->mode & 07777);
+        if (dest_fds[dest_count] == -1) {
+            perror("Error opening destination file");
+            continue;
+        }
+        if (the_config->verbose) {
+            printf("  -> %s\n", dest_path);
+        }
+        dest_indexes[dest_count++] = i;
+    }
+    if (dest_count == 0) {
+        return;
+    }
 
-        closedir(dir_dst);
-    });
+    int source_fd = open(source_entry->path_and_name, O_RDONLY);
+    if (source_fd == -1) {
+        perror("Error opening source file");
+    }
+    // Une destination en erreur est abandonnée, les autres continuent
+    bool is_complete[DESTINATIONS_MAX];
+    for (int i=0; i<dest_count; ++i) {
+        is_complete[i] = source_fd != -1;
+    }
+    // Avec --hash-copies, chaque tampon n'est haché qu'une fois pour toutes les destinations
+    md5_context_t *md5 = source_fd != -1 && the_config->hash_copies ? start_md5() : NULL;
+    ssize_t bytes_read = 0;
+    while (source_fd != -1 && (bytes_read = read(source_fd, copy_buffer, sizeof(copy_buffer))) != 0) {
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error reading source file");
+            break;
+        }
+        throttle_io(bytes_read, 1 + bytes_read / THROTTLE_OP_SIZE);
+        if (md5 != NULL) {
+            update_md5(md5, copy_buffer, bytes_read);
+        }
+        for (int i=0; i<dest_count; ++i) {
+            if (is_complete[i] && write_all(dest_fds[i], copy_buffer, bytes_read) == -1) {
+                perror("Error copying file");
+                is_complete[i] = false;
+            }
+        }
+        throttle_io(dest_count * bytes_read, dest_count * (1 + bytes_read / THROTTLE_OP_SIZE));
+        count_progress(PROGRESS_BYTES_COPIED, bytes_read);
+    }
 
-    // Attend que les tâches parallèles se terminent
-    pthread_join(src_thread, NULL);
-    pthread_join(dst_thread, NULL);
+    uint8_t md5sum[sizeof(source_entry->md5sum)];
+    bool is_hashed = md5 != NULL && finish_md5(md5, md5sum) == 0 && bytes_read == 0;
+    if (is_hashed && the_config->uses_md5 && memcmp(md5sum, source_entry->md5sum, sizeof(md5sum)) != 0) {
+        fprintf(stderr, "The copy of %s does not match its source (modified while copying?)\n", source_entry->path_and_name);
+        bytes_read = -1;
+    }
+
+    // Conserve les droits et la date de modification de la source
+    // Le manifeste est celui de la première destination, les autres sont hachées au prochain passage
+    struct timespec times[2] = {{0, UTIME_OMIT}, source_entry->mtime};
+    uint8_t *copy_sum = is_hashed ? md5sum : (the_config->uses_md5 ? source_entry->md5sum : NULL);
+    for (int i=0; i<dest_count; ++i) {
+        fchmod(dest_fds[i], source_entry->mode & 07777);
+        futimens(dest_fds[i], times);
+        close(dest_fds[i]);
+        if (is_complete[i] && bytes_read == 0) {
+            journal_record_copy(dest_paths[i], true, copy_sum);
+            if (is_hashed && dest_indexes[i] == 0) {
+                manifest_record_copy(dest_paths[i], md5sum);
+            }
+        }
+    }
+    if (source_fd != -1) {
+        close(source_fd);
+    }
 }
 
 /*!
@@ -176,48 +1074,104 @@ void copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t
         return;
     }
 
-    // Construit le chemin complet du fichier source
-    char source_path[PATH_MAX];
-    snprintf(source_path, sizeof(source_path), "%s/%s", the_config->source_path, source_entry->path);
+    if (the_config->destinations_count > 1) {
+        copy_entry_to_destinations(source_entry, the_config);
+        return;
+    }
+    if (is_remote_destination(the_config)) {
+        if (send_remote_copy(source_entry, path_prefix_length(the_config->source)) == -1) {
+            fprintf(stderr, "Unable to send %s to the agent\n", source_entry->path_and_name);
+        } else if (source_entry->entry_type == FICHIER) {
+            count_progress(PROGRESS_BYTES_COPIED, source_entry->size);
+        }
+        return;
+    }
 
     // Construit le chemin complet du fichier destination
-    char dest_path[PATH_MAX];
-    snprintf(dest_path, sizeof(dest_path), "%s/%s", the_config->destination_path, source_entry->path);
+    char dest_path[PATH_SIZE];
+    if (concat_path(dest_path, the_config->destination, source_entry->path_and_name + path_prefix_length(the_config->source)) == NULL) {
+        fprintf(stderr, "Destination path too long for %s\n", source_entry->path_and_name);
+        return;
+    }
 
     // Vérifie si l'entrée est un répertoire
-    if (source_entry->is_directory) {
+    if (source_entry->entry_type == DOSSIER) {
         // Crée le répertoire de destination
-        if (mkdir(dest_path, the_config->dir_mode) != 0) {
+        if (mkdir(dest_path, source_entry->mode & 07777) != 0 && errno != EEXIST) {
             perror("Error creating directory");
-            return;
-        }
-    } else {
-        // Ouvre le fichier source
-        int source_fd = open(source_path, O_RDONLY);
-        if (source_fd == -1) {
-            perror("Error opening source file");
-            return;
         }
+        return;
+    }
 
-        // Crée ou ouvre le fichier de destination
-        int dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, the_config->file_mode);
-        if (dest_fd == -1) {
-            perror("Error opening destination file");
-            close(source_fd);
-            return;
-        }
+    // Un contenu déjà présent dans la destination n'est pas recopié
+    if (the_config->dedup && dedup_entry(&dedup_index, source_entry, dest_path, the_config)) {
+        record_source_sum(source_entry, dest_path, the_config);
+        count_progress(PROGRESS_BYTES_COPIED, source_entry->size);
+        return;
+    }
+
+    // Ouvre le fichier source
+    int source_fd = open(source_entry->path_and_name, O_RDONLY);
+    if (source_fd == -1) {
+        perror("Error opening source file");
+        return;
+    }
 
-        // Utilise sendfile pour copier le contenu du fichier
-        ssize_t bytes_copied = sendfile(dest_fd, source_fd, NULL, source_entry->size);
+    // Crée ou ouvre le fichier de destination, la copie reste en cours dans le journal jusqu'à sa fin
+    // Avec --atomic, la copie est écrite dans un fichier temporaire publié par lot (@see flush_staging_batch)
+    journal_record_copy(dest_path, false, NULL);
+    bool is_staged = staging.files != NULL;
+    int dest_fd = is_staged ? stage_file(&staging, dest_path, source_entry->mode & 07777) : open_destination_file(dest_path, source_entry->mode & 07777);
+    if (dest_fd == -1) {
+        perror("Error opening destination file");
+        close(source_fd);
+        return;
+    }
 
-        // Vérifie si la copie a réussi
-        if (bytes_copied == -1) {
-            perror("Error copying file");
+    // Utilise sendfile pour copier le contenu du fichier (il peut copier moins que demandé)
+    // Avec une limite d'I/O, la copie est découpée pour que le débit reste régulier
+    // Avec --hash-copies, les octets passent par un tampon pour être hachés (@see copy_hashing)
+    bool is_complete;
+    if (the_config->hash_copies) {
+        is_complete = copy_hashing(source_entry, source_fd, dest_fd, the_config) == 0;
+    } else {
+        off_t offset = 0;
+        size_t chunk_size = is_io_throttled() ? 16 * THROTTLE_OP_SIZE : source_entry->size;
+        while (offset < (off_t) source_entry->size) {
+            size_t remaining = source_entry->size - offset;
+            ssize_t bytes_copied = sendfile(dest_fd, source_fd, &offset, remaining < chunk_size ? remaining : chunk_size);
+            if (bytes_copied == -1) {
+                perror("Error copying file");
+                break;
+            }
+            if (bytes_copied == 0) {
+                break;
+            }
+            // Lecture et écriture
+            throttle_io(2 * bytes_copied, 2 * (1 + bytes_copied / THROTTLE_OP_SIZE));
+            count_progress(PROGRESS_BYTES_COPIED, bytes_copied);
         }
+        is_complete = offset == (off_t) source_entry->size;
+    }
 
-        // Ferme les fichier
-        close(source_fd);
-        close(dest_fd);
+    // Conserve les droits et la date de modification de la source
+    struct timespec times[2] = {{0, UTIME_OMIT}, source_entry->mtime};
+    fchmod(dest_fd, source_entry->mode & 07777);
+    futimens(dest_fd, times);
+
+    // Ferme les fichier
+    close(source_fd);
+    if (is_staged) {
+        if (is_complete) {
+            commit_staged_file(&staging, source_entry);
+        } else {
+            discard_staged_file(&staging);
+        }
+        return;
+    }
+    close(dest_fd);
+    if (is_complete) {
+        copy_published(source_entry, dest_path, the_config);
     }
 }
 
@@ -257,6 +1211,71 @@ void make_list(files_list_t *list, char *target) {
     closedir(dir);
 }
 
+/*!
+ * @brief walk_subtree is the recursion of walk_tree
+ * @param target is the directory to walk
+ * @param root_length is the length of the prefix of the root in the paths (@see path_prefix_length)
+ * @param is_destination tells if the tree is a destination (@see is_internal_entry)
+ * @param callback is called on every entry
+ * @param context is given to the callback
+ */
+static void walk_subtree(char *target, size_t root_length, bool is_destination, walk_callback_t callback, void *context) {
+    DIR *dir = open_dir(target);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = get_next_entry(dir)) != NULL) {
+        char path[PATH_SIZE];
+        if (concat_path(path, target, entry->d_name) == NULL) {
+            continue;
+        }
+        // Les entrées exclues ne sont ni analysées, ni parcourues (--exclude, --include)
+        if (is_internal_entry(path + root_length, is_destination) || filter_prunes(path + root_length, dirfd(dir), entry)) {
+            continue;
+        }
+        count_progress(PROGRESS_LISTED, 1);
+        callback(path, entry, context);
+        if (entry->d_type == DT_DIR) {
+            walk_subtree(path, root_length, is_destination, callback, context);
+        }
+    }
+
+    closedir(dir);
+}
+
+/*!
+ * @brief walk_tree calls a function on every relevant entry of a tree (it recurses in directories)
+ * Unlike make_list, it doesn't build any list, so that the caller decides what is kept in memory
+ * @param target is the target dir whose content must be walked
+ * @param is_destination tells if target is a destination, whose internal files are skipped (@see is_internal_entry)
+ * @param callback is the function called with the full path and the directory entry of each entry
+ * @param context is passed as is to callback
+ */
+void walk_tree(char *target, bool is_destination, walk_callback_t callback, void *context) {
+    walk_subtree(target, path_prefix_length(target), is_destination, callback, context);
+}
+
+/*!
+ * @brief is_internal_entry tells if an entry is a file of lp25-backup itself, which is not synchronized
+ * The journal and the manifest live at the root of the destination (@see init_journal, manifest_record_copy), the
+ * temporary copies next to their destination file in any directory (@see open_named_temp). The source is never
+ * written by lp25-backup, so its entries are all synchronized, whatever their name.
+ * @param relative_path is the path of the entry relative to the root of its tree
+ * @param is_destination tells if the tree is a destination
+ * @return true if the entry must be skipped, false else
+ */
+bool is_internal_entry(char *relative_path, bool is_destination) {
+    if (!is_destination) {
+        return false;
+    }
+    char *name = strrchr(relative_path, '/');
+    name = name == NULL ? relative_path : name + 1;
+    return strcmp(relative_path, JOURNAL_FILE_NAME) == 0 || strcmp(relative_path, MANIFEST_FILE_NAME) == 0
+        || strncmp(name, STAGING_PREFIX, strlen(STAGING_PREFIX)) == 0;
+}
+
 /*!
  * @brief open_dir opens a dir
  * @param path is the path to the dir
@@ -0,0 +1,214 @@
+#include "throttle.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_LOWEST_BE_LEVEL 7
+
+// The throttle is mapped in anonymous shared memory before the processes are forked, so that all the analyzers
+// and the copy share the same buckets. Buckets are GCRA ones: each I/O atomically pushes the theoretical arrival
+// time by its cost, and waits when it gets more than THROTTLE_BURST_NS ahead of now. No lock is needed.
+
+static io_throttle_t *shared_throttle = NULL;
+
+/*!
+ * @brief now_ns gives a monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*!
+ * @brief read_device_counters reads the completed I/Os and the time spent on them from sysfs
+ * @param device is the device to read
+ * @param counters is a pointer to the counters to fill
+ * @return 0 on success, -1 when the device has no statistics (i.e. virtual filesystems)
+ */
+static int read_device_counters(dev_t device, device_counters_t *counters) {
+    char stat_path[64];
+    snprintf(stat_path, sizeof(stat_path), "/sys/dev/block/%u:%u/stat", major(device), minor(device));
+    FILE *stat_file = fopen(stat_path, "r");
+    if (stat_file == NULL) {
+        return -1;
+    }
+    unsigned long long read_ios, read_merges, read_sectors, read_ticks;
+    unsigned long long write_ios, write_merges, write_sectors, write_ticks;
+    int fields = fscanf(stat_file, "%llu %llu %llu %llu %llu %llu %llu %llu", &read_ios, &read_merges, &read_sectors,
+                        &read_ticks, &write_ios, &write_merges, &write_sectors, &write_ticks);
+    fclose(stat_file);
+    if (fields != 8) {
+        return -1;
+    }
+    counters->ios = read_ios + write_ios;
+    counters->ticks_ms = read_ticks + write_ticks;
+    return 0;
+}
+
+/*!
+ * @brief check_devices_latency adapts the backoff factor to the latency of the source and destination devices
+ * The baseline of a device follows its lowest latencies: it drops to a lower sample at once, and moves slowly toward
+ * higher ones (an EWMA), so that it adapts when the device or the workload changes. When the average latency gets
+ * above twice the baseline, the limits are halved. They recover by 25% at each check otherwise. The sysfs busy time
+ * has a 1ms resolution, so checks where a device was busy less than THROTTLE_MIN_BUSY_MS are too coarse to tell a
+ * congestion, whatever the latency of the device.
+ * @param throttle is a pointer to the shared throttle
+ */
+static void check_devices_latency(io_throttle_t *throttle) {
+    bool is_congested = false;
+    for (int i=0; i<THROTTLE_DEVICES; ++i) {
+        device_counters_t counters;
+        if (read_device_counters(throttle->devices[i], &counters) == -1) {
+            continue;
+        }
+        uint64_t ios = counters.ios - throttle->counters[i].ios;
+        uint64_t ticks_ms = counters.ticks_ms - throttle->counters[i].ticks_ms;
+        throttle->counters[i] = counters;
+        if (ios == 0 || ticks_ms == 0) {
+            continue;
+        }
+        double latency_ms = (double) ticks_ms / ios;
+        double *baseline_ms = &throttle->baseline_latency_ms[i];
+        if (*baseline_ms == 0.0 || latency_ms < *baseline_ms) {
+            *baseline_ms = latency_ms;
+        } else {
+            if (latency_ms > 2.0 * *baseline_ms && ticks_ms >= THROTTLE_MIN_BUSY_MS) {
+                is_congested = true;
+            }
+            *baseline_ms += THROTTLE_BASELINE_WEIGHT * (latency_ms - *baseline_ms);
+        }
+    }
+
+    uint32_t factor = __atomic_load_n(&throttle->factor_permille, __ATOMIC_RELAXED);
+    factor = is_congested ? factor / 2 : factor + factor / 4;
+    if (factor < THROTTLE_MIN_FACTOR) {
+        factor = THROTTLE_MIN_FACTOR;
+    }
+    if (factor > 1000) {
+        factor = 1000;
+    }
+    __atomic_store_n(&throttle->factor_permille, factor, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief reserve pushes the theoretical arrival time of a bucket and waits if it is too far ahead
+ * @param tat_ns is a pointer to the shared theoretical arrival time
+ * @param cost_ns is the time the I/O takes at the allowed rate
+ */
+static void reserve(uint64_t *tat_ns, uint64_t cost_ns) {
+    uint64_t now = now_ns();
+    uint64_t tat = __atomic_load_n(tat_ns, __ATOMIC_RELAXED);
+    uint64_t new_tat;
+    do {
+        new_tat = (tat > now ? tat : now) + cost_ns;
+    } while (!__atomic_compare_exchange_n(tat_ns, &tat, new_tat, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (new_tat > now + THROTTLE_BURST_NS) {
+        uint64_t wait_ns = new_tat - now - THROTTLE_BURST_NS;
+        struct timespec wait = {wait_ns / 1000000000ULL, wait_ns % 1000000000ULL};
+        nanosleep(&wait, NULL);
+    }
+}
+
+/*!
+ * @brief init_io_throttle creates the shared throttle when --bwlimit or --iops-limit is used
+ * Must be called before forking the processes.
+ * @param the_config is a pointer to the configuration
+ * @return 0 on success (or when nothing is limited), -1 else
+ */
+int init_io_throttle(configuration_t *the_config) {
+    if (the_config->bwlimit == 0 && the_config->iops_limit == 0) {
+        return 0;
+    }
+    io_throttle_t *throttle = mmap(NULL, sizeof(io_throttle_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (throttle == MAP_FAILED) {
+        perror("Unable to map the I/O throttle");
+        return -1;
+    }
+    throttle->bytes_per_second = the_config->bwlimit;
+    throttle->ops_per_second = the_config->iops_limit;
+    throttle->bytes_tat_ns = 0;
+    throttle->ops_tat_ns = 0;
+    throttle->factor_permille = 1000;
+    throttle->last_check_ns = now_ns();
+
+    char *roots[THROTTLE_DEVICES] = {the_config->source, the_config->destination};
+    for (int i=0; i<THROTTLE_DEVICES; ++i) {
+        struct stat sb;
+        throttle->devices[i] = stat(roots[i], &sb) == 0 ? sb.st_dev : 0;
+        throttle->baseline_latency_ms[i] = 0.0;
+        if (read_device_counters(throttle->devices[i], &throttle->counters[i]) == -1) {
+            throttle->counters[i].ios = 0;
+            throttle->counters[i].ticks_ms = 0;
+        }
+    }
+    shared_throttle = throttle;
+    return 0;
+}
+
+/*!
+ * @brief apply_io_class sets the I/O scheduling class of the calling process
+ * @param io_class is the class to set, IO_CLASS_DEFAULT keeps the inherited one
+ * @return the result of ioprio_set, 0 when nothing is changed
+ */
+int apply_io_class(io_class_t io_class) {
+    int priority;
+    switch (io_class) {
+        case IO_CLASS_IDLE:
+            priority = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+            break;
+        case IO_CLASS_BEST_EFFORT:
+            priority = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_LOWEST_BE_LEVEL;
+            break;
+        default:
+            return 0;
+    }
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, priority);
+}
+
+/*!
+ * @brief throttle_io accounts an I/O in the shared buckets, waiting as long as needed to respect the limits
+ * Does nothing when no limit is set.
+ * @param bytes is the number of bytes read or written
+ * @param ops is the number of I/O operations
+ */
+void throttle_io(uint64_t bytes, uint32_t ops) {
+    io_throttle_t *throttle = shared_throttle;
+    if (throttle == NULL) {
+        return;
+    }
+
+    // One process at a time checks the devices latency
+    uint64_t now = now_ns();
+    uint64_t last_check = __atomic_load_n(&throttle->last_check_ns, __ATOMIC_RELAXED);
+    if (now - last_check > THROTTLE_CHECK_NS
+        && __atomic_compare_exchange_n(&throttle->last_check_ns, &last_check, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        check_devices_latency(throttle);
+    }
+
+    uint64_t factor = __atomic_load_n(&throttle->factor_permille, __ATOMIC_RELAXED);
+    if (throttle->bytes_per_second > 0 && bytes > 0) {
+        reserve(&throttle->bytes_tat_ns, bytes * 1000000000ULL / (throttle->bytes_per_second * factor / 1000 + 1));
+    }
+    if (throttle->ops_per_second > 0 && ops > 0) {
+        reserve(&throttle->ops_tat_ns, ops * 1000000000ULL / (throttle->ops_per_second * factor / 1000 + 1));
+    }
+}
+
+/*!
+ * @brief is_io_throttled tells if I/Os are limited, so that copies are split into smaller chunks
+ * @return true when a limit is set
+ */
+bool is_io_throttled(void) {
+    return shared_throttle != NULL;
+}
@@ -1,5 +1,8 @@
-#include <../include/defines.h>
+#include <../include/utility.h>
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
 
 /*!
  * @brief concat_path concatenates suffix to prefix into result
@@ -30,3 +33,70 @@ char *concat_path(char *result, char *prefix, char *suffix) {
 
     return result;
 }
+
+/*!
+ * @brief path_prefix_length gives the offset of the relative part of the paths built from root with concat_path
+ * @param root the directory used as prefix (source or destination)
+ * @return the length of root, plus the separator added by concat_path if any
+ */
+size_t path_prefix_length(char *root) {
+    size_t root_len = strlen(root);
+    if (root_len > 0 && root[root_len - 1] == '/') {
+        return root_len;
+    }
+    return root_len + 1;
+}
+
+/*!
+ * @brief parse_size converts a size given on the command line into bytes
+ * Accepted suffixes are K, M, G and T (powers of 1024), case insensitive
+ * @param text the string to parse, i.e. "512M"
+ * @param size a pointer to the result
+ * @return 0 if the size is valid, -1 else
+ */
+int parse_size(char *text, uint64_t *size) {
+    if (text == NULL || size == NULL) {
+        return -1;
+    }
+    // strtoull accepts a sign and would turn "-1" into a huge size
+    char *digits = text;
+    while (isspace((unsigned char) *digits)) {
+        ++digits;
+    }
+    if (*digits == '-') {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) {
+        return -1;
+    }
+
+    uint64_t multiplier = 1;
+    switch (*end) {
+        case 'T': case 't':
+            multiplier <<= 10;
+            // fall through
+        case 'G': case 'g':
+            multiplier <<= 10;
+            // fall through
+        case 'M': case 'm':
+            multiplier <<= 10;
+            // fall through
+        case 'K': case 'k':
+            multiplier <<= 10;
+            ++end;
+            break;
+        case '\0':
+            break;
+        default:
+            return -1;
+    }
+    if (*end != '\0' || value > UINT64_MAX / multiplier) {
+        return -1;
+    }
+
+    *size = value * multiplier;
+    return 0;
+}
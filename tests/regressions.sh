@@ -0,0 +1,166 @@
+#!/bin/sh
+# Regression tests of lp25-backup, run by `make check`
+# Usage: tests/regressions.sh [path of lp25-backup]
+
+BINARY=$(realpath "${1:-./lp25-backup}")
+WORK_DIR=$(mktemp -d)
+FAILURES=0
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# Each test gets an empty source and destination
+setup() {
+    rm -rf "$WORK_DIR/src" "$WORK_DIR/dst"
+    mkdir -p "$WORK_DIR/src" "$WORK_DIR/dst"
+    cd "$WORK_DIR" || exit 1
+}
+
+run_backup() {
+    "$BINARY" --no-parallel "$@" > "$WORK_DIR/output.txt" 2>&1
+}
+
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "PASS $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# Une mise à jour d'un fichier dédupliqué ne doit pas réécrire les autres noms du même contenu
+test_dedup_update() {
+    setup
+    echo shared > src/a
+    echo shared > src/b
+    touch -r src/a src/b
+    run_backup --dedup src dst
+    echo changed > src/a
+    run_backup --dedup src dst
+    check "dedup: updated file" "$(cat dst/a)" "changed"
+    check "dedup: other name kept" "$(cat dst/b)" "shared"
+}
+
+# Un changement de mode ou de date ne doit pas être appliqué sur place à un inode partagé
+test_dedup_metadata() {
+    setup
+    echo shared > src/a
+    echo shared > src/b
+    chmod 644 src/a src/b
+    touch -r src/a src/b
+    run_backup --dedup src dst
+    chmod 600 src/a
+    touch -d '2001-01-01' src/a
+    run_backup --dedup src dst
+    check "dedup: updated mode" "$(stat -c %a dst/a)" "600"
+    check "dedup: other mode kept" "$(stat -c %a dst/b)" "644"
+    check "dedup: other mtime kept" "$(stat -c %Y dst/b)" "$(stat -c %Y src/b)"
+}
+
+# Une synchronisation dans un instantané ne doit pas modifier l'instantané précédent
+test_link_dest_snapshot() {
+    setup
+    mkdir -p snapshot.1 snapshot.2
+    echo first > src/a
+    echo second > src/b
+    chmod 644 src/a src/b
+    run_backup src snapshot.1
+    run_backup --link-dest="$WORK_DIR/snapshot.1" src snapshot.2
+    check "link-dest: unchanged file linked" "$(stat -c %h snapshot.1/a)" "2"
+    echo changed > src/a
+    chmod 600 src/b
+    run_backup src snapshot.2
+    check "link-dest: snapshot updated" "$(cat snapshot.2/a)" "changed"
+    check "link-dest: previous content kept" "$(cat snapshot.1/a)" "first"
+    check "link-dest: snapshot mode updated" "$(stat -c %a snapshot.2/b)" "600"
+    check "link-dest: previous mode kept" "$(stat -c %a snapshot.1/b)" "644"
+}
+
+# Un fichier déplacé n'est lié à un second nom que si leurs métadonnées sont les mêmes
+test_moves_metadata() {
+    setup
+    echo data > dst/old
+    echo data > src/a
+    echo data > src/b
+    chmod 644 src/a
+    chmod 600 src/b
+    run_backup --detect-moves src dst
+    check "moves: moved file mode" "$(stat -c %a dst/a)" "644"
+    check "moves: other file mode" "$(stat -c %a dst/b)" "600"
+    check "moves: not linked" "$(stat -c %h dst/a)" "1"
+}
+
+# Le * d'un motif de suffixe peut être vide : *.tmp exclut aussi .tmp
+test_exclude_suffix() {
+    setup
+    echo kept > src/a
+    echo excluded > src/.tmp
+    echo excluded > src/b.tmp
+    run_backup --exclude '*.tmp' src dst
+    check "exclude: suffix" "$(ls -A dst)" "a"
+}
+
+# Les processus fils ne doivent pas réafficher la sortie du processus principal
+test_parallel_output() {
+    setup
+    echo data > src/a
+    "$BINARY" -n 4 src dst > output.txt 2>&1
+    check "parallel: output printed once" "$(grep -c 'Setting configuration' output.txt)" "1"
+}
+
+# Une taille négative est refusée, elle ne doit pas devenir une limite immense
+test_negative_size() {
+    setup
+    if run_backup --memory-limit=-1 src dst; then status=accepted; else status=rejected; fi
+    check "parse_size: negative size" "$status" "rejected"
+}
+
+# Un agent ne sert qu'une destination : les autres ne doivent pas être ignorées en silence
+test_remote_destinations() {
+    setup
+    mkdir -p dst2
+    if run_backup --remote "$BINARY --agent $WORK_DIR/dst" src dst dst2; then status=accepted; else status=rejected; fi
+    check "remote: extra destinations" "$status" "rejected"
+}
+
+# Les fichiers de lp25-backup ne sont ignorés qu'à leur place dans la destination
+test_internal_names() {
+    setup
+    mkdir -p src/d
+    echo user > src/d/.lp25-journal
+    run_backup --journal src dst
+    check "internal names: journal name in a subdirectory" "$(cat dst/d/.lp25-journal 2>/dev/null)" "user"
+    echo user > src/d/.lp25-tmp.1.1
+    run_backup --atomic src dst
+    check "internal names: temporary name in the source" "$(cat dst/d/.lp25-tmp.1.1 2>/dev/null)" "user"
+    echo user > src/d/.lp25-manifest
+    run_backup --hash-copies src dst
+    check "internal names: manifest name in a subdirectory" "$(cat dst/d/.lp25-manifest 2>/dev/null)" "user"
+}
+
+# Un changement de mode doit atteindre une destination distante, qui n'a pas de mise à jour en place
+test_remote_mode() {
+    setup
+    mkdir -p src/d
+    echo data > src/d/a
+    chmod 644 src/d/a
+    chmod 755 src/d
+    run_backup --remote "$BINARY --agent $WORK_DIR/dst" src dst
+    chmod 600 src/d/a
+    chmod 700 src/d
+    run_backup --remote "$BINARY --agent $WORK_DIR/dst" src dst
+    check "remote: file mode" "$(stat -c %a dst/d/a)" "600"
+    check "remote: directory mode" "$(stat -c %a dst/d)" "700"
+}
+
+test_dedup_update
+test_dedup_metadata
+test_link_dest_snapshot
+test_moves_metadata
+test_exclude_suffix
+test_parallel_output
+test_negative_size
+test_remote_destinations
+test_internal_names
+test_remote_mode
+
+[ "$FAILURES" -eq 0 ]